@@ -7,19 +7,45 @@
 #include "profiler_pal.h"
 #include <string>
 
+// Synthetic names of the dynamic methods compiled so far, by FunctionID.
+static std::mutex dynamicMethodNamesLock;
+static std::unordered_map<FunctionID, UINT32> dynamicMethodOrdinals;
+
+static void PrintEvent(const char* event, FunctionID functionId)
+{
+    UINT32 ordinal = 0;
+    {
+        std::lock_guard<std::mutex> guard(dynamicMethodNamesLock);
+        auto found = dynamicMethodOrdinals.find(functionId);
+        if (found != dynamicMethodOrdinals.end())
+        {
+            ordinal = found->second;
+        }
+    }
+
+    if (ordinal != 0)
+    {
+        printf("\r\n%s DynamicMethod#%u %" UINT_PTR_FORMAT "", event, ordinal, (UINT64)functionId);
+    }
+    else
+    {
+        printf("\r\n%s %" UINT_PTR_FORMAT "", event, (UINT64)functionId);
+    }
+}
+
 PROFILER_STUB EnterStub(FunctionIDOrClientID functionId, COR_PRF_ELT_INFO eltInfo)
 {
-    printf("\r\nEnter %" UINT_PTR_FORMAT "", (UINT64)functionId.functionID);
+    PrintEvent("Enter", functionId.functionID);
 }
 
 PROFILER_STUB LeaveStub(FunctionID functionId, COR_PRF_ELT_INFO eltInfo)
 {
-    printf("\r\nLeave %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    PrintEvent("Leave", functionId);
 }
 
 PROFILER_STUB TailcallStub(FunctionID functionId, COR_PRF_ELT_INFO eltInfo)
 {
-    printf("\r\nTailcall %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    PrintEvent("Tailcall", functionId);
 }
 
 #ifdef _X86_
@@ -78,7 +104,7 @@ EXTERN_C void LeaveNaked(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_
 EXTERN_C void TailcallNaked(FunctionIDOrClientID functionIDOrClientID, COR_PRF_ELT_INFO eltInfo);
 #endif
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr)
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), dynamicMethodCount(0)
 {
 }
 
@@ -100,7 +126,9 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         return E_FAIL;
     }
 
-    DWORD eventMask = COR_PRF_MONITOR_ENTERLEAVE | COR_PRF_ENABLE_FUNCTION_ARGS | COR_PRF_ENABLE_FUNCTION_RETVAL | COR_PRF_ENABLE_FRAME_INFO;
+    // JIT compilation events are only needed to learn about dynamic methods,
+    // whose FunctionIDs otherwise can't be traced back to anything.
+    DWORD eventMask = COR_PRF_MONITOR_ENTERLEAVE | COR_PRF_ENABLE_FUNCTION_ARGS | COR_PRF_ENABLE_FUNCTION_RETVAL | COR_PRF_ENABLE_FRAME_INFO | COR_PRF_MONITOR_JIT_COMPILATION;
 
     auto hr = this->corProfilerInfo->SetEventMask(eventMask);
     if (hr != S_OK)
@@ -566,10 +594,51 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleInMemorySymbolsUpdated(ModuleID mod
 
 HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock, LPCBYTE ilHeader, ULONG cbILHeader)
 {
+    // cbILHeader is the size of the whole IL body, not just its header.
+    std::lock_guard<std::mutex> guard(this->dynamicMethodsLock);
+    this->dynamicMethodsCompiling[functionId] = std::make_pair(cbILHeader, std::chrono::steady_clock::now());
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
+    auto finished = std::chrono::steady_clock::now();
+    std::pair<ULONG, std::chrono::steady_clock::time_point> started;
+    UINT32 ordinal;
+
+    {
+        std::lock_guard<std::mutex> guard(this->dynamicMethodsLock);
+        auto found = this->dynamicMethodsCompiling.find(functionId);
+        if (found == this->dynamicMethodsCompiling.end())
+        {
+            return S_OK;
+        }
+
+        started = found->second;
+        this->dynamicMethodsCompiling.erase(found);
+        ordinal = ++this->dynamicMethodCount;
+    }
+
+    if (SUCCEEDED(hrStatus))
+    {
+        std::lock_guard<std::mutex> guard(dynamicMethodNamesLock);
+        dynamicMethodOrdinals[functionId] = ordinal;
+    }
+
+    // Dynamic methods have no metadata, so they are named by the order they
+    // were compiled in, and the Enter/Leave hooks print that name for them;
+    // the code range lets samples be attributed to them.
+    COR_PRF_CODE_INFO codeInfo = { 0, 0 };
+    ULONG32 codeInfoCount = 0;
+    if (FAILED(hrStatus) || FAILED(this->corProfilerInfo->GetCodeInfo2(functionId, 1, &codeInfoCount, &codeInfo)))
+    {
+        codeInfoCount = 0;
+    }
+
+    printf("\r\nDynamicMethod#%u %" UINT_PTR_FORMAT ", IL %u bytes, JIT %lld us, code 0x%" UINT_PTR_FORMAT "-0x%" UINT_PTR_FORMAT "",
+        ordinal, (UINT64)functionId, (unsigned)started.first,
+        (long long)std::chrono::duration_cast<std::chrono::microseconds>(finished - started.second).count(),
+        (UINT64)codeInfo.startAddress, (UINT64)(codeInfo.startAddress + codeInfo.size));
+
     return S_OK;
 }
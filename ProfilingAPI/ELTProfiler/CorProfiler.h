@@ -4,6 +4,9 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 #include "cor.h"
 #include "corprof.h"
 
@@ -12,6 +15,11 @@ class CorProfiler : public ICorProfilerCallback8
 private:
     std::atomic<int> refCount;
     ICorProfilerInfo8* corProfilerInfo;
+
+    // IL size and JIT start time of the dynamic methods being compiled.
+    std::mutex dynamicMethodsLock;
+    std::unordered_map<FunctionID, std::pair<ULONG, std::chrono::steady_clock::time_point>> dynamicMethodsCompiling;
+    UINT32 dynamicMethodCount;
 public:
     CorProfiler();
     virtual ~CorProfiler();
@@ -0,0 +1,768 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+// Measures the ReJITEnterLeaveHooks profiler's IL rewriter on its own. The
+// method bodies of a corpus recorded by the profiler (PROFILER_IL_CORPUS) are
+// run through Import, the probe passes and Export, as the profiler would, with
+// the metadata served from the signatures saved in the corpus. Before timing,
+// every body is checked to survive an Import/Export unchanged, and every
+// instrumented body to decode back to the instruction stream it was exported
+// from.
+
+#include "../ReJITEnterLeaveHooks/ILCorpus.h"
+#include "../ReJITEnterLeaveHooks/ILRewriter.h"
+#include "corhlpr.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define MAX_REPORTED_ERRORS 20
+
+namespace
+{
+
+enum
+{
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) c,
+#include "opcode.def"
+#undef OPDEF
+    CEE_COUNT,
+    CEE_SWITCH_ARG,     // one switch target, as the rewriter has them
+};
+
+enum OperandKind
+{
+    OperandNone,
+    OperandValue,
+    OperandShortBranch,
+    OperandBranch,
+    OperandSwitch,
+};
+
+struct OpcodeInfo
+{
+    BYTE size;
+    BYTE kind;
+};
+
+const OpcodeInfo opcodes[] =
+{
+#define InlineNone           { 0, OperandNone }
+#define ShortInlineVar       { 1, OperandValue }
+#define InlineVar            { 2, OperandValue }
+#define ShortInlineI         { 1, OperandValue }
+#define InlineI              { 4, OperandValue }
+#define InlineI8             { 8, OperandValue }
+#define ShortInlineR         { 4, OperandValue }
+#define InlineR              { 8, OperandValue }
+#define ShortInlineBrTarget  { 1, OperandShortBranch }
+#define InlineBrTarget       { 4, OperandBranch }
+#define InlineMethod         { 4, OperandValue }
+#define InlineField          { 4, OperandValue }
+#define InlineType           { 4, OperandValue }
+#define InlineString         { 4, OperandValue }
+#define InlineSig            { 4, OperandValue }
+#define InlineRVA            { 4, OperandValue }
+#define InlineTok            { 4, OperandValue }
+#define InlineSwitch         { 4, OperandSwitch }
+
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,flow) args,
+#include "opcode.def"
+#undef OPDEF
+
+#undef InlineNone
+#undef ShortInlineVar
+#undef InlineVar
+#undef ShortInlineI
+#undef InlineI
+#undef InlineI8
+#undef ShortInlineR
+#undef InlineR
+#undef ShortInlineBrTarget
+#undef InlineBrTarget
+#undef InlineMethod
+#undef InlineField
+#undef InlineType
+#undef InlineString
+#undef InlineSig
+#undef InlineRVA
+#undef InlineTok
+#undef InlineSwitch
+};
+
+struct CorpusSignature
+{
+    mdToken token;
+    PCCOR_SIGNATURE signature;
+    ULONG size;
+};
+
+struct CorpusMethod
+{
+    mdMethodDef methodDef;
+    LPCBYTE body;
+    ULONG bodySize;
+    mdSignature probeSignature;
+    std::vector<CorpusSignature> signatures;
+};
+
+// The metadata of one corpus method at a time. Signatures the passes add get
+// made-up StandAloneSig tokens, unless the method already has the same one.
+class CorpusMetadata : public ILMetadata
+{
+private:
+    static const mdSignature addedTokenBase = 0x11FF0000;
+
+    const CorpusMethod* method;
+    std::vector<std::vector<BYTE>> added;
+    size_t addedCount;
+
+    HRESULT Find(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize)
+    {
+        if (token >= addedTokenBase && token - addedTokenBase < this->addedCount)
+        {
+            const std::vector<BYTE>& found = this->added[token - addedTokenBase];
+            *signature = found.data();
+            *signatureSize = (ULONG)found.size();
+            return S_OK;
+        }
+
+        for (const CorpusSignature& recorded : this->method->signatures)
+        {
+            if (recorded.token == token)
+            {
+                *signature = recorded.signature;
+                *signatureSize = recorded.size;
+                return S_OK;
+            }
+        }
+
+        return E_FAIL;
+    }
+public:
+    CorpusMetadata() : method(nullptr), addedCount(0)
+    {
+    }
+
+    void Reset(const CorpusMethod* method)
+    {
+        this->method = method;
+        this->addedCount = 0;
+    }
+
+    HRESULT GetMethodSignature(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override
+    {
+        return this->Find(token, signature, signatureSize);
+    }
+
+    HRESULT GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override
+    {
+        return this->Find(token, signature, signatureSize);
+    }
+
+    HRESULT GetTokenFromSignature(PCCOR_SIGNATURE signature, ULONG signatureSize, mdSignature* token) override
+    {
+        for (const CorpusSignature& recorded : this->method->signatures)
+        {
+            if (TypeFromToken(recorded.token) == mdtSignature && recorded.size == signatureSize && memcmp(recorded.signature, signature, signatureSize) == 0)
+            {
+                *token = recorded.token;
+                return S_OK;
+            }
+        }
+
+        if (this->addedCount == this->added.size())
+        {
+            this->added.emplace_back();
+        }
+
+        this->added[this->addedCount].assign(signature, signature + signatureSize);
+        *token = addedTokenBase + (mdSignature)this->addedCount++;
+        return S_OK;
+    }
+};
+
+// Hands out the exported bodies. Only the last one is kept.
+class BodyAllocator : public IMethodMalloc
+{
+private:
+    std::vector<BYTE> buffer;
+public:
+    UINT64 bytesAllocated;
+
+    BodyAllocator() : bytesAllocated(0)
+    {
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override
+    {
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef(void) override
+    {
+        return 1;
+    }
+
+    ULONG STDMETHODCALLTYPE Release(void) override
+    {
+        return 1;
+    }
+
+    PVOID STDMETHODCALLTYPE Alloc(ULONG cb) override
+    {
+        if (this->buffer.size() < cb)
+        {
+            this->buffer.resize(cb);
+        }
+
+        this->bytesAllocated += cb;
+        return this->buffer.data();
+    }
+};
+
+// Import and Export only.
+class RoundTripPass : public ILPass
+{
+public:
+    HRESULT Run(ILRewriter* pilr, const ILMethod& method) override
+    {
+        return S_OK;
+    }
+
+    const char* GetConfig() const override
+    {
+        return "roundtrip";
+    }
+};
+
+struct DecodedInstruction
+{
+    unsigned opcode;
+    INT64 operand;              // the index of the target, for branches
+};
+
+struct DecodedClause
+{
+    DWORD flags;
+    size_t tryBegin;
+    size_t tryEnd;
+    size_t handlerBegin;
+    size_t handlerEnd;
+    INT64 classTokenOrFilter;   // the index of the filter, for filters
+
+    // Field by field, the padding after flags isn't necessarily zero.
+    bool operator==(const DecodedClause& other) const
+    {
+        return this->flags == other.flags && this->tryBegin == other.tryBegin && this->tryEnd == other.tryEnd &&
+            this->handlerBegin == other.handlerBegin && this->handlerEnd == other.handlerEnd && this->classTokenOrFilter == other.classTokenOrFilter;
+    }
+};
+
+struct DecodedMethod
+{
+    DWORD initLocals;
+    mdSignature localVarSig;
+    std::vector<DecodedInstruction> instructions;
+    std::vector<DecodedClause> clauses;
+};
+
+// Decodes a body into instructions that refer to each other by index, with
+// every branch in its long form, so bodies that differ only in where the code
+// landed and which branch forms fit compare equal.
+bool Decode(LPCBYTE body, DecodedMethod* method, std::string* error)
+{
+    COR_ILMETHOD_DECODER decoder(reinterpret_cast<const COR_ILMETHOD*>(body));
+    LPCBYTE code = decoder.Code;
+    unsigned codeSize = decoder.GetCodeSize();
+
+    method->initLocals = decoder.GetFlags() & CorILMethod_InitLocals;
+    method->localVarSig = decoder.GetLocalVarSigTok();
+    method->instructions.clear();
+    method->clauses.clear();
+
+    // The index of the instruction at each offset, and the target offset of
+    // each branch until they are all known.
+    std::vector<size_t> indexAt(codeSize + 1, SIZE_MAX);
+    std::vector<size_t> branches;
+
+    unsigned offset = 0;
+    while (offset < codeSize)
+    {
+        indexAt[offset] = method->instructions.size();
+
+        unsigned opcode = code[offset++];
+        if (opcode == 0xFE)
+        {
+            if (offset >= codeSize)
+            {
+                *error = "truncated opcode";
+                return false;
+            }
+            opcode = 0x100 + code[offset++];
+        }
+
+        if (opcode >= CEE_COUNT || (CEE_PREFIX7 <= opcode && opcode <= CEE_PREFIX1))
+        {
+            *error = "invalid opcode at " + std::to_string(offset);
+            return false;
+        }
+
+        const OpcodeInfo& info = opcodes[opcode];
+        if (offset + info.size > codeSize)
+        {
+            *error = "truncated operand at " + std::to_string(offset);
+            return false;
+        }
+
+        INT64 operand = 0;
+        switch (info.size)
+        {
+        case 1: operand = info.kind == OperandShortBranch ? *(INT8*)&code[offset] : code[offset]; break;
+        case 2: operand = *(UNALIGNED INT16*)&code[offset]; break;
+        case 4: operand = *(UNALIGNED INT32*)&code[offset]; break;
+        case 8: operand = *(UNALIGNED INT64*)&code[offset]; break;
+        }
+        offset += info.size;
+
+        if (info.kind == OperandShortBranch || info.kind == OperandBranch)
+        {
+            if (opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S)
+            {
+                opcode += CEE_BR - CEE_BR_S;
+            }
+            else if (opcode == CEE_LEAVE_S)
+            {
+                opcode = CEE_LEAVE;
+            }
+
+            branches.push_back(method->instructions.size());
+            operand += offset;
+        }
+
+        method->instructions.push_back({ opcode, operand });
+
+        if (info.kind == OperandSwitch)
+        {
+            unsigned targetCount = (unsigned)operand;
+            unsigned base = offset + targetCount * sizeof(INT32);
+            if (base > codeSize || base < offset)
+            {
+                *error = "truncated switch at " + std::to_string(offset);
+                return false;
+            }
+
+            for (unsigned i = 0; i < targetCount; i++, offset += sizeof(INT32))
+            {
+                branches.push_back(method->instructions.size());
+                method->instructions.push_back({ CEE_SWITCH_ARG, (INT64)base + *(UNALIGNED INT32*)&code[offset] });
+            }
+        }
+    }
+
+    indexAt[codeSize] = method->instructions.size();
+
+    auto toIndex = [&](INT64 target, size_t* index) {
+        if (target < 0 || target > codeSize || indexAt[(size_t)target] == SIZE_MAX)
+        {
+            return false;
+        }
+
+        *index = indexAt[(size_t)target];
+        return true;
+    };
+
+    for (size_t branch : branches)
+    {
+        size_t index;
+        if (!toIndex(method->instructions[branch].operand, &index))
+        {
+            *error = "branch into the middle of an instruction, to " + std::to_string(method->instructions[branch].operand);
+            return false;
+        }
+
+        method->instructions[branch].operand = (INT64)index;
+    }
+
+    for (unsigned i = 0; i < decoder.EHCount(); i++)
+    {
+        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
+        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT* clause = reinterpret_cast<const COR_ILMETHOD_SECT_EH_CLAUSE_FAT*>(decoder.EH->EHClause(i, &scratch));
+
+        DecodedClause decoded = {};
+        decoded.flags = clause->GetFlags();
+        decoded.classTokenOrFilter = clause->GetClassToken();
+
+        size_t filter = 0;
+        bool valid =
+            toIndex(clause->GetTryOffset(), &decoded.tryBegin) &&
+            toIndex((INT64)clause->GetTryOffset() + clause->GetTryLength(), &decoded.tryEnd) &&
+            toIndex(clause->GetHandlerOffset(), &decoded.handlerBegin) &&
+            toIndex((INT64)clause->GetHandlerOffset() + clause->GetHandlerLength(), &decoded.handlerEnd) &&
+            ((decoded.flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0 || toIndex(clause->GetFilterOffset(), &filter));
+
+        if (!valid)
+        {
+            *error = "exception clause " + std::to_string(i) + " doesn't start or end on an instruction";
+            return false;
+        }
+
+        if (decoded.flags & COR_ILEXCEPTION_CLAUSE_FILTER)
+        {
+            decoded.classTokenOrFilter = (INT64)filter;
+        }
+
+        method->clauses.push_back(decoded);
+    }
+
+    return true;
+}
+
+bool Compare(const DecodedMethod& expected, const DecodedMethod& actual, std::string* error)
+{
+    if (expected.initLocals != actual.initLocals || expected.localVarSig != actual.localVarSig)
+    {
+        *error = "the header changed";
+        return false;
+    }
+
+    size_t count = std::min(expected.instructions.size(), actual.instructions.size());
+    for (size_t i = 0; i < count; i++)
+    {
+        if (expected.instructions[i].opcode != actual.instructions[i].opcode || expected.instructions[i].operand != actual.instructions[i].operand)
+        {
+            *error = "instruction " + std::to_string(i) + " changed";
+            return false;
+        }
+    }
+
+    if (expected.instructions.size() != actual.instructions.size())
+    {
+        *error = std::to_string(expected.instructions.size()) + " instructions became " + std::to_string(actual.instructions.size());
+        return false;
+    }
+
+    if (expected.clauses != actual.clauses)
+    {
+        *error = "the exception clauses changed";
+        return false;
+    }
+
+    return true;
+}
+
+bool LoadCorpus(const std::string& path, std::vector<BYTE>* data, std::vector<CorpusMethod>* methods)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "error: could not open %s\n", path.c_str());
+        return false;
+    }
+
+    BYTE chunk[64 * 1024];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) != 0)
+    {
+        data->insert(data->end(), chunk, chunk + read);
+    }
+    fclose(file);
+
+    const ILCorpusFileHeader* header = reinterpret_cast<const ILCorpusFileHeader*>(data->data());
+    if (data->size() < sizeof(ILCorpusFileHeader) || header->magic != ILCORPUS_FILE_MAGIC || header->version != ILCORPUS_FILE_VERSION)
+    {
+        fprintf(stderr, "error: %s is not a version %d IL corpus\n", path.c_str(), ILCORPUS_FILE_VERSION);
+        return false;
+    }
+
+    // A corpus cut short by a profiler that didn't shut down is used up to
+    // its last complete record.
+    size_t offset = sizeof(ILCorpusFileHeader);
+    while (data->size() - offset >= sizeof(ILCorpusRecordHeader))
+    {
+        const ILCorpusRecordHeader* record = reinterpret_cast<const ILCorpusRecordHeader*>(data->data() + offset);
+        size_t end = offset + sizeof(ILCorpusRecordHeader) + record->bodySize;
+        if (end > data->size())
+        {
+            break;
+        }
+
+        CorpusMethod method;
+        method.methodDef = record->methodDef;
+        method.body = data->data() + offset + sizeof(ILCorpusRecordHeader);
+        method.bodySize = record->bodySize;
+        method.probeSignature = record->probeSignature;
+
+        UINT32 i = 0;
+        for (; i < record->signatureCount && data->size() - end >= sizeof(ILCorpusSignature); i++)
+        {
+            ILCorpusSignature signature;
+            memcpy(&signature, data->data() + end, sizeof(signature));
+            end += sizeof(signature);
+
+            if (signature.size > data->size() - end)
+            {
+                break;
+            }
+
+            method.signatures.push_back({ signature.token, data->data() + end, signature.size });
+            end += signature.size;
+        }
+
+        if (i != record->signatureCount)
+        {
+            break;
+        }
+
+        methods->push_back(std::move(method));
+        offset = (end + 3) & ~(size_t)3;
+        if (offset > data->size())
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+std::string FormatHResult(HRESULT hr)
+{
+    char text[16];
+    snprintf(text, sizeof(text), "0x%08x", (unsigned)hr);
+    return text;
+}
+
+ILMethod GetILMethod(const CorpusMethod& method, CorpusMetadata* metadata)
+{
+    ILMethod ilMethod = {};
+    ilMethod.methodDef = method.methodDef;
+    ilMethod.functionIndex = 1;
+    ilMethod.pMetadata = metadata;
+    ilMethod.probeSignature = method.probeSignature;
+    return ilMethod;
+}
+
+// Returns the number of methods that failed a check.
+size_t Verify(const std::vector<CorpusMethod>& methods, const std::vector<std::unique_ptr<ILPass>>& passes)
+{
+    std::vector<std::unique_ptr<ILPass>> roundTrip;
+    roundTrip.emplace_back(new RoundTripPass());
+
+    CorpusMetadata metadata;
+    BodyAllocator allocator;
+    DecodedMethod expected;
+    DecodedMethod actual;
+    std::vector<BYTE> instrumented;
+    size_t failures = 0;
+
+    for (const CorpusMethod& method : methods)
+    {
+        metadata.Reset(&method);
+        ILMethod ilMethod = GetILMethod(method, &metadata);
+
+        std::string error;
+        LPCBYTE body;
+        ULONG bodySize;
+        HRESULT hr;
+
+        if (!Decode(method.body, &expected, &error))
+        {
+            error = "the original body doesn't decode: " + error;
+        }
+        else if (FAILED(hr = RewriteILBody(method.body, &allocator, ilMethod, roundTrip, &body, &bodySize)))
+        {
+            error = "Import/Export failed with " + FormatHResult(hr);
+        }
+        else if (!Decode(body, &actual, &error) || !Compare(expected, actual, &error))
+        {
+            error = "Import/Export: " + error;
+        }
+        // A method the passes can't instrument is left as it is by the
+        // profiler, and only counted as skipped when timing.
+        else if (RewriteILBody(method.body, &allocator, ilMethod, passes, &body, &bodySize) != S_OK)
+        {
+        }
+        else if (!Decode(body, &expected, &error))
+        {
+            error = "the instrumented body doesn't decode: " + error;
+        }
+        else
+        {
+            // The allocator only keeps the last body
+            instrumented.assign(body, body + bodySize);
+
+            if (FAILED(hr = RewriteILBody(instrumented.data(), &allocator, ilMethod, roundTrip, &body, &bodySize)))
+            {
+                error = "Import/Export of the instrumented body failed with " + FormatHResult(hr);
+            }
+            else if (!Decode(body, &actual, &error) || !Compare(expected, actual, &error))
+            {
+                error = "Import/Export of the instrumented body: " + error;
+            }
+        }
+
+        if (!error.empty())
+        {
+            if (failures++ < MAX_REPORTED_ERRORS)
+            {
+                fprintf(stderr, "error: method 0x%08x: %s\n", (unsigned)method.methodDef, error.c_str());
+            }
+        }
+    }
+
+    return failures;
+}
+
+void PrintUsage(const char* program)
+{
+    fprintf(stderr,
+        "usage: %s <corpus file> [options]\n"
+        "  --iterations <count> times to rewrite the whole corpus (default: 10)\n"
+        "  --probes <kind>      enterleave or counters (default: enterleave)\n"
+        "  --exit-probes <kind> ret or finally (default: ret)\n"
+        "  --verify <0|1>       check the rewritten bodies first (default: 1)\n",
+        program);
+}
+
+UINT64 counter;
+
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 2;
+    }
+
+    std::string corpusPath = argv[1];
+    unsigned iterations = 10;
+    bool counterProbes = false;
+    bool exitProbesInFinally = false;
+    bool verify = true;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string option = argv[i];
+        if (i + 1 >= argc)
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+
+        std::string value = argv[++i];
+        if (option == "--iterations")
+        {
+            iterations = (unsigned)strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (option == "--probes" && (value == "enterleave" || value == "counters"))
+        {
+            counterProbes = value == "counters";
+        }
+        else if (option == "--exit-probes" && (value == "ret" || value == "finally"))
+        {
+            exitProbesInFinally = value == "finally";
+        }
+        else if (option == "--verify")
+        {
+            verify = value != "0";
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<BYTE> data;
+    std::vector<CorpusMethod> methods;
+    if (!LoadCorpus(corpusPath, &data, &methods))
+    {
+        return 1;
+    }
+
+    // Same passes as the profiler's, with addresses that are never called
+    std::vector<std::unique_ptr<ILPass>> passes;
+    if (counterProbes)
+    {
+        passes.emplace_back(new CounterPass([](UINT32 functionIndex) { return &counter; }));
+    }
+    else
+    {
+        passes.emplace_back(new ProbePass(0x1000, 0x2000, exitProbesInFinally));
+    }
+
+    UINT64 ilBytes = 0;
+    for (const CorpusMethod& method : methods)
+    {
+        ilBytes += method.bodySize;
+    }
+
+    printf("%zu methods, %llu bytes of IL\n", methods.size(), (unsigned long long)ilBytes);
+
+    if (verify)
+    {
+        size_t failures = Verify(methods, passes);
+        if (failures != 0)
+        {
+            fprintf(stderr, "error: %zu methods failed to round-trip\n", failures);
+            return 1;
+        }
+
+        printf("all methods round-trip\n");
+    }
+
+    CorpusMetadata metadata;
+    BodyAllocator allocator;
+    UINT64 arenaAllocatedBefore;
+    UINT64 arenaReserved;
+    GetILArenaStats(&arenaAllocatedBefore, &arenaReserved);
+
+    UINT64 rewrites = 0;
+    UINT64 failures = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned iteration = 0; iteration < iterations; iteration++)
+    {
+        for (const CorpusMethod& method : methods)
+        {
+            metadata.Reset(&method);
+
+            LPCBYTE body;
+            ULONG bodySize;
+            if (RewriteILBody(method.body, &allocator, GetILMethod(method, &metadata), passes, &body, &bodySize) == S_OK)
+            {
+                rewrites++;
+            }
+            else
+            {
+                failures++;
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    UINT64 arenaAllocated;
+    GetILArenaStats(&arenaAllocated, &arenaReserved);
+    arenaAllocated -= arenaAllocatedBefore;
+
+    printf("%llu rewrites (%llu failed or skipped) in %.3f s\n", (unsigned long long)rewrites, (unsigned long long)failures, seconds);
+    if (rewrites == 0 || seconds <= 0)
+    {
+        return 0;
+    }
+
+    printf("%14.0f methods/s\n", rewrites / seconds);
+    printf("%14.3f MB/s of original IL\n", ilBytes * (double)iterations / seconds / 1e6);
+    printf("%14.0f arena bytes allocated per method\n", (double)arenaAllocated / rewrites);
+    printf("%14.0f body bytes allocated per method\n", (double)allocator.bytesAllocated / rewrites);
+    printf("%14llu arena bytes reserved at the end\n", (unsigned long long)arenaReserved);
+    return 0;
+}
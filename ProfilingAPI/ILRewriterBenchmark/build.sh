@@ -0,0 +1,18 @@
+#!/bin/sh
+
+[ -z "${CORECLR_PATH:-}" ] && CORECLR_PATH=~/coreclr
+[ -z "${BuildOS:-}"      ] && BuildOS=Linux
+[ -z "${BuildArch:-}"    ] && BuildArch=x64
+[ -z "${BuildType:-}"    ] && BuildType=Debug
+[ -z "${Output:-}"       ] && Output=ILRewriterBenchmark
+
+printf '  CORECLR_PATH : %s\n' "$CORECLR_PATH"
+
+printf '  Building %s ... ' "$Output"
+
+CXX_FLAGS="$CXX_FLAGS -O2 -Wno-invalid-noreturn -fms-extensions -DBIT64 -DPAL_STDCPP_COMPAT -DPLATFORM_UNIX -std=c++11 -pthread"
+INCLUDES="-I $CORECLR_PATH/src/pal/inc/rt -I $CORECLR_PATH/src/pal/prebuilt/inc -I $CORECLR_PATH/src/pal/inc -I $CORECLR_PATH/src/inc -I $CORECLR_PATH/bin/Product/$BuildOS.$BuildArch.$BuildType/inc"
+
+clang++ -o $Output $CXX_FLAGS $INCLUDES ILRewriterBenchmark.cpp ../ReJITEnterLeaveHooks/ILCache.cpp ../ReJITEnterLeaveHooks/ILRewriter.cpp
+
+printf 'Done.\n'
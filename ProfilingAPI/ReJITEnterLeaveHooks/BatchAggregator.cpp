@@ -0,0 +1,301 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "BatchAggregator.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BATCH_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define BATCH_AVX2
+#define AVX2_TARGET
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Durations are bucketed through the double exponent, which is exact below 2^52.
+#define MAX_BUCKETED_DURATION ((1ULL << 52) - 1)
+
+static void ExtractTimestampsScalar(const TraceEvent* records, uint32_t count, uint64_t* timestamps)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        timestamps[i] = records[i].Timestamp();
+    }
+}
+
+// deltas[i] = timestamps[i] - timestamps[i - 1], with timestamps[-1] = previous.
+static void ComputeDeltasScalar(const uint64_t* timestamps, uint32_t count, uint64_t previous, uint64_t* deltas)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        deltas[i] = timestamps[i] - previous;
+        previous = timestamps[i];
+    }
+}
+
+static void ComputeBucketsScalar(const uint64_t* durations, uint32_t count, uint32_t* buckets)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t duration = std::min<uint64_t>(durations[i], MAX_BUCKETED_DURATION);
+        uint32_t bucket = 0;
+        while (duration > 1)
+        {
+            duration >>= 1;
+            bucket++;
+        }
+
+        buckets[i] = bucket;
+    }
+}
+
+#ifdef BATCH_AVX2
+
+AVX2_TARGET static void ExtractTimestampsAvx2(const TraceEvent* records, uint32_t count, uint64_t* timestamps)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        // Two records per register: { id0, stamp0, id1, stamp1 } and { id2, stamp2, id3, stamp3 }.
+        __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&records[i]));
+        __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&records[i + 2]));
+        __m256i stamps = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(first, second), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&timestamps[i]), _mm256_srli_epi64(stamps, 1));
+    }
+
+    ExtractTimestampsScalar(records + i, count - i, timestamps + i);
+}
+
+AVX2_TARGET static void ComputeDeltasAvx2(const uint64_t* timestamps, uint32_t count, uint64_t previous, uint64_t* deltas)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    deltas[0] = timestamps[0] - previous;
+
+    uint32_t i = 1;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&timestamps[i]));
+        __m256i before = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&timestamps[i - 1]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&deltas[i]), _mm256_sub_epi64(current, before));
+    }
+
+    ComputeDeltasScalar(timestamps + i, count - i, timestamps[i - 1], deltas + i);
+}
+
+AVX2_TARGET static void ComputeBucketsAvx2(const uint64_t* durations, uint32_t count, uint32_t* buckets)
+{
+    const __m256i limit = _mm256_set1_epi64x(MAX_BUCKETED_DURATION);
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL); // 2^52 as a double
+    const __m256i bias = _mm256_set1_epi64x(1023);
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i duration = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&durations[i]));
+        duration = _mm256_blendv_epi8(duration, limit, _mm256_cmpgt_epi64(duration, limit));
+
+        // (2^52 + duration) - 2^52 is the duration as a double; its exponent is floor(log2).
+        __m256d value = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(duration, magic)), _mm256_castsi256_pd(magic));
+        __m256i exponent = _mm256_sub_epi64(_mm256_srli_epi64(_mm256_castpd_si256(value), 52), bias);
+        exponent = _mm256_blendv_epi8(exponent, zero, _mm256_cmpgt_epi64(zero, exponent));
+
+        // Keep the low 32 bits of every lane.
+        __m256i packed = _mm256_permutevar8x32_epi32(exponent, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&buckets[i]), _mm256_castsi256_si128(packed));
+    }
+
+    ComputeBucketsScalar(durations + i, count - i, buckets + i);
+}
+
+static bool HasAvx2()
+{
+#if defined(__GNUC__)
+    return __builtin_cpu_supports("avx2");
+#else
+    int registers[4];
+    __cpuid(registers, 1);
+    bool osSavesAvx = (registers[2] & (1 << 27)) != 0 && (registers[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+    __cpuidex(registers, 7, 0);
+    return osSavesAvx && (registers[1] & (1 << 5)) != 0;
+#endif
+}
+
+static const bool useAvx2 = HasAvx2();
+
+static void ExtractTimestamps(const TraceEvent* records, uint32_t count, uint64_t* timestamps)
+{
+    useAvx2 ? ExtractTimestampsAvx2(records, count, timestamps) : ExtractTimestampsScalar(records, count, timestamps);
+}
+
+static void ComputeDeltas(const uint64_t* timestamps, uint32_t count, uint64_t previous, uint64_t* deltas)
+{
+    useAvx2 ? ComputeDeltasAvx2(timestamps, count, previous, deltas) : ComputeDeltasScalar(timestamps, count, previous, deltas);
+}
+
+static void ComputeBuckets(const uint64_t* durations, uint32_t count, uint32_t* buckets)
+{
+    useAvx2 ? ComputeBucketsAvx2(durations, count, buckets) : ComputeBucketsScalar(durations, count, buckets);
+}
+
+#else
+
+#define ExtractTimestamps ExtractTimestampsScalar
+#define ComputeDeltas ComputeDeltasScalar
+#define ComputeBuckets ComputeBucketsScalar
+
+#endif
+
+BatchAggregator::BatchAggregator()
+{
+    this->Grow(1);
+}
+
+void BatchAggregator::Grow(size_t slotCount)
+{
+    if (slotCount <= this->exclusiveTimes.size())
+    {
+        return;
+    }
+
+    this->inclusiveTimes.resize(slotCount, 0);
+    this->exclusiveTimes.resize(slotCount, 0);
+    this->histograms.resize(slotCount * HISTOGRAM_BUCKETS, 0);
+}
+
+void BatchAggregator::Add(uint32_t threadIndex, const TraceEvent* records, uint32_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> batchGuard(this->batchLock);
+
+    if (threadIndex >= this->threads.size())
+    {
+        this->threads.resize(threadIndex + 1, { {}, 0 });
+    }
+
+    ThreadState& thread = this->threads[threadIndex];
+
+    this->timestamps.resize(count);
+    this->deltas.resize(count);
+    this->owners.resize(count);
+    this->leaveSlots.resize(count);
+    this->durations.resize(count);
+
+    ExtractTimestamps(records, count, this->timestamps.data());
+    ComputeDeltas(this->timestamps.data(), count, thread.lastTimestamp != 0 ? thread.lastTimestamp : this->timestamps[0], this->deltas.data());
+
+    // Replay the call stack. owners[i] is the function that ran up to event i,
+    // which is what the time in deltas[i] is charged to. Leaves are matched
+    // the same way as in Statistics::Leave.
+    std::vector<Frame>& stack = thread.stack;
+    uint32_t maxSlot = 0;
+    uint32_t leaveCount = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        this->owners[i] = stack.empty() ? 0 : stack.back().slot;
+
+        uint32_t slot = records[i].functionIndex + 1;
+        maxSlot = std::max(maxSlot, slot);
+
+        if (records[i].Kind() == TRACE_EVENT_ENTER)
+        {
+            stack.push_back({ slot, this->timestamps[i] });
+            continue;
+        }
+
+        size_t depth = stack.size();
+        while (depth > 0 && stack[depth - 1].slot != slot)
+        {
+            depth--;
+        }
+
+        if (depth == 0)
+        {
+            continue;
+        }
+
+        this->leaveSlots[leaveCount] = slot;
+        this->durations[leaveCount] = this->timestamps[i] - stack[depth - 1].startTime;
+        leaveCount++;
+        stack.resize(depth - 1);
+    }
+
+    thread.lastTimestamp = this->timestamps[count - 1];
+
+    this->buckets.resize(leaveCount);
+    ComputeBuckets(this->durations.data(), leaveCount, this->buckets.data());
+
+    // Only the totals are shared with Snapshot and Reset.
+    std::lock_guard<std::mutex> totalsGuard(this->totalsLock);
+
+    this->Grow((size_t)maxSlot + 1);
+
+    // Consecutive events are almost never charged to the same function (an
+    // enter charges the caller, the next event the callee), so these stay
+    // plain scatters into the flat arrays.
+    uint64_t* exclusive = this->exclusiveTimes.data();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        exclusive[this->owners[i]] += this->deltas[i];
+    }
+
+    uint64_t* inclusive = this->inclusiveTimes.data();
+    uint64_t* histogram = this->histograms.data();
+    for (uint32_t i = 0; i < leaveCount; i++)
+    {
+        uint32_t slot = this->leaveSlots[i];
+        inclusive[slot] += this->durations[i];
+        histogram[(size_t)slot * HISTOGRAM_BUCKETS + this->buckets[i]]++;
+    }
+}
+
+std::vector<FunctionTotals> BatchAggregator::Snapshot()
+{
+    std::lock_guard<std::mutex> guard(this->totalsLock);
+
+    std::vector<FunctionTotals> result;
+    for (size_t i = 1; i < this->exclusiveTimes.size(); i++)
+    {
+        const uint64_t* histogram = &this->histograms[i * HISTOGRAM_BUCKETS];
+
+        // Every call is in exactly one bucket.
+        uint64_t callCount = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        {
+            callCount += histogram[bucket];
+        }
+
+        if (callCount == 0 && this->exclusiveTimes[i] == 0)
+        {
+            continue;
+        }
+
+        FunctionTotals totals = { (uint32_t)(i - 1), callCount, this->inclusiveTimes[i], this->exclusiveTimes[i], {} };
+        memcpy(totals.histogram, histogram, sizeof(totals.histogram));
+        result.push_back(totals);
+    }
+
+    return result;
+}
+
+void BatchAggregator::Reset()
+{
+    std::lock_guard<std::mutex> guard(this->totalsLock);
+
+    std::fill(this->inclusiveTimes.begin(), this->inclusiveTimes.end(), 0);
+    std::fill(this->exclusiveTimes.begin(), this->exclusiveTimes.end(), 0);
+    std::fill(this->histograms.begin(), this->histograms.end(), 0);
+}
@@ -0,0 +1,92 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "TraceFormat.h"
+
+#define HISTOGRAM_BUCKETS 64
+
+// An event as the probes record it, with the dense index the function got
+// when its IL was rewritten (see FunctionRegistry.h). The index is only
+// turned into a FunctionID when a block is written. Same layout as
+// TraceRecord, so the two are extracted the same way.
+struct TraceEvent
+{
+    uint32_t functionIndex;
+    uint32_t reserved;
+    uint64_t timestampAndKind;  // timestamp in nanoseconds << 1 | TRACE_EVENT_*
+
+    uint64_t Timestamp() const { return this->timestampAndKind >> 1; }
+    unsigned Kind() const { return (unsigned)(this->timestampAndKind & 1); }
+};
+
+static_assert(sizeof(TraceEvent) == sizeof(TraceRecord), "TraceEvent layout");
+
+struct FunctionTotals
+{
+    uint32_t functionIndex;
+    uint64_t callCount;
+    uint64_t inclusiveTime;                 // nanoseconds
+    uint64_t exclusiveTime;                 // nanoseconds
+    uint64_t histogram[HISTOGRAM_BUCKETS];  // calls by log2 of their inclusive time in nanoseconds
+};
+
+// Per-function statistics computed by the trace flusher from the records it
+// drains, so the probes only pay for appending to their buffer. Batches are
+// processed in passes over flat arrays indexed by the probes' function index:
+// extracting timestamps and deltas and bucketing durations use AVX2 when the
+// CPU supports it. The call stack matching and the accumulation into the
+// totals are scalar, and only the latter is done under the lock Snapshot takes.
+//
+// Like TraceFormat.h this header doesn't depend on the CoreCLR headers.
+class BatchAggregator
+{
+private:
+    struct Frame
+    {
+        uint32_t slot;
+        uint64_t startTime;
+    };
+
+    struct ThreadState
+    {
+        std::vector<Frame> stack;
+        uint64_t lastTimestamp;
+    };
+
+    std::mutex batchLock;                   // threads and the scratch space
+    std::mutex totalsLock;
+
+    // Slot i + 1 is for function index i; slot 0 collects the time a thread
+    // spends outside of any traced function. Call counts are the histogram
+    // totals.
+    std::vector<uint64_t> inclusiveTimes;
+    std::vector<uint64_t> exclusiveTimes;
+    std::vector<uint64_t> histograms;       // HISTOGRAM_BUCKETS per function
+
+    std::vector<ThreadState> threads;
+
+    // Scratch space for one batch.
+    std::vector<uint64_t> timestamps;
+    std::vector<uint64_t> deltas;
+    std::vector<uint32_t> owners;
+    std::vector<uint32_t> leaveSlots;
+    std::vector<uint64_t> durations;
+    std::vector<uint32_t> buckets;
+
+    void Grow(size_t slotCount);
+
+public:
+    BatchAggregator();
+
+    // Adds consecutive records of one thread. The thread's call stack carries
+    // over from its previous batch.
+    void Add(uint32_t threadIndex, const TraceEvent* records, uint32_t count);
+
+    std::vector<FunctionTotals> Snapshot();
+    void Reset();
+};
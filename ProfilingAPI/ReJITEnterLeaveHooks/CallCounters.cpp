@@ -0,0 +1,54 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CallCounters.h"
+#include "FunctionRegistry.h"
+#include <mutex>
+
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+
+static std::mutex lock;
+static std::vector<UINT64*> chunks; // slot i is chunks[i / CHUNK_SIZE][i % CHUNK_SIZE]
+
+UINT64* CallCounters::GetSlot(UINT32 functionIndex)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    while (chunks.size() <= (functionIndex >> CHUNK_BITS))
+    {
+        chunks.push_back(new UINT64[CHUNK_SIZE]());
+    }
+
+    return chunks[functionIndex >> CHUNK_BITS] + (functionIndex & (CHUNK_SIZE - 1));
+}
+
+std::vector<FunctionStatistics> CallCounters::Snapshot()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    std::vector<FunctionStatistics> statistics;
+    for (UINT32 i = 0; i < chunks.size() * CHUNK_SIZE; i++)
+    {
+        UINT64 callCount = *(volatile UINT64*)(chunks[i >> CHUNK_BITS] + (i & (CHUNK_SIZE - 1)));
+        if (callCount != 0)
+        {
+            statistics.push_back({ FunctionRegistry::GetFunctionId(i), callCount, 0, 0 });
+        }
+    }
+
+    return statistics;
+}
+
+void CallCounters::Reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (UINT64* chunk : chunks)
+    {
+        for (size_t i = 0; i < CHUNK_SIZE; i++)
+        {
+            *(volatile UINT64*)(chunk + i) = 0;
+        }
+    }
+}
@@ -0,0 +1,26 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "Statistics.h"
+
+// Call counts kept by the counter probes, which increment a per-function slot
+// directly from the method's IL instead of calling into the profiler. Slots
+// are indexed by FunctionRegistry index, and live in native memory that is
+// never moved or freed, so their addresses can be baked into the IL.
+//
+// The increment is a plain load/add/store, so concurrent calls of the same
+// method can occasionally lose a count.
+class CallCounters
+{
+public:
+    static UINT64* GetSlot(UINT32 functionIndex);
+
+    // Only the call counts are filled in.
+    static std::vector<FunctionStatistics> Snapshot();
+    static void Reset();
+};
@@ -0,0 +1,245 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "CodeVersions.h"
+#include "profiler_pal.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static bool IsSet(const char* variable, const char* setting)
+{
+    const char* value = getenv(variable);
+    return value != nullptr && strcmp(value, setting) == 0;
+}
+
+static bool IsDisabled(const char* setting)
+{
+    return IsSet((std::string("DOTNET_") + setting).c_str(), "0") || IsSet((std::string("COMPlus_") + setting).c_str(), "0");
+}
+
+static bool IsEnabled(const char* setting)
+{
+    return IsSet((std::string("DOTNET_") + setting).c_str(), "1") || IsSet((std::string("COMPlus_") + setting).c_str(), "1");
+}
+
+CodeVersions::CodeVersions() : corProfilerInfo(nullptr), moduleMetadata(nullptr), tieredCompilation(false), quickJit(false), quickJitForLoops(false), jitCounts()
+{
+}
+
+// Tiered compilation came with .NET Core 3.0, which is also where
+// ICorProfilerInfo9 first appears. Quick JIT for methods with loops is on by
+// default from .NET 7, where on-stack replacement lets them leave tier0.
+void CodeVersions::Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata)
+{
+    this->corProfilerInfo = corProfilerInfo;
+    this->moduleMetadata = moduleMetadata;
+
+    corProfilerInfo->QueryInterface(__uuidof(ICorProfilerInfo9), reinterpret_cast<void **>(&this->corProfilerInfo9));
+    this->tieredCompilation = this->corProfilerInfo9 != nullptr && !IsDisabled("TieredCompilation");
+    this->quickJit = !IsDisabled("TC_QuickJit");
+
+    USHORT majorVersion = 0;
+    corProfilerInfo->GetRuntimeInformation(nullptr, nullptr, &majorVersion, nullptr, nullptr, nullptr, 0, nullptr, nullptr);
+    this->quickJitForLoops = IsEnabled("TC_QuickJitForLoops") || (majorVersion >= 7 && !IsDisabled("TC_QuickJitForLoops"));
+}
+
+// Lets go of the runtime at shutdown.
+void CodeVersions::Clear()
+{
+    this->corProfilerInfo9.Release();
+}
+
+bool CodeVersions::IsTiered()
+{
+    return this->tieredCompilation;
+}
+
+bool CodeVersions::BeginRewrite(ModuleID moduleId, mdMethodDef methodDef, bool* rewritten, UINT32* functionIndex)
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    auto inserted = this->methods.insert({ { moduleId, methodDef }, { RewriteState::Rewriting, 0 } });
+    if (inserted.second)
+    {
+        return true;
+    }
+
+    // Another instantiation of a generic method may be compiling right now.
+    MethodEntry& entry = inserted.first->second;
+    this->rewriteFinished.wait(guard, [&entry] { return entry.state != RewriteState::Rewriting; });
+
+    *rewritten = entry.state == RewriteState::Rewritten;
+    *functionIndex = entry.functionIndex;
+    return false;
+}
+
+void CodeVersions::EndRewrite(ModuleID moduleId, mdMethodDef methodDef, bool rewritten, UINT32 functionIndex)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->methods.find({ moduleId, methodDef });
+    if (found != this->methods.end())
+    {
+        found->second = { rewritten ? RewriteState::Rewritten : RewriteState::Skipped, functionIndex };
+    }
+
+    this->rewriteFinished.notify_all();
+}
+
+bool CodeVersions::IsRewritten(ModuleID moduleId, mdMethodDef methodDef)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->methods.find({ moduleId, methodDef });
+    return found != this->methods.end() && found->second.state == RewriteState::Rewritten;
+}
+
+void CodeVersions::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    for (auto entry = this->methods.begin(); entry != this->methods.end();)
+    {
+        entry = entry->first.moduleId == moduleId && entry->second.state != RewriteState::Rewriting ? this->methods.erase(entry) : std::next(entry);
+    }
+}
+
+bool CodeVersions::IsFirstCompilation(FunctionID functionId, ReJITID reJITId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->functions.find(functionId);
+    if (found == this->functions.end())
+    {
+        return true;
+    }
+
+    const FunctionEntry& entry = found->second;
+    return (entry.jitCount == 0 || entry.reJITId != reJITId) && !(entry.precompiled && reJITId == 0);
+}
+
+// Methods marked with AggressiveOptimization aren't tiered, and without quick
+// JIT for loops the runtime doesn't compile methods with loops at tier0 either.
+bool CodeVersions::SkipsTier0(FunctionID functionId)
+{
+    if (!this->quickJit)
+    {
+        return true;
+    }
+
+    mdToken token;
+    ClassID classId;
+    ModuleID moduleId;
+    ModuleMetadata metadata;
+    if (FAILED(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token)) ||
+        FAILED(this->moduleMetadata->Get(moduleId, &metadata)))
+    {
+        return false;
+    }
+
+    DWORD implFlags;
+    if (SUCCEEDED(metadata.metadataImport->GetMethodProps(token, nullptr, nullptr, 0, nullptr, nullptr, nullptr, nullptr, nullptr, &implFlags)) &&
+        (implFlags & miAggressiveOptimization) != 0)
+    {
+        return true;
+    }
+
+    if (this->quickJitForLoops)
+    {
+        return false;
+    }
+
+    LPCBYTE methodBytes;
+    return SUCCEEDED(this->corProfilerInfo->GetILFunctionBody(moduleId, token, &methodBytes, nullptr)) && HasBackwardBranch(methodBytes);
+}
+
+// The runtime doesn't say which tier it is compiling for, but every IL
+// version starts with its tier0 code, unless it has ReadyToRun code or the
+// method skips tier0, and any later compilation of the same version is an
+// optimized one. The metadata is looked at only for the first compilation.
+CodeVersions::Tier CodeVersions::CompilationStarted(FunctionID functionId, ReJITID reJITId)
+{
+    bool skipsTier0 = this->tieredCompilation && this->IsFirstCompilation(functionId, reJITId) && this->SkipsTier0(functionId);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    FunctionEntry& entry = this->functions[functionId];
+    if (entry.jitCount == 0 || entry.reJITId != reJITId)
+    {
+        entry.versionJitCount = 0;
+    }
+
+    if (entry.versionJitCount > 0 || (entry.precompiled && reJITId == 0))
+    {
+        entry.tier = Tier::Tier1;
+    }
+    else
+    {
+        entry.tier = this->tieredCompilation && !skipsTier0 ? Tier::Tier0 : Tier::Optimized;
+    }
+
+    entry.reJITId = reJITId;
+    entry.jitCount++;
+    entry.versionJitCount++;
+
+    this->jitCounts[(size_t)entry.tier]++;
+    return entry.tier;
+}
+
+void CodeVersions::PrecompiledCodeUsed(FunctionID functionId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->functions[functionId].precompiled = true;
+}
+
+std::vector<CodeVersions::FunctionCode> CodeVersions::GetFunctions()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    std::vector<FunctionCode> result;
+    result.reserve(this->functions.size());
+
+    for (const auto& function : this->functions)
+    {
+        // Functions that only ran their ReadyToRun code weren't jitted.
+        if (function.second.jitCount == 0)
+        {
+            continue;
+        }
+
+        result.push_back({ function.first, function.second.jitCount, function.second.tier, function.second.reJITId });
+    }
+
+    return result;
+}
+
+void CodeVersions::GetJitCounts(UINT64 counts[(size_t)Tier::Count])
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    memcpy(counts, this->jitCounts, sizeof(this->jitCounts));
+}
+
+ULONG32 CodeVersions::GetCodeCount(FunctionID functionId, ReJITID reJITId)
+{
+    ULONG32 count;
+    if (this->corProfilerInfo9 == nullptr || FAILED(this->corProfilerInfo9->GetNativeCodeStartAddresses(functionId, reJITId, 0, &count, nullptr)))
+    {
+        return 0;
+    }
+
+    return count;
+}
+
+const char* CodeVersions::GetTierName(Tier tier)
+{
+    switch (tier)
+    {
+    case Tier::Tier0:
+        return "tier0";
+    case Tier::Tier1:
+        return "tier1";
+    default:
+        return "optimized";
+    }
+}
@@ -0,0 +1,114 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "CComPtr.h"
+#include "ModuleMetadataCache.h"
+#include "ReJITManager.h"
+
+// Follows the code the JIT produces from each method's IL. With tiered
+// compilation a method is jitted more than once from the same IL: quickly at
+// tier0, and again with full optimizations at tier1 once it is called often,
+// with on-stack replacement possibly compiling a hot loop in between. The
+// probes are rewritten into the IL once, the first time the method is jitted;
+// every later compilation, and every other instantiation of a generic method,
+// picks them up from there, so the tier1 code has the same probes as the tier0
+// code and no method is instrumented twice. Methods that start from their
+// ReadyToRun code, or that the runtime compiles fully optimized right away,
+// have no tier0 code from the JIT.
+class CodeVersions
+{
+public:
+    enum class Tier
+    {
+        Tier0,          // first code from the IL with tiered compilation on
+        Tier1,          // compiled again from the same IL, or after its ReadyToRun code: tier1 or on-stack replacement
+        Optimized,      // first code from the IL with tiered compilation off, or for a method that skips tier0
+        Count,
+    };
+
+    struct FunctionCode
+    {
+        FunctionID functionId;
+        UINT32 jitCount;
+        Tier tier;              // of the last compilation
+        ReJITID reJITId;        // of the last compilation, 0 for the original IL
+    };
+
+private:
+    enum class RewriteState
+    {
+        Rewriting,
+        Rewritten,
+        Skipped,        // not instrumented, the IL is as it was
+    };
+
+    struct MethodEntry
+    {
+        RewriteState state;
+        UINT32 functionIndex;
+    };
+
+    struct FunctionEntry
+    {
+        UINT32 jitCount;
+        UINT32 versionJitCount; // compilations from the IL of reJITId
+        Tier tier;
+        ReJITID reJITId;
+        bool precompiled;       // the original IL started with ReadyToRun code
+    };
+
+    ICorProfilerInfo8* corProfilerInfo;
+    ModuleMetadataCache* moduleMetadata;
+    CComPtr<ICorProfilerInfo9> corProfilerInfo9;    // null before .NET Core 3.0
+    bool tieredCompilation;
+    bool quickJit;          // when off, methods without ReadyToRun code skip tier0
+    bool quickJitForLoops;  // when off, so do methods with loops
+    std::mutex lock;
+    std::condition_variable rewriteFinished;
+    std::unordered_map<MethodKey, MethodEntry, MethodKeyHash> methods;
+    std::unordered_map<FunctionID, FunctionEntry> functions;
+    UINT64 jitCounts[(size_t)Tier::Count];
+
+    bool IsFirstCompilation(FunctionID functionId, ReJITID reJITId);
+    bool SkipsTier0(FunctionID functionId);
+public:
+    CodeVersions();
+    void Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata);
+    void Clear();
+    bool IsTiered();
+
+    // Called when a method is about to be jitted from its original IL.
+    // Returns true the first time; the caller then rewrites the IL and calls
+    // EndRewrite. Later calls wait for that rewrite and return false, with
+    // *rewritten telling whether the IL has the probes, and their index.
+    bool BeginRewrite(ModuleID moduleId, mdMethodDef methodDef, bool* rewritten, UINT32* functionIndex);
+    void EndRewrite(ModuleID moduleId, mdMethodDef methodDef, bool rewritten, UINT32 functionIndex);
+
+    // Whether the method's IL has the probes, so code that inlines it has them too.
+    bool IsRewritten(ModuleID moduleId, mdMethodDef methodDef);
+    void ModuleUnloaded(ModuleID moduleId);
+
+    // Records a compilation of the function. reJITId is 0 for the original IL.
+    Tier CompilationStarted(FunctionID functionId, ReJITID reJITId);
+
+    // Called when the function's ReadyToRun code is used; that is its tier0
+    // code, and the next compilation of its original IL is a tier1 one.
+    void PrecompiledCodeUsed(FunctionID functionId);
+
+    std::vector<FunctionCode> GetFunctions();
+    void GetJitCounts(UINT64 counts[(size_t)Tier::Count]);
+
+    // The native code bodies the runtime keeps for the function's IL version,
+    // or 0 if the runtime can't tell.
+    ULONG32 GetCodeCount(FunctionID functionId, ReJITID reJITId);
+
+    static const char* GetTierName(Tier tier);
+};
@@ -0,0 +1,68 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+// profctl: sends one command to the control socket of a running profiler and
+// prints the reply.
+//
+//   profctl <pid | socket path> <command> [arguments...]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <pid | socket path> <command> [arguments...]\n", argv[0]);
+        fprintf(stderr, "commands: start | stop | mode print|aggregate|trace | reset | status | top [count] | dump | histogram [count] | dynamic | jit |\n");
+        fprintf(stderr, "          instrument <pattern> | uninstrument <pattern> | instrumented | budget <percent>\n");
+        return 2;
+    }
+
+    std::string socketPath = argv[1];
+    if (socketPath.find_first_not_of("0123456789") == std::string::npos)
+    {
+        socketPath = "/tmp/CorProfiler." + socketPath + ".sock";
+    }
+
+    std::string command = argv[2];
+    for (int i = 3; i < argc; i++)
+    {
+        command += " ";
+        command += argv[i];
+    }
+    command += "\n";
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        perror(socketPath.c_str());
+        return 1;
+    }
+
+    if (send(connection, command.data(), command.size(), 0) != (ssize_t)command.size())
+    {
+        perror("send");
+        return 1;
+    }
+
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(connection, buffer, sizeof(buffer), 0)) > 0)
+    {
+        fwrite(buffer, 1, received, stdout);
+    }
+
+    close(connection);
+    return 0;
+}
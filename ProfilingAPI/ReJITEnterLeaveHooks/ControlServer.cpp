@@ -0,0 +1,179 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "ControlServer.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifndef WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // MacOSX uses SO_NOSIGPIPE instead
+#endif
+#endif
+
+#define POLL_INTERVAL_MS  250
+#define MAX_COMMAND_SIZE  4096
+#define RECEIVE_TIMEOUT_S 5
+
+ControlServer::ControlServer() : stopRequested(false), listenSocket(-1)
+{
+}
+
+ControlServer::~ControlServer()
+{
+    this->Stop();
+}
+
+#ifndef WIN32
+
+bool ControlServer::Start(const std::string& socketPath, CommandHandler handler)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        printf("ERROR: Control socket path is too long: %s\n", socketPath.c_str());
+        return false;
+    }
+
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    this->listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (this->listenSocket < 0)
+    {
+        printf("ERROR: Could not create control socket (errno: %d)\n", errno);
+        return false;
+    }
+
+    // A stale socket left behind by a crashed process would make bind fail.
+    unlink(socketPath.c_str());
+
+    if (bind(this->listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+        listen(this->listenSocket, 4) != 0)
+    {
+        printf("ERROR: Could not listen on control socket %s (errno: %d)\n", socketPath.c_str(), errno);
+        close(this->listenSocket);
+        this->listenSocket = -1;
+        return false;
+    }
+
+    this->socketPath = socketPath;
+    this->handler = handler;
+    this->stopRequested = false;
+    this->thread = std::thread(&ControlServer::Run, this);
+
+    return true;
+}
+
+void ControlServer::Stop()
+{
+    if (!this->thread.joinable())
+    {
+        return;
+    }
+
+    this->stopRequested = true;
+    this->thread.join();
+
+    close(this->listenSocket);
+    this->listenSocket = -1;
+    unlink(this->socketPath.c_str());
+}
+
+void ControlServer::Run()
+{
+    while (!this->stopRequested)
+    {
+        // Poll with a timeout rather than blocking in accept, so Stop can
+        // always get the thread to exit.
+        pollfd pending = { this->listenSocket, POLLIN, 0 };
+        if (poll(&pending, 1, POLL_INTERVAL_MS) <= 0)
+        {
+            continue;
+        }
+
+        int connection = accept(this->listenSocket, nullptr, nullptr);
+        if (connection < 0)
+        {
+            continue;
+        }
+
+        // Don't let a client that never sends its command hold up the server.
+        timeval timeout = { RECEIVE_TIMEOUT_S, 0 };
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#ifdef SO_NOSIGPIPE
+        int noSigPipe = 1;
+        setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+        this->HandleConnection(connection);
+        close(connection);
+    }
+}
+
+void ControlServer::HandleConnection(int connection)
+{
+    std::string command;
+    char buffer[256];
+
+    while (command.find('\n') == std::string::npos && command.size() < MAX_COMMAND_SIZE)
+    {
+        ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+        {
+            break;
+        }
+
+        command.append(buffer, received);
+    }
+
+    command = command.substr(0, command.find_first_of("\r\n"));
+
+    std::string reply = this->handler(command);
+
+    size_t sent = 0;
+    while (sent < reply.size())
+    {
+        ssize_t written = send(connection, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (written <= 0)
+        {
+            break;
+        }
+
+        sent += written;
+    }
+}
+
+#else
+
+bool ControlServer::Start(const std::string& socketPath, CommandHandler handler)
+{
+    printf("ERROR: The control socket is not supported on Windows\n");
+    return false;
+}
+
+void ControlServer::Stop()
+{
+}
+
+void ControlServer::Run()
+{
+}
+
+void ControlServer::HandleConnection(int connection)
+{
+}
+
+#endif
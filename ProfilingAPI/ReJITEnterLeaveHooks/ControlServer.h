@@ -0,0 +1,33 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Serves the local control socket. Each connection carries a single text
+// command line; the reply is written back and the connection is closed.
+// Connections are handled one at a time on the server thread.
+class ControlServer
+{
+public:
+    typedef std::function<std::string(const std::string& command)> CommandHandler;
+
+private:
+    std::string socketPath;
+    CommandHandler handler;
+    std::atomic<bool> stopRequested;
+    std::thread thread;
+    int listenSocket;
+
+    void Run();
+    void HandleConnection(int connection);
+public:
+    ControlServer();
+    ~ControlServer();
+    bool Start(const std::string& socketPath, CommandHandler handler);
+    void Stop();
+};
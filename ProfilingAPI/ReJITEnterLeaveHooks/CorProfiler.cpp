@@ -2,33 +2,176 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "CorProfiler.h"
+#include "CallCounters.h"
+#include "FunctionRegistry.h"
 #include "corhlpr.h"
-#include "CComPtr.h"
-#include "ILRewriter.h"
+#include "Statistics.h"
+#include "Timestamp.h"
+#include "TraceWriter.h"
 #include "profiler_pal.h"
+#include <algorithm>
+#include <cstdarg>
+#include <sstream>
 #include <string>
 
-static void STDMETHODCALLTYPE Enter(FunctionID functionId)
+static std::atomic<bool> tracingEnabled(true);
+static std::atomic<HookMode> hookMode(HookMode::Print);
+static bool counterProbes = false;
+
+static void RecordEnter(UINT32 functionIndex)
 {
-    printf("\r\nEnter %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    HookMode mode = hookMode.load(std::memory_order_relaxed);
+    if (mode == HookMode::Aggregate)
+    {
+        Statistics::Enter(functionIndex);
+    }
+    else if (mode == HookMode::Trace)
+    {
+        TraceWriter::Enter(functionIndex);
+    }
+    else
+    {
+        printf("\r\nEnter %" UINT_PTR_FORMAT "", (UINT64)FunctionRegistry::GetFunctionId(functionIndex));
+    }
 }
 
-static void STDMETHODCALLTYPE Leave(FunctionID functionId)
+static void RecordLeave(UINT32 functionIndex)
 {
-    printf("\r\nLeave %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    HookMode mode = hookMode.load(std::memory_order_relaxed);
+    if (mode == HookMode::Aggregate)
+    {
+        Statistics::Leave(functionIndex);
+    }
+    else if (mode == HookMode::Trace)
+    {
+        TraceWriter::Leave(functionIndex);
+    }
+    else
+    {
+        printf("\r\nLeave %" UINT_PTR_FORMAT "", (UINT64)FunctionRegistry::GetFunctionId(functionIndex));
+    }
 }
 
-COR_SIGNATURE enterLeaveMethodSignature             [] = { IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I };
+static void STDMETHODCALLTYPE Enter(UINT32 functionIndex)
+{
+    if (!tracingEnabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
 
-void(STDMETHODCALLTYPE *EnterMethodAddress)(FunctionID) = &Enter;
-void(STDMETHODCALLTYPE *LeaveMethodAddress)(FunctionID) = &Leave;
+    if (OverheadController::ShouldSample())
+    {
+        UINT64 start = GetTimestamp();
+        RecordEnter(functionIndex);
+        OverheadController::AddProbeSample(GetTimestamp() - start);
+        return;
+    }
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr)
+    RecordEnter(functionIndex);
+}
+
+static void STDMETHODCALLTYPE Leave(UINT32 functionIndex)
+{
+    if (!tracingEnabled.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (OverheadController::ShouldSample())
+    {
+        UINT64 start = GetTimestamp();
+        RecordLeave(functionIndex);
+        OverheadController::AddProbeSample(GetTimestamp() - start);
+        return;
+    }
+
+    RecordLeave(functionIndex);
+}
+
+static bool ParseHookMode(const std::string& value, HookMode* mode)
+{
+    if (value == "print")
+    {
+        *mode = HookMode::Print;
+    }
+    else if (value == "aggregate")
+    {
+        *mode = HookMode::Aggregate;
+    }
+    else if (value == "trace")
+    {
+        *mode = HookMode::Trace;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+static const char* HookModeName(HookMode mode)
+{
+    switch (mode)
+    {
+    case HookMode::Aggregate:
+        return "aggregate";
+    case HookMode::Trace:
+        return "trace";
+    default:
+        return "print";
+    }
+}
+
+static std::string Format(const char* format, ...)
+{
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    return buffer;
+}
+
+// In trace mode the statistics are computed by the trace flusher instead of
+// the probes. Counter probes only count calls.
+static std::vector<FunctionStatistics> SnapshotStatistics()
+{
+    if (counterProbes)
+    {
+        return CallCounters::Snapshot();
+    }
+
+    if (hookMode != HookMode::Trace)
+    {
+        return Statistics::Snapshot();
+    }
+
+    std::vector<FunctionStatistics> statistics;
+    for (const FunctionTotals& totals : TraceWriter::GetStatistics())
+    {
+        statistics.push_back({ FunctionRegistry::GetFunctionId(totals.functionIndex), totals.callCount, totals.inclusiveTime, totals.exclusiveTime });
+    }
+
+    return statistics;
+}
+
+COR_SIGNATURE enterLeaveMethodSignature             [] = { IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U4 };
+
+void(STDMETHODCALLTYPE *EnterMethodAddress)(UINT32) = &Enter;
+void(STDMETHODCALLTYPE *LeaveMethodAddress)(UINT32) = &Leave;
+
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), instrumentOnDemand(false), reJITEnabled(false)
 {
 }
 
 CorProfiler::~CorProfiler()
 {
+    this->controlServer.Stop();
+    this->overheadController.Stop();
+    this->reJITManager.Stop();
+    this->preInstrumenter.Stop();
+
     if (this->corProfilerInfo != nullptr)
     {
         this->corProfilerInfo->Release();
@@ -45,17 +188,137 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
         return E_FAIL;
     }
 
+    const char* instrument = getenv("PROFILER_INSTRUMENT");
+    this->instrumentOnDemand = instrument != nullptr && strcmp(instrument, "rejit") == 0;
+
+    const char* budget = getenv("PROFILER_OVERHEAD_BUDGET");
+    double budgetPercent = budget != nullptr ? strtod(budget, nullptr) : 0;
+    this->reJITEnabled = this->instrumentOnDemand || budgetPercent > 0;
+
+    const char* probes = getenv("PROFILER_PROBES");
+    counterProbes = probes != nullptr && strcmp(probes, "counters") == 0;
+
+    const char* exitProbes = getenv("PROFILER_EXIT_PROBES");
+    bool exitProbesInFinally = exitProbes != nullptr && strcmp(exitProbes, "finally") == 0;
+
+    if (counterProbes)
+    {
+        this->ilPasses.emplace_back(new CounterPass(CallCounters::GetSlot));
+    }
+    else
+    {
+        this->ilPasses.emplace_back(new ProbePass(reinterpret_cast<UINT_PTR>(EnterMethodAddress), reinterpret_cast<UINT_PTR>(LeaveMethodAddress), exitProbesInFinally));
+    }
+
+    const char* ilCachePath = getenv("PROFILER_IL_CACHE");
+    if (ilCachePath != nullptr && *ilCachePath != '\0')
+    {
+        this->ilCache.Open(ilCachePath);
+    }
+
+    const char* ilCorpusPath = getenv("PROFILER_IL_CORPUS");
+    if (ilCorpusPath != nullptr && *ilCorpusPath != '\0')
+    {
+        this->ilCorpus.Open(ilCorpusPath);
+    }
+
     DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION                      |
-                      COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
-                      COR_PRF_DISABLE_INLINING                             ;
+                      COR_PRF_MONITOR_MODULE_LOADS                         |
+                      COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST ; /* helps the case where this profiler is used on Full CLR */
+
+    // Cache searches report the methods that come precompiled from ReadyToRun
+    // images. On demand they can be rejitted like the others; otherwise their
+    // precompiled code is kept or turned down as they are found.
+    eventMask |= COR_PRF_MONITOR_CACHE_SEARCHES;
+
+    if (this->reJITEnabled)
+    {
+        eventMask |= COR_PRF_ENABLE_REJIT;
+    }
 
     auto hr = this->corProfilerInfo->SetEventMask(eventMask);
 
+    this->nameResolver.Initialize(this->corProfilerInfo);
+    this->dynamicMethods.Initialize(this->corProfilerInfo);
+    this->moduleMetadata.Initialize(this->corProfilerInfo, enterLeaveMethodSignature, sizeof(enterLeaveMethodSignature));
+    this->codeVersions.Initialize(this->corProfilerInfo, &this->moduleMetadata);
+
+    const char* precompiled = getenv("PROFILER_PRECOMPILED");
+    this->precompiledCode.Initialize(!this->instrumentOnDemand && precompiled != nullptr && strcmp(precompiled, "reject") == 0);
+
+    const char* minimumILSize = getenv("PROFILER_MIN_IL_SIZE");
+    this->methodFilter.Initialize(this->corProfilerInfo, &this->moduleMetadata, minimumILSize != nullptr ? (ULONG)strtoul(minimumILSize, nullptr, 10) : 16);
+
+    const char* selectRules = getenv("PROFILER_SELECT");
+    this->methodSelector.Initialize(this->corProfilerInfo, &this->moduleMetadata, selectRules != nullptr ? selectRules : "");
+
+    if (this->reJITEnabled)
+    {
+        this->reJITManager.Initialize(this->corProfilerInfo, !this->instrumentOnDemand);
+    }
+
+    const char* preInstrumentThreads = getenv("PROFILER_PREINSTRUMENT");
+    unsigned threadCount = preInstrumentThreads != nullptr ? (unsigned)strtoul(preInstrumentThreads, nullptr, 10) : 0;
+    if (!this->instrumentOnDemand && threadCount > 0)
+    {
+        this->preInstrumenter.Start(threadCount, [this](ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex) {
+            return this->PreInstrumentMethod(moduleId, methodDef, functionIndex);
+        });
+    }
+
+    const char* patterns = getenv("PROFILER_REJIT_PATTERNS");
+    if (this->instrumentOnDemand && patterns != nullptr)
+    {
+        this->reJITManager.AddPatterns(patterns);
+    }
+
+    if (budgetPercent > 0)
+    {
+        const char* interval = getenv("PROFILER_OVERHEAD_INTERVAL_MS");
+        UINT32 intervalMilliseconds = interval != nullptr ? (UINT32)strtoul(interval, nullptr, 10) : 0;
+
+        this->overheadController.Start(budgetPercent, intervalMilliseconds != 0 ? intervalMilliseconds : 1000, SnapshotStatistics,
+            [this](const std::vector<FunctionID>& functionIds) { return this->reJITManager.Revert(functionIds); });
+    }
+
+    const char* mode = getenv("PROFILER_MODE");
+    HookMode initialMode;
+    if (mode != nullptr && ParseHookMode(mode, &initialMode))
+    {
+        this->SetHookMode(initialMode);
+    }
+
+    const char* trace = getenv("PROFILER_TRACE");
+    if (trace != nullptr && strcmp(trace, "0") == 0)
+    {
+        tracingEnabled = false;
+    }
+
+    const char* socketPath = getenv("PROFILER_CONTROL_SOCKET");
+    std::string controlSocketPath = socketPath != nullptr ? socketPath : Format("/tmp/CorProfiler.%u.sock", (unsigned)GetCurrentProcessId());
+    if (!controlSocketPath.empty())
+    {
+        this->controlServer.Start(controlSocketPath, [this](const std::string& command) { return this->HandleControlCommand(command); });
+    }
+
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
 {
+    this->controlServer.Stop();
+    this->overheadController.Stop();
+    this->reJITManager.Stop();
+    this->preInstrumenter.Stop();
+    this->ilCache.Close();
+    this->ilCorpus.Close();
+
+    tracingEnabled = false;
+    TraceWriter::Close();
+
+    this->moduleMetadata.Clear();
+    this->codeVersions.Clear();
+
     if (this->corProfilerInfo != nullptr)
     {
         this->corProfilerInfo->Release();
@@ -112,11 +375,37 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
+    if (SUCCEEDED(hrStatus))
+    {
+        // Modules without metadata, such as resource-only ones, just aren't cached.
+        this->moduleMetadata.ModuleLoaded(moduleId);
+        this->methodSelector.ModuleLoaded(moduleId);
+
+        ModuleMetadata metadata;
+        if (this->preInstrumenter.IsStarted() && SUCCEEDED(this->moduleMetadata.Get(moduleId, &metadata)))
+        {
+            this->preInstrumenter.ModuleLoaded(moduleId, metadata.metadataImport);
+        }
+    }
+
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 {
+    // Before the metadata goes away, since the workers may be using it.
+    this->preInstrumenter.ModuleUnloaded(moduleId);
+
+    this->moduleMetadata.ModuleUnloaded(moduleId);
+    this->methodFilter.ModuleUnloaded(moduleId);
+    this->methodSelector.ModuleUnloaded(moduleId);
+    this->codeVersions.ModuleUnloaded(moduleId);
+
+    if (this->reJITEnabled)
+    {
+        this->reJITManager.ModuleUnloaded(moduleId);
+    }
+
     return S_OK;
 }
 
@@ -157,6 +446,14 @@ HRESULT STDMETHODCALLTYPE CorProfiler::FunctionUnloadStarted(FunctionID function
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
 {
+    this->precompiledCode.CompilationStarted(functionId);
+    this->codeVersions.CompilationStarted(functionId, 0);
+
+    if (this->instrumentOnDemand)
+    {
+        return this->MethodLoaded(functionId);
+    }
+
     HRESULT hr;
     mdToken token;
     ClassID classId;
@@ -164,30 +461,89 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationStarted(FunctionID function
 
     IfFailRet(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token));
 
-    CComPtr<IMetaDataImport> metadataImport;
-    IfFailRet(this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    if (!this->methodSelector.IsSelected(moduleId, token) || this->methodFilter.IsTrivial(moduleId, token))
+    {
+        return S_OK;
+    }
+
+    if (this->reJITEnabled)
+    {
+        // Lets the overhead controller take the probes out again.
+        this->reJITManager.MethodLoaded(functionId, moduleId, token, this->nameResolver.GetFunctionName(functionId));
+    }
 
-    CComPtr<IMetaDataEmit> metadataEmit;
-    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
+    // The IL is only rewritten for the first compilation. The tier1 and
+    // on-stack replacement code, and the other instantiations of a generic
+    // method, are compiled from the same IL and get the same probes.
+    bool rewritten;
+    UINT32 functionIndex = 0;
+    if (!this->codeVersions.BeginRewrite(moduleId, token, &rewritten, &functionIndex))
+    {
+        if (rewritten)
+        {
+            FunctionRegistry::Bind(functionIndex, functionId);
+        }
 
-    mdSignature enterLeaveMethodSignatureToken;
-    metadataEmit->GetTokenFromSig(enterLeaveMethodSignature, sizeof(enterLeaveMethodSignature), &enterLeaveMethodSignatureToken);
+        return S_OK;
+    }
 
-    return RewriteIL(this->corProfilerInfo, nullptr, moduleId, token, functionId, reinterpret_cast<ULONGLONG>(EnterMethodAddress), reinterpret_cast<ULONGLONG>(LeaveMethodAddress), enterLeaveMethodSignatureToken);
+    if (this->preInstrumenter.IsStarted() && this->preInstrumenter.TakeInstrumented(moduleId, token, &functionIndex))
+    {
+        FunctionRegistry::Bind(functionIndex, functionId);
+        this->codeVersions.EndRewrite(moduleId, token, true, functionIndex);
+        return S_OK;
+    }
+
+    hr = this->InstrumentMethod(moduleId, token, functionId, nullptr, &functionIndex);
+    this->codeVersions.EndRewrite(moduleId, token, hr == S_OK, functionIndex);
+    return hr;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
+    this->precompiledCode.CompilationFinished(functionId, hrStatus);
     return S_OK;
 }
 
+// Precompiled code is used without a JITCompilationStarted, so the probes can
+// only get into a selected method by turning its ReadyToRun code down and
+// letting the JIT compile it from the rewritten IL.
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCachedFunctionSearchStarted(FunctionID functionId, BOOL *pbUseCachedFunction)
 {
+    if (this->instrumentOnDemand)
+    {
+        return this->MethodLoaded(functionId);
+    }
+
+    HRESULT hr;
+    mdToken token;
+    ClassID classId;
+    ModuleID moduleId;
+
+    IfFailRet(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token));
+
+    if (!this->methodSelector.IsSelected(moduleId, token) || this->methodFilter.IsTrivial(moduleId, token))
+    {
+        return S_OK;
+    }
+
+    if (this->precompiledCode.Found(functionId))
+    {
+        *pbUseCachedFunction = FALSE;
+    }
+
     return S_OK;
 }
 
+// Only a search that found the code tells it was used; a function whose
+// precompiled code was turned down starts at tier0 like any other.
 HRESULT STDMETHODCALLTYPE CorProfiler::JITCachedFunctionSearchFinished(FunctionID functionId, COR_PRF_JIT_CACHE result)
 {
+    if (result == COR_PRF_CACHED_FUNCTION_FOUND)
+    {
+        this->codeVersions.PrecompiledCodeUsed(functionId);
+    }
+
     return S_OK;
 }
 
@@ -196,8 +552,37 @@ HRESULT STDMETHODCALLTYPE CorProfiler::JITFunctionPitched(FunctionID functionId)
     return S_OK;
 }
 
+// Inlined code runs without the callee's probes, so only callees that won't
+// be instrumented are left to the JIT's own inlining decisions.
 HRESULT STDMETHODCALLTYPE CorProfiler::JITInlining(FunctionID callerId, FunctionID calleeId, BOOL *pfShouldInline)
 {
+    HRESULT hr;
+    mdToken token;
+    ClassID classId;
+    ModuleID moduleId;
+
+    IfFailRet(this->corProfilerInfo->GetFunctionInfo(calleeId, &classId, &moduleId, &token));
+
+    if (!this->methodSelector.IsSelected(moduleId, token) || this->methodFilter.IsTrivial(moduleId, token))
+    {
+        return S_OK;
+    }
+
+    if (this->instrumentOnDemand && !this->reJITManager.IsSelected(moduleId, token, this->nameResolver.GetFunctionName(calleeId)))
+    {
+        return S_OK;
+    }
+
+    // Once the callee's IL has the probes, they come along when it is
+    // inlined, so optimized callers can inline it as they would without a
+    // profiler. Not if a rejit may take the probes out of the callee later,
+    // which the inlined copies wouldn't follow.
+    if (!this->reJITEnabled && this->codeVersions.IsRewritten(moduleId, token))
+    {
+        return S_OK;
+    }
+
+    *pfShouldInline = FALSE;
     return S_OK;
 }
 
@@ -473,12 +858,29 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ProfilerDetachSucceeded()
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationStarted(FunctionID functionId, ReJITID rejitId, BOOL fIsSafeToBlock)
 {
+    this->codeVersions.CompilationStarted(functionId, rejitId);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl *pFunctionControl)
 {
-    return S_OK;
+    FunctionID functionId;
+    if (!this->reJITManager.GetInstrumentedFunction(moduleId, methodId, &functionId))
+    {
+        // A method instrumented at its first JIT keeps the rewritten IL unless
+        // it is handed its original IL back. Instrumented on demand, leaving
+        // the IL alone is enough.
+        std::vector<BYTE> originalBody;
+        if (this->reJITManager.GetOriginalIL(moduleId, methodId, &originalBody))
+        {
+            return pFunctionControl->SetILFunctionBody((ULONG)originalBody.size(), originalBody.data());
+        }
+
+        return S_OK;
+    }
+
+    UINT32 functionIndex;
+    return this->InstrumentMethod(moduleId, methodId, functionId, pFunctionControl, &functionIndex);
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
@@ -488,6 +890,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ReJITCompilationFinished(FunctionID funct
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ReJITError(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus)
 {
+    printf("ERROR: ReJIT of %s failed (HRESULT: 0x%08x)\r\n", this->nameResolver.GetFunctionName(functionId).c_str(), (unsigned)hrStatus);
     return S_OK;
 }
 
@@ -518,12 +921,370 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleInMemorySymbolsUpdated(ModuleID mod
 
 HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock, LPCBYTE ilHeader, ULONG cbILHeader)
 {
+    // cbILHeader is the size of the whole IL body, not just its header.
+    this->dynamicMethods.CompilationStarted(functionId, cbILHeader);
+
     printf("\r\nDynamic Function JIT Compilation Started. %" UINT_PTR_FORMAT "", (UINT64)functionId);
     return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::DynamicMethodJITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
 {
-    printf("\r\nDynamic Function JIT Compilation Finished. %" UINT_PTR_FORMAT "", (UINT64)functionId);
+    DynamicMethodInfo info;
+    if (!this->dynamicMethods.CompilationFinished(functionId, hrStatus, &info))
+    {
+        printf("\r\nDynamic Function JIT Compilation Finished. %" UINT_PTR_FORMAT "", (UINT64)functionId);
+        return S_OK;
+    }
+
+    printf("\r\nDynamic Function JIT Compilation Finished. %" UINT_PTR_FORMAT " %s, IL %u bytes, JIT %llu us, code 0x%" UINT_PTR_FORMAT "-0x%" UINT_PTR_FORMAT "",
+        (UINT64)functionId, info.name.c_str(), (unsigned)info.ilSize, (unsigned long long)(info.jitTime / 1000),
+        (UINT64)info.codeStart, (UINT64)(info.codeStart + info.codeSize));
+    return S_OK;
+}
+
+std::string CorProfiler::HandleControlCommand(const std::string& command)
+{
+    std::istringstream arguments(command);
+    std::string verb;
+    arguments >> verb;
+
+    if (verb == "start" || verb == "stop")
+    {
+        tracingEnabled = (verb == "start");
+
+        if (!tracingEnabled)
+        {
+            TraceWriter::Flush();
+        }
+
+        return Format("tracing %s\n", tracingEnabled ? "started" : "stopped");
+    }
+
+    if (verb == "mode")
+    {
+        std::string value;
+        arguments >> value;
+
+        HookMode newMode;
+        if (!ParseHookMode(value, &newMode))
+        {
+            return "error: expected 'mode print', 'mode aggregate' or 'mode trace'\n";
+        }
+
+        if (!this->SetHookMode(newMode))
+        {
+            return "error: could not create the trace file\n";
+        }
+
+        return Format("mode %s\n", HookModeName(newMode));
+    }
+
+    if (verb == "reset")
+    {
+        CallCounters::Reset();
+        Statistics::Reset();
+        TraceWriter::ResetStatistics();
+        return "counters reset\n";
+    }
+
+    if (verb == "status")
+    {
+        std::string reply = counterProbes ? "probes counters\n" : Format("tracing %s, mode %s\n", tracingEnabled ? "on" : "off", HookModeName(hookMode));
+        if (TraceWriter::IsOpen())
+        {
+            reply += Format("trace events written %llu (%llu bytes), dropped %llu\n",
+                (unsigned long long)TraceWriter::GetWrittenEvents(), (unsigned long long)TraceWriter::GetWrittenBytes(),
+                (unsigned long long)TraceWriter::GetDroppedEvents());
+        }
+
+        if (this->overheadController.IsRunning())
+        {
+            reply += Format("overhead budget %.2f%%, probe cost %llu ns, methods reverted %llu\n", this->overheadController.GetBudget(),
+                (unsigned long long)OverheadController::GetProbeCost(), (unsigned long long)this->overheadController.GetRevertedMethods());
+        }
+
+        UINT64 jitCounts[(size_t)CodeVersions::Tier::Count];
+        this->codeVersions.GetJitCounts(jitCounts);
+        reply += Format("tiered compilation %s, jitted tier0 %llu, tier1 %llu, optimized %llu\n", this->codeVersions.IsTiered() ? "on" : "off",
+            (unsigned long long)jitCounts[(size_t)CodeVersions::Tier::Tier0], (unsigned long long)jitCounts[(size_t)CodeVersions::Tier::Tier1],
+            (unsigned long long)jitCounts[(size_t)CodeVersions::Tier::Optimized]);
+
+        if (!this->instrumentOnDemand)
+        {
+            PrecompiledCodeStatistics precompiled = this->precompiledCode.GetStatistics();
+            reply += Format("precompiled code of selected methods kept %llu, rejected %llu, jitted %llu in %llu us\n",
+                (unsigned long long)precompiled.kept, (unsigned long long)precompiled.rejected,
+                (unsigned long long)precompiled.jitted, (unsigned long long)(precompiled.jitTime / 1000));
+        }
+
+        return reply;
+    }
+
+    if (verb == "dump")
+    {
+        std::vector<FunctionStatistics> statistics = SnapshotStatistics();
+
+        std::string reply = "function_id\tcalls\tinclusive_ns\texclusive_ns\tname\n";
+        for (const FunctionStatistics& function : statistics)
+        {
+            reply += Format("0x%" UINT_PTR_FORMAT "\t%llu\t%llu\t%llu\t", (UINT64)function.functionId,
+                (unsigned long long)function.callCount, (unsigned long long)function.inclusiveTime, (unsigned long long)function.exclusiveTime);
+            reply += this->nameResolver.GetFunctionName(function.functionId) + "\n";
+        }
+
+        return reply;
+    }
+
+    if (verb == "top")
+    {
+        size_t count = 20;
+        arguments >> count;
+
+        std::vector<FunctionStatistics> statistics = SnapshotStatistics();
+        std::sort(statistics.begin(), statistics.end(), [](const FunctionStatistics& left, const FunctionStatistics& right) {
+            return left.exclusiveTime != right.exclusiveTime ? left.exclusiveTime > right.exclusiveTime : left.callCount > right.callCount;
+        });
+
+        std::string reply = Format("%14s %14s %14s  %s\n", "calls", "exclusive ms", "inclusive ms", "function");
+        for (size_t i = 0; i < statistics.size() && i < count; i++)
+        {
+            const FunctionStatistics& function = statistics[i];
+            reply += Format("%14llu %14.3f %14.3f  ", (unsigned long long)function.callCount,
+                function.exclusiveTime / 1e6, function.inclusiveTime / 1e6);
+            reply += this->nameResolver.GetFunctionName(function.functionId) + "\n";
+        }
+
+        return reply;
+    }
+
+    if (verb == "histogram")
+    {
+        if (hookMode != HookMode::Trace)
+        {
+            return "error: histograms are only collected in trace mode\n";
+        }
+
+        size_t count = 5;
+        arguments >> count;
+
+        std::vector<FunctionTotals> statistics = TraceWriter::GetStatistics();
+        std::sort(statistics.begin(), statistics.end(), [](const FunctionTotals& left, const FunctionTotals& right) {
+            return left.exclusiveTime > right.exclusiveTime;
+        });
+
+        std::string reply;
+        for (size_t i = 0; i < statistics.size() && i < count; i++)
+        {
+            const FunctionTotals& function = statistics[i];
+            reply += this->nameResolver.GetFunctionName(FunctionRegistry::GetFunctionId(function.functionIndex)) + "\n";
+
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            {
+                if (function.histogram[bucket] != 0)
+                {
+                    reply += Format("  >= %12llu ns %12llu\n", 1ULL << bucket, (unsigned long long)function.histogram[bucket]);
+                }
+            }
+        }
+
+        return reply;
+    }
+
+    if (verb == "dynamic")
+    {
+        std::string reply = "function_id\til_bytes\tjit_us\tcode_start\tcode_size\tname\n";
+        for (const DynamicMethodInfo& method : this->dynamicMethods.Snapshot())
+        {
+            reply += Format("0x%" UINT_PTR_FORMAT "\t%u\t%llu\t0x%" UINT_PTR_FORMAT "\t%llu\t%s\n", (UINT64)method.functionId, (unsigned)method.ilSize,
+                (unsigned long long)(method.jitTime / 1000), (UINT64)method.codeStart, (unsigned long long)method.codeSize, method.name.c_str());
+        }
+
+        return reply;
+    }
+
+    if (verb == "jit")
+    {
+        std::string reply = "function_id\tjit_count\ttier\trejit_id\tcode_versions\tname\n";
+        for (const CodeVersions::FunctionCode& function : this->codeVersions.GetFunctions())
+        {
+            reply += Format("0x%" UINT_PTR_FORMAT "\t%u\t%s\t%llu\t%u\t", (UINT64)function.functionId, (unsigned)function.jitCount,
+                CodeVersions::GetTierName(function.tier), (unsigned long long)function.reJITId, (unsigned)this->codeVersions.GetCodeCount(function.functionId, function.reJITId));
+            reply += this->nameResolver.GetFunctionName(function.functionId) + "\n";
+        }
+
+        return reply;
+    }
+
+    if (verb == "instrument" || verb == "uninstrument")
+    {
+        std::string pattern;
+        arguments >> pattern;
+
+        if (!this->reJITEnabled)
+        {
+            return "error: rejit is only enabled with PROFILER_INSTRUMENT=rejit or PROFILER_OVERHEAD_BUDGET\n";
+        }
+
+        if (pattern.empty())
+        {
+            return Format("error: expected '%s <pattern>'\n", verb.c_str());
+        }
+
+        size_t count = verb == "instrument" ? this->reJITManager.Instrument(pattern) : this->reJITManager.Uninstrument(pattern);
+        return Format("%s %zu methods\n", verb == "instrument" ? "instrumenting" : "reverting", count);
+    }
+
+    if (verb == "budget")
+    {
+        double percent = 0;
+        arguments >> percent;
+
+        if (!this->overheadController.IsRunning())
+        {
+            return "error: the overhead budget is only enforced with PROFILER_OVERHEAD_BUDGET\n";
+        }
+
+        if (percent <= 0)
+        {
+            return "error: expected 'budget <percent>'\n";
+        }
+
+        this->overheadController.SetBudget(percent);
+        return Format("overhead budget %.2f%%\n", percent);
+    }
+
+    if (verb == "instrumented")
+    {
+        std::string reply;
+        for (const std::string& pattern : this->reJITManager.GetPatterns())
+        {
+            reply += "pattern " + pattern + "\n";
+        }
+
+        for (const std::string& name : this->reJITManager.GetInstrumentedNames())
+        {
+            reply += name + "\n";
+        }
+
+        return reply;
+    }
+
+    return "commands: start | stop | mode print|aggregate|trace | reset | status | top [count] | dump | histogram [count] | dynamic | jit | instrument <pattern> | uninstrument <pattern> | instrumented | budget <percent>\n";
+}
+
+HRESULT CorProfiler::InstrumentMethod(ModuleID moduleId, mdMethodDef methodDef, FunctionID functionId, ICorProfilerFunctionControl* functionControl, UINT32* functionIndex)
+{
+    if (!FunctionRegistry::Register(functionId, functionIndex))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return this->RewriteMethod(moduleId, methodDef, *functionIndex, functionControl);
+}
+
+// Runs on the pre-instrumentation workers, before the method has a FunctionID.
+HRESULT CorProfiler::PreInstrumentMethod(ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex)
+{
+    if (!this->methodSelector.IsSelected(moduleId, methodDef) || this->methodFilter.IsTrivial(moduleId, methodDef))
+    {
+        return S_FALSE;
+    }
+
+    if (!FunctionRegistry::Reserve(functionIndex))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return this->RewriteMethod(moduleId, methodDef, *functionIndex, nullptr);
+}
+
+HRESULT CorProfiler::RewriteMethod(ModuleID moduleId, mdMethodDef methodDef, UINT32 functionIndex, ICorProfilerFunctionControl* functionControl)
+{
+    HRESULT hr;
+
+    ModuleMetadata metadata;
+    IfFailRet(this->moduleMetadata.Get(moduleId, &metadata));
+
+    ModuleILMetadata ilMetadata(metadata.metadataImport, metadata.metadataEmit);
+    ILMethod method = { moduleId, methodDef, functionIndex, &ilMetadata, metadata.enterLeaveSignatureToken, metadata.moduleVersionId };
+
+    // With rejit enabled, a method instrumented at its first JIT may have its
+    // probes taken out and put back later. The runtime only has the rewritten
+    // IL by then, so both start from a copy of the original.
+    LPCBYTE body = nullptr;
+    ULONG bodySize = 0;
+    std::vector<BYTE> originalBody;
+    if (functionControl != nullptr && this->reJITManager.GetOriginalIL(moduleId, methodDef, &originalBody))
+    {
+        body = originalBody.data();
+        bodySize = (ULONG)originalBody.size();
+    }
+    else if (functionControl == nullptr && this->reJITEnabled)
+    {
+        IfFailRet(this->corProfilerInfo->GetILFunctionBody(moduleId, methodDef, &body, &bodySize));
+        this->reJITManager.SaveOriginalIL(moduleId, methodDef, body, bodySize);
+    }
+
+    LPCBYTE replacedBody = originalBody.empty() ? nullptr : body;
+
+    if (!this->ilCorpus.IsOpen())
+    {
+        return RewriteIL(this->corProfilerInfo, functionControl, method, this->ilPasses, this->ilCache.IsOpen() ? &this->ilCache : nullptr, replacedBody);
+    }
+
+    // The original body stays where it is after the rewrite. It isn't looked
+    // up in the IL cache, which would skip the metadata reads.
+    if (body == nullptr)
+    {
+        IfFailRet(this->corProfilerInfo->GetILFunctionBody(moduleId, methodDef, &body, &bodySize));
+    }
+
+    ILCorpusRecorder recorder(&ilMetadata);
+    method.pMetadata = &recorder;
+
+    hr = RewriteIL(this->corProfilerInfo, functionControl, method, this->ilPasses, nullptr, replacedBody);
+    if (hr == S_OK)
+    {
+        this->ilCorpus.Add(methodDef, method.probeSignature, body, bodySize, recorder);
+    }
+
+    return hr;
+}
+
+// Only used when instrumenting on demand: the method runs uninstrumented
+// until the ReJITManager decides otherwise.
+HRESULT CorProfiler::MethodLoaded(FunctionID functionId)
+{
+    HRESULT hr;
+    mdToken token;
+    ClassID classId;
+    ModuleID moduleId;
+
+    IfFailRet(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token));
+
+    if (!this->methodSelector.IsSelected(moduleId, token) || this->methodFilter.IsTrivial(moduleId, token))
+    {
+        return S_OK;
+    }
+
+    this->reJITManager.MethodLoaded(functionId, moduleId, token, this->nameResolver.GetFunctionName(functionId));
     return S_OK;
-}
\ No newline at end of file
+}
+
+bool CorProfiler::SetHookMode(HookMode mode)
+{
+    if (mode == HookMode::Trace && !TraceWriter::IsOpen())
+    {
+        const char* tracePath = getenv("PROFILER_TRACE_FILE");
+        std::string traceFilePath = tracePath != nullptr ? tracePath : Format("CorProfiler.%u.trace", (unsigned)GetCurrentProcessId());
+
+        if (!TraceWriter::Open(traceFilePath, [this](FunctionID functionId) { return this->nameResolver.GetFunctionName(functionId); }))
+        {
+            return false;
+        }
+    }
+
+    hookMode = mode;
+    return true;
+}
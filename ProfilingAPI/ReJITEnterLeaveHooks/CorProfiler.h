@@ -4,14 +4,61 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 #include "cor.h"
 #include "corprof.h"
+#include "CodeVersions.h"
+#include "ControlServer.h"
+#include "DynamicMethods.h"
+#include "ILCache.h"
+#include "ILCorpus.h"
+#include "ILRewriter.h"
+#include "MethodFilter.h"
+#include "MethodSelector.h"
+#include "ModuleMetadataCache.h"
+#include "NameResolver.h"
+#include "OverheadController.h"
+#include "PrecompiledCode.h"
+#include "PreInstrumenter.h"
+#include "ReJITManager.h"
+
+enum class HookMode
+{
+    Print,      // print every Enter/Leave to stdout
+    Aggregate,  // only accumulate per-function statistics
+    Trace,      // write every Enter/Leave to the binary trace file
+};
 
 class CorProfiler : public ICorProfilerCallback8
 {
 private:
     std::atomic<int> refCount;
     ICorProfilerInfo8* corProfilerInfo;
+    ControlServer controlServer;
+    NameResolver nameResolver;
+    DynamicMethods dynamicMethods;
+    ModuleMetadataCache moduleMetadata;
+    MethodFilter methodFilter;
+    MethodSelector methodSelector;
+    CodeVersions codeVersions;
+    PrecompiledCode precompiledCode;
+    ReJITManager reJITManager;
+    OverheadController overheadController;
+    PreInstrumenter preInstrumenter;
+    bool instrumentOnDemand;
+    bool reJITEnabled;          // on demand, or to enforce the overhead budget
+    std::vector<std::unique_ptr<ILPass>> ilPasses;
+    ILCache ilCache;
+    ILCorpusWriter ilCorpus;
+
+    HRESULT InstrumentMethod(ModuleID moduleId, mdMethodDef methodDef, FunctionID functionId, ICorProfilerFunctionControl* functionControl, UINT32* functionIndex);
+    HRESULT PreInstrumentMethod(ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex);
+    HRESULT RewriteMethod(ModuleID moduleId, mdMethodDef methodDef, UINT32 functionIndex, ICorProfilerFunctionControl* functionControl);
+    HRESULT MethodLoaded(FunctionID functionId);
+    std::string HandleControlCommand(const std::string& command);
+    bool SetHookMode(HookMode mode);
 public:
     CorProfiler();
     virtual ~CorProfiler();
@@ -0,0 +1,100 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "DynamicMethods.h"
+#include "Timestamp.h"
+#include "profiler_pal.h"
+
+#define MAX_CODE_RANGES 16
+
+DynamicMethods::DynamicMethods() : corProfilerInfo(nullptr), nextOrdinal(1)
+{
+}
+
+void DynamicMethods::Initialize(ICorProfilerInfo8* corProfilerInfo)
+{
+    this->corProfilerInfo = corProfilerInfo;
+}
+
+void DynamicMethods::CompilationStarted(FunctionID functionId, ULONG ilSize)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->pending[functionId] = std::make_pair(ilSize, GetTimestamp());
+}
+
+bool DynamicMethods::CompilationFinished(FunctionID functionId, HRESULT hrStatus, DynamicMethodInfo* info)
+{
+    UINT64 now = GetTimestamp();
+    std::pair<ULONG, UINT64> started;
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto found = this->pending.find(functionId);
+        if (found == this->pending.end())
+        {
+            return false;
+        }
+
+        started = found->second;
+        this->pending.erase(found);
+    }
+
+    if (FAILED(hrStatus) || this->corProfilerInfo == nullptr)
+    {
+        return false;
+    }
+
+    // Code may be split into hot and cold ranges; only the first one, which
+    // holds the entry point, is tracked.
+    COR_PRF_CODE_INFO codeInfos[MAX_CODE_RANGES];
+    ULONG32 codeInfoCount = 0;
+    if (FAILED(this->corProfilerInfo->GetCodeInfo2(functionId, MAX_CODE_RANGES, &codeInfoCount, codeInfos)) || codeInfoCount == 0)
+    {
+        return false;
+    }
+
+    info->functionId = functionId;
+    info->ilSize = started.first;
+    info->jitTime = now - started.second;
+    info->codeStart = codeInfos[0].startAddress;
+    info->codeSize = codeInfos[0].size;
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    char name[64];
+    sprintf(name, "<dynamic>::DynamicMethod#%u", this->nextOrdinal++);
+    info->name = name;
+
+    // A collected dynamic method's code can be reused by a new one, so drop
+    // whatever the new range overlaps.
+    auto next = this->methods.lower_bound(info->codeStart);
+    if (next != this->methods.begin())
+    {
+        auto previous = std::prev(next);
+        if (previous->second.codeStart + previous->second.codeSize > info->codeStart)
+        {
+            next = previous;
+        }
+    }
+
+    while (next != this->methods.end() && next->second.codeStart < info->codeStart + info->codeSize)
+    {
+        next = this->methods.erase(next);
+    }
+
+    this->methods[info->codeStart] = *info;
+    return true;
+}
+
+std::vector<DynamicMethodInfo> DynamicMethods::Snapshot()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    std::vector<DynamicMethodInfo> result;
+    for (auto& entry : this->methods)
+    {
+        result.push_back(entry.second);
+    }
+
+    return result;
+}
@@ -0,0 +1,48 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+struct DynamicMethodInfo
+{
+    FunctionID functionId;
+    std::string name;       // synthetic, dynamic methods have no metadata
+    ULONG ilSize;
+    UINT64 jitTime;         // nanoseconds
+    UINT_PTR codeStart;
+    SIZE_T codeSize;        // size of the range holding the entry point
+};
+
+// Keeps track of dynamic methods (LightweightCodeGen: expression trees,
+// compiled regexes, serializer-generated code, ...), which never show up in
+// JITCompilationStarted and have no metadata to take a name from. Every
+// method gets a synthetic name, and its native code range is recorded for the
+// dynamic control command. They are never instrumented, so they don't show up in
+// the statistics or the trace.
+class DynamicMethods
+{
+private:
+    ICorProfilerInfo8* corProfilerInfo;
+    std::mutex lock;
+    std::unordered_map<FunctionID, std::pair<ULONG, UINT64>> pending; // IL size and start time of methods being jitted
+    std::map<UINT_PTR, DynamicMethodInfo> methods;                    // by codeStart
+    UINT32 nextOrdinal;
+public:
+    DynamicMethods();
+    void Initialize(ICorProfilerInfo8* corProfilerInfo);
+
+    void CompilationStarted(FunctionID functionId, ULONG ilSize);
+
+    // Returns false if the method wasn't compiled, or its code couldn't be found.
+    bool CompilationFinished(FunctionID functionId, HRESULT hrStatus, DynamicMethodInfo* info);
+
+    std::vector<DynamicMethodInfo> Snapshot();
+};
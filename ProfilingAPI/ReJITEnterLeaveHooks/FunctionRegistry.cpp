@@ -0,0 +1,87 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "FunctionRegistry.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define MAX_CHUNKS 4096 // 16M functions
+
+static std::mutex lock;
+static std::unordered_map<FunctionID, UINT32> indexes;
+static std::atomic<FunctionID*> chunks[MAX_CHUNKS];
+static std::atomic<UINT32> count(0);
+
+// Must be called with the lock held.
+static bool AddFunction(FunctionID functionId, UINT32* functionIndex)
+{
+    UINT32 index = count.load(std::memory_order_relaxed);
+    if ((index >> CHUNK_BITS) >= MAX_CHUNKS)
+    {
+        return false;
+    }
+
+    FunctionID* chunk = chunks[index >> CHUNK_BITS].load(std::memory_order_relaxed);
+    if (chunk == nullptr)
+    {
+        chunk = new FunctionID[CHUNK_SIZE]();
+        chunks[index >> CHUNK_BITS].store(chunk, std::memory_order_release);
+    }
+
+    chunk[index & (CHUNK_SIZE - 1)] = functionId;
+    count.store(index + 1, std::memory_order_release);
+
+    *functionIndex = index;
+    return true;
+}
+
+bool FunctionRegistry::Register(FunctionID functionId, UINT32* functionIndex)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = indexes.find(functionId);
+    if (found != indexes.end())
+    {
+        *functionIndex = found->second;
+        return true;
+    }
+
+    if (!AddFunction(functionId, functionIndex))
+    {
+        return false;
+    }
+
+    indexes[functionId] = *functionIndex;
+    return true;
+}
+
+bool FunctionRegistry::Reserve(UINT32* functionIndex)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return AddFunction(0, functionIndex);
+}
+
+void FunctionRegistry::Bind(UINT32 functionIndex, FunctionID functionId)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    FunctionID* slot = chunks[functionIndex >> CHUNK_BITS].load(std::memory_order_relaxed) + (functionIndex & (CHUNK_SIZE - 1));
+    if (*slot == 0)
+    {
+        *slot = functionId;
+        indexes.insert({ functionId, functionIndex });
+    }
+}
+
+FunctionID FunctionRegistry::GetFunctionId(UINT32 functionIndex)
+{
+    return chunks[functionIndex >> CHUNK_BITS].load(std::memory_order_acquire)[functionIndex & (CHUNK_SIZE - 1)];
+}
+
+UINT32 FunctionRegistry::GetCount()
+{
+    return count.load(std::memory_order_acquire);
+}
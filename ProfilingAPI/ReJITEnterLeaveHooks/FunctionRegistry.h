@@ -0,0 +1,31 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include "cor.h"
+#include "corprof.h"
+
+// Gives every instrumented function a dense 32-bit index when its IL is
+// rewritten. The probes carry the index instead of the FunctionID, so
+// per-function data on the native side lives in flat arrays instead of hash
+// tables. Indexes are never reused.
+class FunctionRegistry
+{
+public:
+    // Returns the same index for every call with the same function; false
+    // once the registry is full.
+    static bool Register(FunctionID functionId, UINT32* functionIndex);
+
+    // Hands out an index before the function is known, for IL rewritten
+    // ahead of its first JIT. Bind attaches the first function jitted from
+    // that IL; later instantiations share its index.
+    static bool Reserve(UINT32* functionIndex);
+    static void Bind(UINT32 functionIndex, FunctionID functionId);
+
+    // Lock-free; the index must come from Register or Reserve. Returns 0 for
+    // a reserved index until it is bound.
+    static FunctionID GetFunctionId(UINT32 functionIndex);
+
+    static UINT32 GetCount();
+};
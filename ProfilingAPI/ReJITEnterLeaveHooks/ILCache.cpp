@@ -0,0 +1,391 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "ILCache.h"
+#include "profiler_pal.h"
+
+#ifndef WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+// Records are written in batches of whole records, so a process that dies
+// halfway through a run leaves a file that can still be read.
+#define ILCACHE_FLUSH_SIZE  (64 * 1024)
+
+// Every process started with the same cache file appends to it. A batch is
+// written under an exclusive advisory lock, and the file is mapped under a
+// shared one, so a batch is never interleaved with another process's, nor
+// read while it is half written.
+#ifndef WIN32
+
+typedef int LockHandle;
+
+static LockHandle GetLockHandle(FILE* file)
+{
+    return fileno(file);
+}
+
+static void LockCacheFile(LockHandle handle, bool exclusive)
+{
+    while (flock(handle, exclusive ? LOCK_EX : LOCK_SH) != 0 && errno == EINTR)
+    {
+    }
+}
+
+static void UnlockCacheFile(LockHandle handle)
+{
+    flock(handle, LOCK_UN);
+}
+
+static bool MoveOver(const std::string& from, const std::string& to)
+{
+    return rename(from.c_str(), to.c_str()) == 0;
+}
+
+#else
+
+typedef HANDLE LockHandle;
+
+// Windows locks are mandatory, so a byte far past the end of any cache file
+// stands for the whole file.
+#define ILCACHE_LOCK_OFFSET_HIGH    0x7FFFFFFF
+
+static LockHandle GetLockHandle(FILE* file)
+{
+    return (HANDLE)_get_osfhandle(_fileno(file));
+}
+
+static void LockCacheFile(LockHandle handle, bool exclusive)
+{
+    OVERLAPPED overlapped = {};
+    overlapped.OffsetHigh = ILCACHE_LOCK_OFFSET_HIGH;
+    LockFileEx(handle, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &overlapped);
+}
+
+static void UnlockCacheFile(LockHandle handle)
+{
+    OVERLAPPED overlapped = {};
+    overlapped.OffsetHigh = ILCACHE_LOCK_OFFSET_HIGH;
+    UnlockFileEx(handle, 0, 1, 0, &overlapped);
+}
+
+static bool MoveOver(const std::string& from, const std::string& to)
+{
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+#endif
+
+static UINT64 GetRecordSize(const ILCacheRecordHeader* record)
+{
+    UINT64 size = sizeof(ILCacheRecordHeader) + (UINT64)record->fixupCount * sizeof(ILFixup) + record->bodySize + record->localVarSigSize;
+    return (size + 7) & ~(UINT64)7;
+}
+
+ILCache::ILCache() : mapping(nullptr), mappingSize(0),
+#ifdef WIN32
+    mappingHandle(NULL),
+#endif
+    file(nullptr)
+{
+}
+
+ILCache::~ILCache()
+{
+    this->Close();
+}
+
+#ifndef WIN32
+
+bool ILCache::Map(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    LockCacheFile(fd, false);
+
+    // The mapping keeps the open file alive, and the lock with it, so the
+    // lock has to be released explicitly.
+    struct stat status;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(ILCacheFileHeader))
+    {
+        view = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    UnlockCacheFile(fd);
+    close(fd);
+
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+
+    this->mapping = static_cast<const BYTE*>(view);
+    this->mappingSize = (size_t)status.st_size;
+    return true;
+}
+
+void ILCache::Unmap()
+{
+    if (this->mapping != nullptr)
+    {
+        munmap(const_cast<BYTE*>(this->mapping), this->mappingSize);
+        this->mapping = nullptr;
+        this->mappingSize = 0;
+    }
+}
+
+#else
+
+bool ILCache::Map(const std::string& path)
+{
+    HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LockCacheFile(fileHandle, false);
+
+    // Maps the size read under the lock, not whatever was appended since.
+    LARGE_INTEGER size;
+    this->mappingHandle = NULL;
+    if (GetFileSizeEx(fileHandle, &size) && (UINT64)size.QuadPart >= sizeof(ILCacheFileHeader) && (UINT64)size.QuadPart <= SIZE_MAX)
+    {
+        this->mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, size.HighPart, size.LowPart, NULL);
+    }
+
+    UnlockCacheFile(fileHandle);
+    CloseHandle(fileHandle);
+
+    if (this->mappingHandle == NULL)
+    {
+        return false;
+    }
+
+    const void* view = MapViewOfFile(this->mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        CloseHandle(this->mappingHandle);
+        this->mappingHandle = NULL;
+        return false;
+    }
+
+    this->mapping = static_cast<const BYTE*>(view);
+    this->mappingSize = (size_t)size.QuadPart;
+    return true;
+}
+
+void ILCache::Unmap()
+{
+    if (this->mapping != nullptr)
+    {
+        UnmapViewOfFile(this->mapping);
+        CloseHandle(this->mappingHandle);
+        this->mapping = nullptr;
+        this->mappingSize = 0;
+        this->mappingHandle = NULL;
+    }
+}
+
+#endif
+
+// Fails if the file was written by another version or pointer size, or if
+// its last record is incomplete; such a file is started over.
+bool ILCache::Index()
+{
+    const ILCacheFileHeader* header = reinterpret_cast<const ILCacheFileHeader*>(this->mapping);
+    if (header->magic != ILCACHE_FILE_MAGIC || header->version != ILCACHE_FILE_VERSION || header->pointerSize != sizeof(UINT_PTR))
+    {
+        return false;
+    }
+
+    size_t offset = sizeof(ILCacheFileHeader);
+    while (offset < this->mappingSize)
+    {
+        if (this->mappingSize - offset < sizeof(ILCacheRecordHeader))
+        {
+            return false;
+        }
+
+        const ILCacheRecordHeader* record = reinterpret_cast<const ILCacheRecordHeader*>(this->mapping + offset);
+        UINT64 recordSize = GetRecordSize(record);
+        if (recordSize > this->mappingSize - offset)
+        {
+            return false;
+        }
+
+        this->records[{ record->moduleVersionId, record->methodDef }] = record;
+        offset += (size_t)recordSize;
+    }
+
+    return true;
+}
+
+bool ILCache::Open(const std::string& path)
+{
+    bool reuse = this->Map(path);
+    if (reuse && !this->Index())
+    {
+        printf("ERROR: The IL cache %s is from another version or incomplete, starting over\n", path.c_str());
+        reuse = false;
+    }
+
+    if (!reuse)
+    {
+        this->records.clear();
+        this->Unmap();
+    }
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (!reuse && !this->StartOver(path))
+    {
+        printf("ERROR: Could not create the IL cache %s\n", path.c_str());
+        return false;
+    }
+
+    this->file = fopen(path.c_str(), "ab");
+    if (this->file == nullptr)
+    {
+        printf("ERROR: Could not open the IL cache %s\n", path.c_str());
+        this->records.clear();
+        this->Unmap();
+        return false;
+    }
+
+    return true;
+}
+
+// Other processes may still be appending to the file, or serving records from
+// their mapping of it, so it isn't truncated; a new file is written next to it
+// and moved over it. Whatever they append from then on goes to the old file.
+bool ILCache::StartOver(const std::string& path)
+{
+    char suffix[32];
+    sprintf(suffix, ".%u.tmp", (unsigned)GetCurrentProcessId());
+    std::string newPath = path + suffix;
+
+    FILE* newFile = fopen(newPath.c_str(), "wb");
+    if (newFile == nullptr)
+    {
+        return false;
+    }
+
+    ILCacheFileHeader header = { ILCACHE_FILE_MAGIC, ILCACHE_FILE_VERSION, sizeof(UINT_PTR) };
+    bool written = fwrite(&header, sizeof(header), 1, newFile) == 1;
+    written = fclose(newFile) == 0 && written;
+
+    if (!written || !MoveOver(newPath, path))
+    {
+        remove(newPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void ILCache::Close()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        if (this->file != nullptr)
+        {
+            this->Flush();
+            fclose(this->file);
+            this->file = nullptr;
+        }
+    }
+
+    this->records.clear();
+    this->Unmap();
+}
+
+bool ILCache::IsOpen()
+{
+    return this->file != nullptr;
+}
+
+bool ILCache::Find(const GUID& moduleVersionId, mdMethodDef methodDef, UINT64 hash, ILCacheEntry* entry)
+{
+    auto found = this->records.find({ moduleVersionId, methodDef });
+    if (found == this->records.end() || found->second->hash != hash)
+    {
+        return false;
+    }
+
+    const ILCacheRecordHeader* record = found->second;
+    const BYTE* data = reinterpret_cast<const BYTE*>(record + 1);
+
+    entry->fixups = reinterpret_cast<const ILFixup*>(data);
+    entry->fixupCount = record->fixupCount;
+    data += record->fixupCount * sizeof(ILFixup);
+
+    entry->body = data;
+    entry->bodySize = record->bodySize;
+    data += record->bodySize;
+
+    entry->localVarSig = data;
+    entry->localVarSigSize = record->localVarSigSize;
+    return true;
+}
+
+void ILCache::Add(const GUID& moduleVersionId, mdMethodDef methodDef, UINT64 hash, const ILCacheEntry& entry)
+{
+    ILCacheRecordHeader record = { moduleVersionId, methodDef, entry.bodySize, hash, entry.localVarSigSize, entry.fixupCount };
+
+    auto append = [this](const void* data, size_t size) {
+        const BYTE* bytes = static_cast<const BYTE*>(data);
+        this->pending.insert(this->pending.end(), bytes, bytes + size);
+    };
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (this->file == nullptr)
+    {
+        return;
+    }
+
+    append(&record, sizeof(record));
+    append(entry.fixups, entry.fixupCount * sizeof(ILFixup));
+    append(entry.body, entry.bodySize);
+    append(entry.localVarSig, entry.localVarSigSize);
+    this->pending.resize((this->pending.size() + 7) & ~(size_t)7, 0);
+
+    if (this->pending.size() >= ILCACHE_FLUSH_SIZE)
+    {
+        this->Flush();
+    }
+}
+
+// Must be called with the lock held.
+void ILCache::Flush()
+{
+    if (this->pending.empty())
+    {
+        return;
+    }
+
+    LockHandle handle = GetLockHandle(this->file);
+    LockCacheFile(handle, true);
+
+    if (fwrite(this->pending.data(), 1, this->pending.size(), this->file) != this->pending.size() || fflush(this->file) != 0)
+    {
+        printf("ERROR: Could not write to the IL cache\n");
+    }
+
+    UnlockCacheFile(handle);
+    this->pending.clear();
+}
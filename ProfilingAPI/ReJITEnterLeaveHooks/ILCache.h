@@ -0,0 +1,127 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "ILRewriter.h"
+
+// On-disk layout of the IL cache:
+//
+//   ILCacheFileHeader
+//   ILCacheRecordHeader, fixups[fixupCount], body[bodySize], localVarSig[localVarSigSize], padding to 8
+//   ILCacheRecordHeader, ...
+//
+// Records are only ever appended. A method rewritten again after its IL or
+// the instrumentation changed gets a new record, and the last record of a
+// method wins when the file is read.
+
+#define ILCACHE_FILE_MAGIC      0x3145484341434C49ULL  // "ILCACHE1"
+#define ILCACHE_FILE_VERSION    1
+
+struct ILCacheFileHeader
+{
+    UINT64 magic;
+    UINT32 version;
+    UINT32 pointerSize;         // the width of the native int fixups
+};
+
+struct ILCacheRecordHeader
+{
+    GUID moduleVersionId;
+    UINT32 methodDef;
+    UINT32 bodySize;
+    UINT64 hash;                // of the original IL and the passes, see RewriteIL
+    UINT32 localVarSigSize;     // 0 unless the passes added locals
+    UINT32 fixupCount;
+};
+
+static_assert(sizeof(ILCacheFileHeader) == 16, "ILCacheFileHeader layout");
+static_assert(sizeof(ILCacheRecordHeader) == 40, "ILCacheRecordHeader layout");
+
+// A rewritten body as Export left it, before any fixup is patched.
+struct ILCacheEntry
+{
+    const BYTE* body;
+    UINT32 bodySize;
+    PCCOR_SIGNATURE localVarSig;    // for the ILFixup_LocalVarSig token
+    UINT32 localVarSigSize;
+    const ILFixup* fixups;
+    UINT32 fixupCount;
+};
+
+// FNV-1a, to chain over the pieces of a record's hash.
+inline UINT64 ILCacheHash(UINT64 hash, const void* data, size_t size)
+{
+    const BYTE* bytes = static_cast<const BYTE*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+#define ILCACHE_HASH_SEED   0xCBF29CE484222325ULL
+
+// Keeps rewritten IL across runs of the process. The file is mapped once when
+// the cache is opened and the records found in it are served from the
+// mapping; bodies rewritten by this run are appended for the next one.
+class ILCache
+{
+private:
+    struct Key
+    {
+        GUID moduleVersionId;
+        mdMethodDef methodDef;
+
+        bool operator==(const Key& other) const
+        {
+            return this->methodDef == other.methodDef && memcmp(&this->moduleVersionId, &other.moduleVersionId, sizeof(GUID)) == 0;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return (size_t)ILCacheHash(ILCACHE_HASH_SEED ^ key.methodDef, &key.moduleVersionId, sizeof(GUID));
+        }
+    };
+
+    // Filled by Open and read-only afterwards, so Find doesn't lock.
+    std::unordered_map<Key, const ILCacheRecordHeader*, KeyHash> records;
+    const BYTE* mapping;
+    size_t mappingSize;
+#ifdef WIN32
+    HANDLE mappingHandle;
+#endif
+
+    std::mutex lock;
+    FILE* file;
+    std::vector<BYTE> pending;  // whole records not yet written
+
+    bool Map(const std::string& path);
+    void Unmap();
+    bool Index();
+    bool StartOver(const std::string& path);
+    void Flush();               // Must be called with the lock held.
+public:
+    ILCache();
+    ~ILCache();
+
+    bool Open(const std::string& path);
+    void Close();
+    bool IsOpen();
+
+    // Only finds records saved by earlier runs, from the same hash.
+    bool Find(const GUID& moduleVersionId, mdMethodDef methodDef, UINT64 hash, ILCacheEntry* entry);
+    void Add(const GUID& moduleVersionId, mdMethodDef methodDef, UINT64 hash, const ILCacheEntry& entry);
+};
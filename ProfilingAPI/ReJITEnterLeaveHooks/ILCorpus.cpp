@@ -0,0 +1,118 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "ILCorpus.h"
+
+ILCorpusRecorder::ILCorpusRecorder(ILMetadata* metadata) : metadata(metadata)
+{
+}
+
+void ILCorpusRecorder::Record(mdToken token, PCCOR_SIGNATURE signature, ULONG size)
+{
+    for (const Signature& recorded : this->signatures)
+    {
+        if (recorded.token == token)
+        {
+            return;
+        }
+    }
+
+    this->signatures.push_back({ token, signature, size });
+}
+
+HRESULT ILCorpusRecorder::GetMethodSignature(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize)
+{
+    HRESULT hr = this->metadata->GetMethodSignature(token, signature, signatureSize);
+    if (SUCCEEDED(hr))
+    {
+        this->Record(token, *signature, *signatureSize);
+    }
+
+    return hr;
+}
+
+HRESULT ILCorpusRecorder::GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE* signature, ULONG* signatureSize)
+{
+    HRESULT hr = this->metadata->GetStandAloneSignature(token, signature, signatureSize);
+    if (SUCCEEDED(hr))
+    {
+        this->Record(token, *signature, *signatureSize);
+    }
+
+    return hr;
+}
+
+// The signatures the rewrite adds are made up again when it is replayed.
+HRESULT ILCorpusRecorder::GetTokenFromSignature(PCCOR_SIGNATURE signature, ULONG signatureSize, mdSignature* token)
+{
+    return this->metadata->GetTokenFromSignature(signature, signatureSize, token);
+}
+
+ILCorpusWriter::ILCorpusWriter() : file(nullptr)
+{
+}
+
+ILCorpusWriter::~ILCorpusWriter()
+{
+    this->Close();
+}
+
+bool ILCorpusWriter::Open(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    this->file = fopen(path.c_str(), "wb");
+    if (this->file == nullptr)
+    {
+        printf("ERROR: Could not create the IL corpus %s\n", path.c_str());
+        return false;
+    }
+
+    ILCorpusFileHeader header = { ILCORPUS_FILE_MAGIC, ILCORPUS_FILE_VERSION, 0 };
+    fwrite(&header, sizeof(header), 1, this->file);
+    return true;
+}
+
+void ILCorpusWriter::Close()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (this->file != nullptr)
+    {
+        fclose(this->file);
+        this->file = nullptr;
+    }
+}
+
+bool ILCorpusWriter::IsOpen()
+{
+    return this->file != nullptr;
+}
+
+void ILCorpusWriter::Add(mdMethodDef methodDef, mdSignature probeSignature, LPCBYTE body, ULONG bodySize, const ILCorpusRecorder& recorder)
+{
+    static const BYTE padding[4] = {};
+
+    ILCorpusRecordHeader record = { methodDef, bodySize, probeSignature, (UINT32)recorder.signatures.size() };
+    size_t recordSize = sizeof(record) + bodySize;
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (this->file == nullptr)
+    {
+        return;
+    }
+
+    fwrite(&record, sizeof(record), 1, this->file);
+    fwrite(body, 1, bodySize, this->file);
+
+    for (const ILCorpusRecorder::Signature& recorded : recorder.signatures)
+    {
+        ILCorpusSignature signature = { recorded.token, recorded.size };
+        fwrite(&signature, sizeof(signature), 1, this->file);
+        fwrite(recorded.signature, 1, recorded.size, this->file);
+        recordSize += sizeof(signature) + recorded.size;
+    }
+
+    fwrite(padding, 1, (4 - recordSize % 4) % 4, this->file);
+}
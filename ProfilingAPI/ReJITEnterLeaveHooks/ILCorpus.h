@@ -0,0 +1,93 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+// On-disk layout of an IL corpus, written by the profiler with
+// PROFILER_IL_CORPUS and replayed by the ILRewriterBenchmark:
+//
+//   ILCorpusFileHeader
+//   ILCorpusRecordHeader, body[bodySize], signatureCount x { ILCorpusSignature, signature[size] }, padding to 4
+//   ILCorpusRecordHeader, ...
+//
+// A record has a method's original body, as GetILFunctionBody returned it,
+// and every signature its rewrite read from the metadata, so the method can
+// be rewritten again without its module.
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "ILRewriter.h"
+
+#define ILCORPUS_FILE_MAGIC     0x315350524F434C49ULL  // "ILCORPS1"
+#define ILCORPUS_FILE_VERSION   1
+
+struct ILCorpusFileHeader
+{
+    UINT64 magic;
+    UINT32 version;
+    UINT32 reserved;
+};
+
+struct ILCorpusRecordHeader
+{
+    UINT32 methodDef;
+    UINT32 bodySize;
+    UINT32 probeSignature;      // the StandAloneSig the probes were called through
+    UINT32 signatureCount;
+};
+
+struct ILCorpusSignature
+{
+    UINT32 token;               // MethodDef, MemberRef, MethodSpec or StandAloneSig
+    UINT32 size;
+};
+
+static_assert(sizeof(ILCorpusFileHeader) == 16, "ILCorpusFileHeader layout");
+static_assert(sizeof(ILCorpusRecordHeader) == 16, "ILCorpusRecordHeader layout");
+static_assert(sizeof(ILCorpusSignature) == 8, "ILCorpusSignature layout");
+
+// Passes the rewriter's reads through to the module's metadata, and keeps the
+// signatures it returned for the corpus.
+class ILCorpusRecorder : public ILMetadata
+{
+private:
+    struct Signature
+    {
+        mdToken token;
+        PCCOR_SIGNATURE signature;  // owned by the module's metadata
+        ULONG size;
+    };
+
+    ILMetadata* metadata;
+    std::vector<Signature> signatures;
+
+    void Record(mdToken token, PCCOR_SIGNATURE signature, ULONG size);
+
+    friend class ILCorpusWriter;
+public:
+    ILCorpusRecorder(ILMetadata* metadata);
+
+    HRESULT GetMethodSignature(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override;
+    HRESULT GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override;
+    HRESULT GetTokenFromSignature(PCCOR_SIGNATURE signature, ULONG signatureSize, mdSignature* token) override;
+};
+
+class ILCorpusWriter
+{
+private:
+    std::mutex lock;
+    FILE* file;
+public:
+    ILCorpusWriter();
+    ~ILCorpusWriter();
+
+    bool Open(const std::string& path);
+    void Close();
+    bool IsOpen();
+
+    void Add(mdMethodDef methodDef, mdSignature probeSignature, LPCBYTE body, ULONG bodySize, const ILCorpusRecorder& recorder);
+};
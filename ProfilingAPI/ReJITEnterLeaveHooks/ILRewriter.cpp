@@ -4,8 +4,11 @@
 #include "cor.h"
 #include "corprof.h"
 #include "ILRewriter.h"
+#include "ILCache.h"
 #include <corhlpr.cpp>
 #include <cassert>
+#include <cstdlib>
+#include <new>
 #include <stdexcept>
 
 #undef IfFailRet
@@ -21,6 +24,8 @@ struct ILInstr
 
     unsigned        m_opcode;
     unsigned        m_offset;
+    int             m_stackDepth;   // on entry, -1 until ComputeMaxStack reaches it
+    unsigned        m_fixup;        // ILFixupKind of the operand
 
     union
     {
@@ -135,22 +140,161 @@ static int k_rgnStackPushes[] = {
 #undef OPDEF
 };
 
+// Calls and ret pop a number of values that depends on a signature; they are
+// handled separately.
+static int k_rgnStackPops[] = {
+
+#define OPDEF(c,s,pop,push,args,type,l,s1,s2,ctrl) \
+	 pop ,
+
+#define Pop0    0
+#define Pop1    1
+#define PopI    1
+#define PopI8   1
+#define PopR4   1
+#define PopR8   1
+#define PopRef  1
+#define VarPop  0
+
+#include "opcode.def"
+
+#undef Pop0
+#undef Pop1
+#undef PopI
+#undef PopI8
+#undef PopR4
+#undef PopR8
+#undef PopRef
+#undef VarPop
+#undef OPDEF
+};
+
+// Bump allocator for everything a rewrite allocates. Nothing is freed on its
+// own; Reset releases it all at once and keeps the last (largest) block, so a
+// JIT thread stops going to the heap after its first few methods.
+class ILArena
+{
+private:
+    struct Block
+    {
+        Block *     m_pPrev;
+        size_t      m_size;
+    };
+
+    static const size_t k_initialBlockSize = 16 * 1024;
+
+    Block *     m_pBlock;
+    BYTE *      m_pCurrent;
+    BYTE *      m_pEnd;
+
+    UINT64      m_cbAllocated;
+    UINT64      m_cbReserved;
+
+    bool Grow(size_t size)
+    {
+        size_t blockSize = m_pBlock != NULL ? m_pBlock->m_size * 2 : k_initialBlockSize;
+        if (blockSize < sizeof(Block) + size)
+            blockSize = sizeof(Block) + size;
+
+        Block * pBlock = (Block *)malloc(blockSize);
+        if (pBlock == NULL)
+            return false;
+
+        pBlock->m_pPrev = m_pBlock;
+        pBlock->m_size = blockSize;
+        m_pBlock = pBlock;
+        m_cbReserved += blockSize;
+        m_pCurrent = (BYTE *)(pBlock + 1);
+        m_pEnd = (BYTE *)pBlock + blockSize;
+        return true;
+    }
+
+    void FreeBlocks(Block * pBlock)
+    {
+        while (pBlock != NULL)
+        {
+            Block * pPrev = pBlock->m_pPrev;
+            m_cbReserved -= pBlock->m_size;
+            free(pBlock);
+            pBlock = pPrev;
+        }
+    }
+
+public:
+    ILArena() : m_pBlock(NULL), m_pCurrent(NULL), m_pEnd(NULL), m_cbAllocated(0), m_cbReserved(0)
+    {
+    }
+
+    ~ILArena()
+    {
+        FreeBlocks(m_pBlock);
+    }
+
+    void * Alloc(size_t size)
+    {
+        size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        if ((size_t)(m_pEnd - m_pCurrent) < size && !Grow(size))
+            return NULL;
+
+        void * p = m_pCurrent;
+        m_pCurrent += size;
+        m_cbAllocated += size;
+        return p;
+    }
+
+    template <class T>
+    T * AllocArray(size_t count)
+    {
+        return (T *)Alloc(count * sizeof(T));
+    }
+
+    void Reset()
+    {
+        if (m_pBlock == NULL)
+            return;
+
+        FreeBlocks(m_pBlock->m_pPrev);
+        m_pBlock->m_pPrev = NULL;
+        m_pCurrent = (BYTE *)(m_pBlock + 1);
+    }
+
+    void GetStats(UINT64 * pcbAllocated, UINT64 * pcbReserved)
+    {
+        *pcbAllocated = m_cbAllocated;
+        *pcbReserved = m_cbReserved;
+    }
+
+    // One arena per JIT thread. A thread only runs one rewrite at a time.
+    static ILArena & ForCurrentThread()
+    {
+        static thread_local ILArena arena;
+        return arena;
+    }
+};
+
 class ILRewriter
 {
 private:
     ICorProfilerInfo * m_pICorProfilerInfo;
     ICorProfilerFunctionControl * m_pICorProfilerFunctionControl;
+    ILMetadata * m_pMetadata;
 
     ModuleID    m_moduleId;
     mdToken     m_tkMethod;
 
     mdToken     m_tkLocalVarSig;
+    mdToken     m_tkOriginalLocalVarSig;
     unsigned    m_maxStack;
     unsigned    m_flags;
-    bool        m_fGenerateTinyHeader;
 
     ILInstr m_IL; // Double linked list of all il instructions
 
+    // The same instructions as a contiguous array in list order, valid while
+    // m_fFlat is set. Import fills it directly; inserted instructions are
+    // spliced into the list and Flatten lays the array out again for Export.
+    ILInstr *   m_pInstrs;
+    bool        m_fFlat;
+
     unsigned    m_nEH;
     EHClause *  m_pEH;
 
@@ -162,15 +306,26 @@ private:
 
     unsigned    m_nInstrs;
 
-    BYTE *      m_pOutputBuffer;
-
     IMethodMalloc * m_pIMethodMalloc;
 
+    // What the last Export sent, and where its fixups are, if RecordExport
+    // asked for them.
+    bool        m_fRecordExport;
+    LPBYTE      m_pExportedBody;
+    unsigned    m_cbExportedBody;
+    ILFixup *   m_pFixups;
+    unsigned    m_nFixups;
+
+    ILArena &   m_arena;
+
 public:
-    ILRewriter(ICorProfilerInfo * pICorProfilerInfo, ICorProfilerFunctionControl * pICorProfilerFunctionControl, ModuleID moduleID, mdToken tkMethod)
-        : m_pICorProfilerInfo(pICorProfilerInfo), m_pICorProfilerFunctionControl(pICorProfilerFunctionControl),
-        m_moduleId(moduleID), m_tkMethod(tkMethod), m_fGenerateTinyHeader(false),
-        m_pEH(nullptr), m_pOffsetToInstr(nullptr), m_pOutputBuffer(nullptr), m_pIMethodMalloc(nullptr)
+    ILRewriter(ICorProfilerInfo * pICorProfilerInfo, ICorProfilerFunctionControl * pICorProfilerFunctionControl, ILMetadata * pMetadata, ModuleID moduleID, mdToken tkMethod)
+        : m_pICorProfilerInfo(pICorProfilerInfo), m_pICorProfilerFunctionControl(pICorProfilerFunctionControl), m_pMetadata(pMetadata),
+        m_moduleId(moduleID), m_tkMethod(tkMethod),
+        m_pInstrs(nullptr), m_fFlat(false),
+        m_pEH(nullptr), m_pOffsetToInstr(nullptr), m_pIMethodMalloc(nullptr),
+        m_fRecordExport(false), m_pExportedBody(nullptr), m_cbExportedBody(0), m_pFixups(nullptr), m_nFixups(0),
+        m_arena(ILArena::ForCurrentThread())
     {
         m_IL.m_pNext = &m_IL;
         m_IL.m_pPrev = &m_IL;
@@ -180,16 +335,8 @@ public:
 
     ~ILRewriter()
     {
-        ILInstr * p = m_IL.m_pNext;
-        while (p != &m_IL)
-        {
-            ILInstr * t = p->m_pNext;
-            delete p;
-            p = t;
-        }
-        delete[] m_pEH;
-        delete[] m_pOffsetToInstr;
-        delete[] m_pOutputBuffer;
+        // The instructions, EH clauses and buffers all live in the arena.
+        m_arena.Reset();
 
         if (m_pIMethodMalloc)
             m_pIMethodMalloc->Release();
@@ -208,10 +355,16 @@ public:
         IfFailRet(m_pICorProfilerInfo->GetILFunctionBody(
             m_moduleId, m_tkMethod, &pMethodBytes, NULL));
 
+        return Import(pMethodBytes);
+    }
+
+    HRESULT Import(LPCBYTE pMethodBytes)
+    {
         COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
 
         // Import the header flags
         m_tkLocalVarSig = decoder.GetLocalVarSigTok();
+        m_tkOriginalLocalVarSig = m_tkLocalVarSig;
         m_maxStack = decoder.GetMaxStack();
         m_flags = (decoder.GetFlags() & CorILMethod_InitLocals);
 
@@ -221,16 +374,25 @@ public:
 
         IfFailRet(ImportEH(decoder.EH, decoder.EHCount()));
 
+        // Only count the pushes of the instructions added from here on, so
+        // m_maxStack stays an upper bound if ComputeMaxStack fails.
+        m_maxStack = decoder.GetMaxStack();
+
         return S_OK;
     }
 
     HRESULT ImportIL(LPCBYTE pIL)
     {
-        m_pOffsetToInstr = new ILInstr*[m_CodeSize + 1];
+        m_pOffsetToInstr = m_arena.AllocArray<ILInstr *>(m_CodeSize + 1);
         IfNullRet(m_pOffsetToInstr);
 
         ZeroMemory(m_pOffsetToInstr, m_CodeSize * sizeof(ILInstr*));
 
+        // Every instruction takes at least one byte, and so does every switch
+        // target, so the code size bounds the number of instructions
+        m_pInstrs = m_arena.AllocArray<ILInstr>(m_CodeSize + 1);
+        IfNullRet(m_pInstrs);
+
         // Set the sentinel instruction
         m_pOffsetToInstr[m_CodeSize] = &m_IL;
         m_IL.m_opcode = -1;
@@ -274,8 +436,7 @@ public:
                 return COR_E_INVALIDPROGRAM;
             }
 
-            ILInstr * pInstr = NewILInstr();
-            IfNullRet(pInstr);
+            ILInstr * pInstr = NewImportedILInstr();
 
             pInstr->m_opcode = opcode;
 
@@ -329,8 +490,7 @@ public:
                         return COR_E_INVALIDPROGRAM;
                     }
 
-                    pInstr = NewILInstr();
-                    IfNullRet(pInstr);
+                    pInstr = NewImportedILInstr();
 
                     pInstr->m_opcode = CEE_SWITCH_ARG;
 
@@ -353,13 +513,15 @@ public:
         if (fBranch)
         {
             // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            for (unsigned iInstr = 0; iInstr < m_nInstrs; iInstr++)
             {
+                ILInstr * pInstr = &m_pInstrs[iInstr];
                 if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
                     pInstr->m_pTarget = GetInstrFromOffset(pInstr->m_Arg32);
             }
         }
 
+        m_fFlat = true;
         return S_OK;
     }
 
@@ -372,7 +534,7 @@ public:
         if (nEH == 0)
             return S_OK;
 
-        IfNullRet(m_pEH = new EHClause[m_nEH]);
+        IfNullRet(m_pEH = m_arena.AllocArray<EHClause>(m_nEH));
         for (unsigned iEH = 0; iEH < m_nEH; iEH++)
         {
             // If the EH clause is in tiny form, the call to pILEH->EHClause() below will
@@ -398,17 +560,91 @@ public:
         return S_OK;
     }
 
+    // Appends a local of the given type to the locals signature, and returns
+    // its index.
+    HRESULT AddLocal(PCCOR_SIGNATURE pType, ULONG cbType, unsigned * pLocalIndex)
+    {
+        PCCOR_SIGNATURE pLocals = NULL;
+        PCCOR_SIGNATURE pLocalsEnd = NULL;
+        ULONG nLocals = 0;
+
+        if (m_tkLocalVarSig != mdTokenNil)
+        {
+            ULONG cbLocals;
+            IfFailRet(m_pMetadata->GetStandAloneSignature(m_tkLocalVarSig, &pLocals, &cbLocals));
+
+            pLocalsEnd = pLocals + cbLocals;
+            pLocals++; // IMAGE_CEE_CS_CALLCONV_LOCAL_SIG
+            nLocals = CorSigUncompressData(pLocals);
+        }
+
+        COR_SIGNATURE * pSignature = m_arena.AllocArray<COR_SIGNATURE>(1 + sizeof(ULONG) + (pLocalsEnd - pLocals) + cbType);
+        IfNullRet(pSignature);
+
+        COR_SIGNATURE * pCurrent = pSignature;
+        *pCurrent++ = IMAGE_CEE_CS_CALLCONV_LOCAL_SIG;
+        pCurrent += CorSigCompressData(nLocals + 1, pCurrent);
+        CopyMemory(pCurrent, pLocals, pLocalsEnd - pLocals);
+        pCurrent += pLocalsEnd - pLocals;
+        CopyMemory(pCurrent, pType, cbType);
+        pCurrent += cbType;
+
+        IfFailRet(m_pMetadata->GetTokenFromSignature(pSignature, (ULONG)(pCurrent - pSignature), &m_tkLocalVarSig));
+
+        *pLocalIndex = nLocals;
+        return S_OK;
+    }
+
+    // New clauses go last, so they must enclose the existing ones.
+    HRESULT AddEHClause(const EHClause & clause)
+    {
+        EHClause * pEH = m_arena.AllocArray<EHClause>(m_nEH + 1);
+        IfNullRet(pEH);
+
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+            pEH[iEH] = m_pEH[iEH];
+        pEH[m_nEH] = clause;
+
+        m_pEH = pEH;
+        m_nEH++;
+
+        return S_OK;
+    }
+
+    // A try region that runs to the end of the method ends at the list head,
+    // so it would take in any code appended after the last instruction. This
+    // ends it at pFirstAppended, the first instruction appended. Handlers end
+    // at their own last instruction and need nothing.
+    void EndEHClausesBefore(ILInstr * pFirstAppended)
+    {
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            if (m_pEH[iEH].m_pTryEnd == &m_IL)
+                m_pEH[iEH].m_pTryEnd = pFirstAppended;
+        }
+    }
+
     ILInstr* NewILInstr()
     {
+        void * p = m_arena.Alloc(sizeof(ILInstr));
+        if (p == NULL)
+            return NULL;
+
         m_nInstrs++;
-        return new ILInstr();
+        return new (p) ILInstr();
+    }
+
+    ILInstr* NewImportedILInstr()
+    {
+        assert(m_nInstrs < m_CodeSize);
+        return new (&m_pInstrs[m_nInstrs++]) ILInstr();
     }
 
     ILInstr* GetInstrFromOffset(unsigned offset)
     {
         ILInstr * pInstr = NULL;
 
-        if (offset <= m_CodeSize)
+        if (m_pOffsetToInstr != NULL && offset <= m_CodeSize)
             pInstr = m_pOffsetToInstr[offset];
 
         assert(pInstr != NULL);
@@ -423,6 +659,7 @@ public:
         pWhat->m_pNext->m_pPrev = pWhat;
         pWhat->m_pPrev->m_pNext = pWhat;
 
+        m_fFlat = false;
         AdjustState(pWhat);
     }
 
@@ -434,12 +671,64 @@ public:
         pWhat->m_pNext->m_pPrev = pWhat;
         pWhat->m_pPrev->m_pNext = pWhat;
 
+        m_fFlat = false;
         AdjustState(pWhat);
     }
 
+    // Copies the list into a new contiguous array in list order and relinks
+    // it, moving branch targets and EH boundaries along. Pointers to the old
+    // instructions are no longer valid afterwards.
+    HRESULT Flatten()
+    {
+        unsigned nInstrs = 0;
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            pInstr->m_offset = nInstrs++;   // index in the new array, until Export sets the offsets
+
+        ILInstr * pInstrs = m_arena.AllocArray<ILInstr>(nInstrs + 1);
+        IfNullRet(pInstrs);
+
+        ILInstr * pCurrent = pInstrs;
+        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            *pCurrent++ = *pInstr;
+
+        auto relocate = [pInstrs, this](ILInstr * pInstr) { return pInstr == &m_IL ? &m_IL : &pInstrs[pInstr->m_offset]; };
+
+        for (unsigned iInstr = 0; iInstr < nInstrs; iInstr++)
+        {
+            ILInstr * pInstr = &pInstrs[iInstr];
+            pInstr->m_pPrev = iInstr > 0 ? pInstr - 1 : &m_IL;
+            pInstr->m_pNext = iInstr + 1 < nInstrs ? pInstr + 1 : &m_IL;
+            if (s_OpCodeFlags[pInstr->m_opcode] & OPCODEFLAGS_BranchTarget)
+                pInstr->m_pTarget = relocate(pInstr->m_pTarget);
+        }
+        m_IL.m_pNext = nInstrs > 0 ? &pInstrs[0] : &m_IL;
+        m_IL.m_pPrev = nInstrs > 0 ? &pInstrs[nInstrs - 1] : &m_IL;
+
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            EHClause * clause = &(m_pEH[iEH]);
+            clause->m_pTryBegin = relocate(clause->m_pTryBegin);
+            clause->m_pTryEnd = relocate(clause->m_pTryEnd);
+            clause->m_pHandlerBegin = relocate(clause->m_pHandlerBegin);
+            clause->m_pHandlerEnd = relocate(clause->m_pHandlerEnd);
+            if (clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER)
+                clause->m_pFilter = relocate(clause->m_pFilter);
+        }
+
+        // The offset map points into the old instructions
+        m_pOffsetToInstr = NULL;
+
+        m_pInstrs = pInstrs;
+        m_nInstrs = nInstrs;
+        m_fFlat = true;
+        return S_OK;
+    }
+
     void AdjustState(ILInstr * pNewInstr)
     {
-        m_maxStack += k_rgnStackPushes[pNewInstr->m_opcode];
+        // Switch targets aren't real instructions and have no table entry
+        if (pNewInstr->m_opcode < CEE_COUNT)
+            m_maxStack += k_rgnStackPushes[pNewInstr->m_opcode];
     }
 
 
@@ -455,26 +744,218 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-    HRESULT Export()
+    /////////////////////////////////////////////////////////////////////////////////////////////////
+    //
+    // M A X   S T A C K
+    //
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    HRESULT GetCallStackEffect(unsigned opcode, mdToken token, int * pPops, int * pPushes)
     {
-        // One instruction produces 2 + sizeof(native int) bytes in the worst case which can be 10 bytes for 64-bit.
-        // For simplification we just use 10 here.
-        unsigned maxSize = m_nInstrs * 10;
+        PCCOR_SIGNATURE pSig;
+        ULONG cbSig;
+
+        if (opcode == CEE_CALLI)
+            IfFailRet(m_pMetadata->GetStandAloneSignature(token, &pSig, &cbSig));
+        else
+            IfFailRet(m_pMetadata->GetMethodSignature(token, &pSig, &cbSig));
+
+        PCCOR_SIGNATURE pEnd = pSig + cbSig;
+        BYTE callConv = *pSig++;
+        if (callConv & IMAGE_CEE_CS_CALLCONV_GENERIC)
+            CorSigUncompressData(pSig);
+        int nParameters = (int)CorSigUncompressData(pSig);
+        while (pSig < pEnd && (*pSig == ELEMENT_TYPE_CMOD_REQD || *pSig == ELEMENT_TYPE_CMOD_OPT))
+        {
+            pSig++;
+            CorSigUncompressData(pSig);
+        }
 
-        m_pOutputBuffer = new BYTE[maxSize];
-        IfNullRet(m_pOutputBuffer);
+        if (pSig >= pEnd)
+            return COR_E_BADIMAGEFORMAT;
 
-    again:
-        BYTE * pIL = m_pOutputBuffer;
+        // newobj creates "this" rather than popping it, and calli also pops the
+        // function pointer.
+        BOOL fImplicitThis = (callConv & IMAGE_CEE_CS_CALLCONV_HASTHIS) && !(callConv & IMAGE_CEE_CS_CALLCONV_EXPLICITTHIS);
+        *pPops = nParameters + (fImplicitThis && opcode != CEE_NEWOBJ ? 1 : 0) + (opcode == CEE_CALLI ? 1 : 0);
+        *pPushes = (opcode == CEE_NEWOBJ || *pSig != ELEMENT_TYPE_VOID) ? 1 : 0;
 
-        bool fBranch = false;
-        unsigned offset = 0;
+        return S_OK;
+    }
 
-        // Go over all instructions and produce code for them
-        for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+    // Follows every path through the method, including branches, switch arms
+    // and handler entries, and returns the deepest the evaluation stack gets.
+    // Fails if a call's signature can't be read, or if the IL is inconsistent.
+    HRESULT ComputeMaxStack(unsigned * pMaxStack)
+    {
+        assert(m_fFlat);
+        for (unsigned iInstr = 0; iInstr < m_nInstrs; iInstr++)
+            m_pInstrs[iInstr].m_stackDepth = -1;
+
+        struct PendingPath
+        {
+            ILInstr *   m_pInstr;
+            int         m_depth;
+        };
+
+        // Every instruction is walked once and queues at most one target.
+        PendingPath * pWorklist = m_arena.AllocArray<PendingPath>(m_nInstrs + 1 + 2 * m_nEH);
+        IfNullRet(pWorklist);
+
+        unsigned nPending = 0;
+        pWorklist[nPending++] = { m_IL.m_pNext, 0 };
+
+        // Catch and filter handlers start with the exception on the stack.
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            EHClause * clause = &(m_pEH[iEH]);
+            BOOL fHasException = (clause->m_Flags & (COR_ILEXCEPTION_CLAUSE_FINALLY | COR_ILEXCEPTION_CLAUSE_FAULT)) == 0;
+            pWorklist[nPending++] = { clause->m_pHandlerBegin, fHasException ? 1 : 0 };
+            if (clause->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER)
+                pWorklist[nPending++] = { clause->m_pFilter, 1 };
+        }
+
+        int maxDepth = 0;
+        while (nPending != 0)
+        {
+            nPending--;
+            ILInstr * pInstr = pWorklist[nPending].m_pInstr;
+            int depth = pWorklist[nPending].m_depth;
+
+            for (; pInstr != &m_IL; pInstr = pInstr->m_pNext)
+            {
+                if (pInstr->m_stackDepth >= 0)
+                {
+                    if (pInstr->m_stackDepth != depth)
+                        return COR_E_INVALIDPROGRAM;
+                    break;
+                }
+                pInstr->m_stackDepth = depth;
+
+                unsigned opcode = pInstr->m_opcode;
+                if (opcode == CEE_SWITCH_ARG)
+                {
+                    pWorklist[nPending++] = { pInstr->m_pTarget, depth };
+                    continue;
+                }
+
+                int pops = k_rgnStackPops[opcode];
+                int pushes = k_rgnStackPushes[opcode];
+                if (opcode == CEE_CALL || opcode == CEE_CALLVIRT || opcode == CEE_NEWOBJ || opcode == CEE_CALLI)
+                    IfFailRet(GetCallStackEffect(opcode, pInstr->m_Arg32, &pops, &pushes));
+
+                if (pops > depth)
+                    return COR_E_INVALIDPROGRAM;
+                depth += pushes - pops;
+                if (depth > maxDepth)
+                    maxDepth = depth;
+
+                if (opcode == CEE_RET || opcode == CEE_THROW || opcode == CEE_RETHROW || opcode == CEE_ENDFINALLY ||
+                    opcode == CEE_ENDFILTER || opcode == CEE_JMP)
+                    break;
+
+                if (opcode == CEE_LEAVE || opcode == CEE_LEAVE_S)
+                {
+                    // leave empties the stack
+                    pWorklist[nPending++] = { pInstr->m_pTarget, 0 };
+                    break;
+                }
+
+                if (s_OpCodeFlags[opcode] & OPCODEFLAGS_BranchTarget)
+                {
+                    pWorklist[nPending++] = { pInstr->m_pTarget, depth };
+                    if (opcode == CEE_BR || opcode == CEE_BR_S)
+                        break;
+                }
+            }
+        }
+
+        *pMaxStack = (unsigned)maxDepth;
+        return S_OK;
+    }
+
+    static unsigned GetInstrSize(ILInstr * pInstr)
+    {
+        unsigned opcode = pInstr->m_opcode;
+        BYTE flags = s_OpCodeFlags[opcode];
+
+        unsigned size = (flags & OPCODEFLAGS_SizeMask);
+        if (opcode < CEE_COUNT)
+            size += (opcode >= 0x100) ? 2 : 1;
+        if (flags & OPCODEFLAGS_Switch)
+            size += sizeof(INT32);
+
+        return size;
+    }
+
+    // Assigns the offsets, using the short form of every branch whose target
+    // is in range, whichever form it was imported or inserted with. Branches
+    // start short and only ever grow, so this converges, and each round only
+    // moves the code after the first branch it had to widen.
+    void LayoutCode()
+    {
+        for (unsigned iInstr = 0; iInstr < m_nInstrs; iInstr++)
+        {
+            ILInstr * pInstr = &m_pInstrs[iInstr];
+            if (pInstr->m_opcode == CEE_LEAVE)
+                pInstr->m_opcode = CEE_LEAVE_S;
+            else if (pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN)
+                pInstr->m_opcode = pInstr->m_opcode - CEE_BR + CEE_BR_S;
+        }
+
+        m_IL.m_offset = 0;
+
+        unsigned iFirstMoved = 0;
+        while (iFirstMoved < m_nInstrs)
+        {
+            // The first moved instruction grew, but still starts where it did
+            unsigned offset = (iFirstMoved == 0) ? 0 : m_pInstrs[iFirstMoved].m_offset;
+            for (unsigned iInstr = iFirstMoved; iInstr < m_nInstrs; iInstr++)
+            {
+                m_pInstrs[iInstr].m_offset = offset;
+                offset += GetInstrSize(&m_pInstrs[iInstr]);
+            }
+            m_IL.m_offset = offset;
+
+            iFirstMoved = m_nInstrs;
+            for (unsigned iInstr = 0; iInstr < m_nInstrs; iInstr++)
+            {
+                ILInstr * pInstr = &m_pInstrs[iInstr];
+                if (s_OpCodeFlags[pInstr->m_opcode] != (1 | OPCODEFLAGS_BranchTarget))
+                    continue;
+
+                // (see #pragma at top of file)
+                int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+                if ((INT8)delta == delta)
+                    continue;
+
+                unsigned opcode = pInstr->m_opcode;
+                if (opcode == CEE_LEAVE_S)
+                {
+                    pInstr->m_opcode = CEE_LEAVE;
+                }
+                else
+                {
+                    assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
+                    pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
+                    assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
+                }
+
+                if (iFirstMoved == m_nInstrs)
+                    iFirstMoved = iInstr;
+            }
+        }
+    }
+
+    // Writes the code laid out by LayoutCode, which is m_IL.m_offset bytes.
+    void EncodeCode(BYTE * pIL)
+    {
+        unsigned switchBase = 0;
+
+        for (unsigned iInstr = 0; iInstr < m_nInstrs; iInstr++)
         {
-            assert(offset < maxSize);
-            pInstr->m_offset = offset;
+            ILInstr * pInstr = &m_pInstrs[iInstr];
+            unsigned offset = pInstr->m_offset;
 
             unsigned opcode = pInstr->m_opcode;
             if (opcode < CEE_COUNT)
@@ -483,16 +964,19 @@ public:
                 // the lead byte of multi-byte opcodes. For now, the only lead byte
                 // supported is CEE_PREFIX1 = 0xFE.
                 if (opcode >= 0x100)
-                    m_pOutputBuffer[offset++] = CEE_PREFIX1;
+                    pIL[offset++] = CEE_PREFIX1;
 
                 // This appears to depend on an implicit conversion from
                 // unsigned opcode down to BYTE, to deliberately lose data and have
                 // opcode >= 0x100 wrap around to 0.
-                m_pOutputBuffer[offset++] = (opcode & 0xFF);
+                pIL[offset++] = (opcode & 0xFF);
             }
 
-            assert(pInstr->m_opcode < _countof(s_OpCodeFlags));
-            BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+            if (pInstr->m_fixup != ILFixup_None && m_pFixups != NULL)
+                RecordFixup((ILFixupKind)pInstr->m_fixup, &pIL[offset]);
+
+            assert(opcode < _countof(s_OpCodeFlags));
+            BYTE flags = s_OpCodeFlags[opcode];
             switch (flags)
             {
             case 0:
@@ -510,101 +994,100 @@ public:
                 *(UNALIGNED INT64 *)&(pIL[offset]) = pInstr->m_Arg64;
                 break;
             case 1 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                *(UNALIGNED INT8 *)&(pIL[offset]) = (INT8)(pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset);
                 break;
             case 4 | OPCODEFLAGS_BranchTarget:
-                fBranch = true;
+                if (opcode == CEE_SWITCH_ARG)
+                {
+                    // Switch args are relative to the end of the switch table
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - switchBase;
+                }
+                else
+                {
+                    *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+                }
                 break;
             case 0 | OPCODEFLAGS_Switch:
                 *(UNALIGNED INT32 *)&(pIL[offset]) = pInstr->m_Arg32;
-                offset += sizeof(INT32);
+                switchBase = offset + sizeof(INT32) * (pInstr->m_Arg32 + 1);
                 break;
             default:
                 assert(false);
                 break;
             }
-            offset += (flags & OPCODEFLAGS_SizeMask);
         }
-        m_IL.m_offset = offset;
+    }
 
-        if (fBranch)
-        {
-            bool fTryAgain = false;
-            unsigned switchBase = 0;
+    void RecordFixup(ILFixupKind kind, const BYTE * pOperand)
+    {
+        m_pFixups[m_nFixups].offset = (UINT32)(pOperand - m_pExportedBody);
+        m_pFixups[m_nFixups].kind = kind;
+        m_nFixups++;
+    }
 
-            // Go over all control flow instructions and resolve the targets
-            for (ILInstr * pInstr = m_IL.m_pNext; pInstr != &m_IL; pInstr = pInstr->m_pNext)
-            {
-                unsigned opcode = pInstr->m_opcode;
+    // The small EH format has 16-bit offsets, 8-bit lengths and an 8-bit
+    // section size, which leaves room for 20 clauses.
+    bool FitsSmallEHSection()
+    {
+        if (sizeof(IMAGE_COR_ILMETHOD_SECT_SMALL) + sizeof(WORD) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_SMALL) * m_nEH > 0xFF)
+            return false;
 
-                if (pInstr->m_opcode == CEE_SWITCH)
-                {
-                    switchBase = pInstr->m_offset + 1 + sizeof(INT32) * (pInstr->m_Arg32 + 1);
-                    continue;
-                }
-                if (opcode == CEE_SWITCH_ARG)
-                {
-                    // Switch args are special
-                    *(UNALIGNED INT32 *)&(pIL[pInstr->m_offset]) = pInstr->m_pTarget->m_offset - switchBase;
-                    continue;
-                }
+        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+        {
+            EHClause * clause = &(m_pEH[iEH]);
+            if (clause->m_pTryBegin->m_offset > 0xFFFF ||
+                clause->m_pTryEnd->m_offset - clause->m_pTryBegin->m_offset > 0xFF ||
+                clause->m_pHandlerBegin->m_offset > 0xFFFF ||
+                clause->m_pHandlerEnd->m_pNext->m_offset - clause->m_pHandlerBegin->m_offset > 0xFF)
+                return false;
+        }
 
-                BYTE flags = s_OpCodeFlags[pInstr->m_opcode];
+        return true;
+    }
 
-                if (flags & OPCODEFLAGS_BranchTarget)
-                {
-                    int delta = pInstr->m_pTarget->m_offset - pInstr->m_pNext->m_offset;
+    template <class TClause>
+    static void ExportEHClause(EHClause * pSrc, TClause * pDst)
+    {
+        pDst->Flags = pSrc->m_Flags;
+        pDst->TryOffset = pSrc->m_pTryBegin->m_offset;
+        pDst->TryLength = pSrc->m_pTryEnd->m_offset - pSrc->m_pTryBegin->m_offset;
+        pDst->HandlerOffset = pSrc->m_pHandlerBegin->m_offset;
+        pDst->HandlerLength = pSrc->m_pHandlerEnd->m_pNext->m_offset - pSrc->m_pHandlerBegin->m_offset;
+        if ((pSrc->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
+            pDst->ClassToken = pSrc->m_ClassToken;
+        else
+            pDst->FilterOffset = pSrc->m_pFilter->m_offset;
+    }
 
-                    switch (flags)
-                    {
-                    case 1 | OPCODEFLAGS_BranchTarget:
-                        // Check if delta is too big to fit into an INT8.
-                        // 
-                        // (see #pragma at top of file)
-                        if ((INT8)delta != delta)
-                        {
-                            if (opcode == CEE_LEAVE_S)
-                            {
-                                pInstr->m_opcode = CEE_LEAVE;
-                            }
-                            else
-                            {
-                                assert(opcode >= CEE_BR_S && opcode <= CEE_BLT_UN_S);
-                                pInstr->m_opcode = opcode - CEE_BR_S + CEE_BR;
-                                assert(pInstr->m_opcode >= CEE_BR && pInstr->m_opcode <= CEE_BLT_UN);
-                            }
-                            fTryAgain = true;
-                            continue;
-                        }
-                        *(UNALIGNED INT8 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT8)]) = delta;
-                        break;
-                    case 4 | OPCODEFLAGS_BranchTarget:
-                        *(UNALIGNED INT32 *)&(pIL[pInstr->m_pNext->m_offset - sizeof(INT32)]) = delta;
-                        break;
-                    default:
-                        assert(false);
-                        break;
-                    }
-                }
-            }
+    HRESULT Export()
+    {
+        if (!m_fFlat)
+            IfFailRet(Flatten());
 
-            // Do the whole thing again if we changed the size of some branch targets
-            if (fTryAgain)
-                goto again;
+        unsigned maxStack;
+        if (SUCCEEDED(ComputeMaxStack(&maxStack)))
+            m_maxStack = maxStack;
+
+        if (m_fRecordExport)
+        {
+            // One per tagged instruction, plus the locals token
+            m_pFixups = m_arena.AllocArray<ILFixup>(m_nInstrs + 1);
+            IfNullRet(m_pFixups);
+            m_nFixups = 0;
         }
 
-        unsigned codeSize = offset;
+        LayoutCode();
+        unsigned codeSize = m_IL.m_offset;
         unsigned totalSize;
         LPBYTE pBody = NULL;
-        if (m_fGenerateTinyHeader)
+        if (codeSize < 64 && m_maxStack <= 8 && m_tkLocalVarSig == mdTokenNil && m_nEH == 0)
         {
-            // Make sure we can fit in a tiny header
-            if (codeSize >= 64)
-                return E_FAIL;
+            // Use TINY header, which implies a max stack of 8
 
             totalSize = sizeof(IMAGE_COR_ILMETHOD_TINY) + codeSize;
             pBody = AllocateILMemory(totalSize);
             IfNullRet(pBody);
+            m_pExportedBody = pBody;
 
             BYTE * pCurrent = pBody;
 
@@ -613,19 +1096,28 @@ public:
             pCurrent += sizeof(IMAGE_COR_ILMETHOD_TINY);
 
             // And the body
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            EncodeCode(pCurrent);
         }
         else
         {
             // Use FAT header
 
-            unsigned alignedCodeSize = (offset + 3) & ~3;
+            unsigned alignedCodeSize = (codeSize + 3) & ~3;
+
+            bool fSmallEH = FitsSmallEHSection();
+            unsigned ehSize = 0;
+            if (m_nEH != 0)
+            {
+                ehSize = fSmallEH ?
+                    (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_SMALL) + sizeof(WORD) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_SMALL) * m_nEH) :
+                    (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
+            }
 
-            totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
-                (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH) : 0);
+            totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize + ehSize;
 
             pBody = AllocateILMemory(totalSize);
             IfNullRet(pBody);
+            m_pExportedBody = pBody;
 
             BYTE * pCurrent = pBody;
 
@@ -633,48 +1125,63 @@ public:
             pHeader->Flags = m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
             pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
             pHeader->MaxStack = m_maxStack;
-            pHeader->CodeSize = offset;
+            pHeader->CodeSize = codeSize;
             pHeader->LocalVarSigTok = m_tkLocalVarSig;
 
+            if (m_tkLocalVarSig != m_tkOriginalLocalVarSig && m_pFixups != NULL)
+                RecordFixup(ILFixup_LocalVarSig, (const BYTE *)&pHeader->LocalVarSigTok);
+
             pCurrent = (BYTE*)(pHeader + 1);
 
-            CopyMemory(pCurrent, m_pOutputBuffer, codeSize);
+            EncodeCode(pCurrent);
             pCurrent += alignedCodeSize;
 
-            if (m_nEH != 0)
+            if (m_nEH != 0 && fSmallEH)
+            {
+                IMAGE_COR_ILMETHOD_SECT_EH_SMALL *pEH = (IMAGE_COR_ILMETHOD_SECT_EH_SMALL *)pCurrent;
+                pEH->SectSmall.Kind = CorILMethod_Sect_EHTable;
+                pEH->SectSmall.DataSize = (BYTE)ehSize;
+                pEH->Reserved = 0;
+
+                for (unsigned iEH = 0; iEH < m_nEH; iEH++)
+                    ExportEHClause(&(m_pEH[iEH]), &(pEH->Clauses[iEH]));
+            }
+            else if (m_nEH != 0)
             {
                 IMAGE_COR_ILMETHOD_SECT_FAT *pEH = (IMAGE_COR_ILMETHOD_SECT_FAT *)pCurrent;
                 pEH->Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
-                pEH->DataSize = (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
-
-                pCurrent = (BYTE*)(pEH + 1);
+                pEH->DataSize = ehSize;
 
+                IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pDst = (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)(pEH + 1);
                 for (unsigned iEH = 0; iEH < m_nEH; iEH++)
-                {
-                    EHClause *pSrc = &(m_pEH[iEH]);
-                    IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pDst = (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)pCurrent;
-
-                    pDst->Flags = pSrc->m_Flags;
-                    pDst->TryOffset = pSrc->m_pTryBegin->m_offset;
-                    pDst->TryLength = pSrc->m_pTryEnd->m_offset - pSrc->m_pTryBegin->m_offset;
-                    pDst->HandlerOffset = pSrc->m_pHandlerBegin->m_offset;
-                    pDst->HandlerLength = pSrc->m_pHandlerEnd->m_pNext->m_offset - pSrc->m_pHandlerBegin->m_offset;
-                    if ((pSrc->m_Flags & COR_ILEXCEPTION_CLAUSE_FILTER) == 0)
-                        pDst->ClassToken = pSrc->m_ClassToken;
-                    else
-                        pDst->FilterOffset = pSrc->m_pFilter->m_offset;
-
-                    pCurrent = (BYTE*)(pDst + 1);
-                }
+                    ExportEHClause(&(m_pEH[iEH]), &(pDst[iEH]));
             }
         }
 
+        // Old-style instrumentation does not provide a way to free up bytes,
+        // and rejit bodies are released with the arena
         IfFailRet(SetILFunctionBody(totalSize, pBody));
-        DeallocateILMemory(pBody);
+        m_cbExportedBody = totalSize;
 
         return S_OK;
     }
 
+    void RecordExport()
+    {
+        m_fRecordExport = true;
+    }
+
+    // A body from the arena, for a rejit, only lasts as long as the rewriter.
+    void GetExport(ILCacheEntry * pEntry)
+    {
+        pEntry->body = m_pExportedBody;
+        pEntry->bodySize = m_cbExportedBody;
+        pEntry->fixups = m_pFixups;
+        pEntry->fixupCount = m_nFixups;
+        pEntry->localVarSig = NULL;
+        pEntry->localVarSigSize = 0;
+    }
+
     HRESULT SetILFunctionBody(unsigned size, LPBYTE pBody)
     {
         if (m_pICorProfilerFunctionControl != NULL)
@@ -682,7 +1189,7 @@ public:
             // We're supplying IL for a rejit, so use the rejit mechanism
             IfFailRet(m_pICorProfilerFunctionControl->SetILFunctionBody(size, pBody));
         }
-        else
+        else if (m_pICorProfilerInfo != NULL)
         {
             // "classic-style" instrumentation on first JIT, so use old mechanism
             IfFailRet(m_pICorProfilerInfo->SetILFunctionBody(m_moduleId, m_tkMethod, pBody));
@@ -695,36 +1202,34 @@ public:
     {
         if (m_pICorProfilerFunctionControl != NULL)
         {
-            // We're supplying IL for a rejit, so we can just allocate from
-            // the heap
-            return new BYTE[size];
+            // We're supplying IL for a rejit, which the runtime copies, so it
+            // can come from the arena
+            return m_arena.AllocArray<BYTE>(size);
         }
 
         // Else, this is "classic-style" instrumentation on first JIT, and
-        // need to use the CLR's IL allocator
+        // need to use the CLR's IL allocator, unless one was supplied
 
-        if (FAILED(m_pICorProfilerInfo->GetILFunctionBodyAllocator(m_moduleId, &m_pIMethodMalloc)))
+        if (m_pIMethodMalloc == NULL && FAILED(m_pICorProfilerInfo->GetILFunctionBodyAllocator(m_moduleId, &m_pIMethodMalloc)))
             return NULL;
 
         return (LPBYTE)m_pIMethodMalloc->Alloc(size);
     }
 
-    void DeallocateILMemory(LPBYTE pBody)
+    // For a body that doesn't go to the runtime; Export leaves it there.
+    void SetILFunctionBodyAllocator(IMethodMalloc * pIMethodMalloc)
     {
-        if (m_pICorProfilerFunctionControl == NULL)
-        {
-            // Old-style instrumentation does not provide a way to free up bytes
-            return;
-        }
-
-        delete[] pBody;
+        pIMethodMalloc->AddRef();
+        m_pIMethodMalloc = pIMethodMalloc;
     }
+
 };
 
 HRESULT AddProbe(
     ILRewriter * pilr,
-    FunctionID functionId,
+    UINT32 functionIndex,
     UINT_PTR methodAddress,
+    ILFixupKind methodAddressFixup,
     ULONG32 methodSignature,
     ILInstr * pInsertProbeBeforeThisInstr)
 {
@@ -733,18 +1238,21 @@ HRESULT AddProbe(
     constexpr auto CEE_LDC_I = sizeof(size_t) == 8 ? CEE_LDC_I8 : sizeof(size_t) == 4 ? CEE_LDC_I4 : throw std::logic_error("size_t must be defined as 8 or 4");
 
     pNewInstr = pilr->NewILInstr();
-    pNewInstr->m_opcode = CEE_LDC_I;
-    pNewInstr->m_Arg64 = functionId;
+    pNewInstr->m_opcode = CEE_LDC_I4;
+    pNewInstr->m_Arg32 = functionIndex;
+    pNewInstr->m_fixup = ILFixup_FunctionIndex;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_LDC_I;
     pNewInstr->m_Arg64 = methodAddress;
+    pNewInstr->m_fixup = methodAddressFixup;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     pNewInstr = pilr->NewILInstr();
     pNewInstr->m_opcode = CEE_CALLI;
     pNewInstr->m_Arg32 = methodSignature;
+    pNewInstr->m_fixup = ILFixup_ProbeSignature;
     pilr->InsertBefore(pInsertProbeBeforeThisInstr, pNewInstr);
 
     return S_OK;
@@ -752,19 +1260,19 @@ HRESULT AddProbe(
 
 HRESULT AddEnterProbe(
     ILRewriter * pilr,
-    FunctionID functionId,
+    UINT32 functionIndex,
     UINT_PTR methodAddress,
     ULONG32 methodSignature)
 {
     ILInstr * pFirstOriginalInstr = pilr->GetILList()->m_pNext;
 
-    return AddProbe(pilr, functionId, methodAddress, methodSignature, pFirstOriginalInstr);
+    return AddProbe(pilr, functionIndex, methodAddress, ILFixup_EnterAddress, methodSignature, pFirstOriginalInstr);
 }
 
 
 HRESULT AddExitProbe(
     ILRewriter * pilr,
-    FunctionID functionId,
+    UINT32 functionIndex,
     UINT_PTR methodAddress,
     ULONG32 methodSignature)
 {
@@ -794,7 +1302,7 @@ HRESULT AddExitProbe(
             pilr->InsertAfter(pInstr, pNewRet);
 
             // Add now insert the epilog before the new RET
-            hr = AddProbe(pilr, functionId, methodAddress, methodSignature, pNewRet);
+            hr = AddProbe(pilr, functionIndex, methodAddress, ILFixup_ExitAddress, methodSignature, pNewRet);
             if (FAILED(hr))
                 return hr;
             fAtLeastOneProbeAdded = TRUE;
@@ -804,6 +1312,15 @@ HRESULT AddExitProbe(
             break;
         }
 
+        // A tail call must be followed by its RET, and a jmp leaves without
+        // one, so neither would run the exit probe.
+        case CEE_TAILCALL:
+            pInstr->m_opcode = CEE_NOP;
+            break;
+
+        case CEE_JMP:
+            return E_FAIL;
+
         default:
             break;
         }
@@ -815,29 +1332,708 @@ HRESULT AddExitProbe(
     return S_OK;
 }
 
+// Advances pSig past one type in a signature.
+static HRESULT SkipType(PCCOR_SIGNATURE & pSig, PCCOR_SIGNATURE pEnd)
+{
+    if (pSig >= pEnd)
+        return COR_E_BADIMAGEFORMAT;
+
+    CorElementType elementType = (CorElementType)*pSig++;
+    switch (elementType)
+    {
+    case ELEMENT_TYPE_CMOD_REQD:
+    case ELEMENT_TYPE_CMOD_OPT:
+        CorSigUncompressData(pSig);
+        return SkipType(pSig, pEnd);
+
+    case ELEMENT_TYPE_PTR:
+    case ELEMENT_TYPE_BYREF:
+    case ELEMENT_TYPE_SZARRAY:
+    case ELEMENT_TYPE_PINNED:
+        return SkipType(pSig, pEnd);
+
+    case ELEMENT_TYPE_VALUETYPE:
+    case ELEMENT_TYPE_CLASS:
+    case ELEMENT_TYPE_VAR:
+    case ELEMENT_TYPE_MVAR:
+        CorSigUncompressData(pSig);
+        return S_OK;
+
+    case ELEMENT_TYPE_GENERICINST:
+    {
+        IfFailRet(SkipType(pSig, pEnd));
+        ULONG nArguments = CorSigUncompressData(pSig);
+        for (ULONG i = 0; i < nArguments; i++)
+            IfFailRet(SkipType(pSig, pEnd));
+        return S_OK;
+    }
+
+    case ELEMENT_TYPE_ARRAY:
+    {
+        IfFailRet(SkipType(pSig, pEnd));
+        CorSigUncompressData(pSig); // rank
+        ULONG nSizes = CorSigUncompressData(pSig);
+        for (ULONG i = 0; i < nSizes; i++)
+            CorSigUncompressData(pSig);
+        ULONG nLowerBounds = CorSigUncompressData(pSig);
+        for (ULONG i = 0; i < nLowerBounds; i++)
+            CorSigUncompressData(pSig);
+        return S_OK;
+    }
+
+    case ELEMENT_TYPE_FNPTR:
+    {
+        BYTE callConv = *pSig++;
+        if (callConv & IMAGE_CEE_CS_CALLCONV_GENERIC)
+            CorSigUncompressData(pSig);
+        ULONG nParameters = CorSigUncompressData(pSig);
+        for (ULONG i = 0; i <= nParameters; i++) // return type included
+            IfFailRet(SkipType(pSig, pEnd));
+        return S_OK;
+    }
+
+    case ELEMENT_TYPE_INTERNAL:
+        pSig += sizeof(void *);
+        return S_OK;
+
+    default:
+        if ((elementType >= ELEMENT_TYPE_VOID && elementType <= ELEMENT_TYPE_STRING) ||
+            elementType == ELEMENT_TYPE_TYPEDBYREF || elementType == ELEMENT_TYPE_I || elementType == ELEMENT_TYPE_U ||
+            elementType == ELEMENT_TYPE_OBJECT || elementType == ELEMENT_TYPE_SENTINEL)
+            return S_OK;
+        return COR_E_BADIMAGEFORMAT;
+    }
+}
+
+// Adds a local to hold the method's return value, if it has one.
+HRESULT AddResultLocal(
+    ILRewriter * pilr,
+    ILMetadata * pMetadata,
+    mdMethodDef methodDef,
+    BOOL * pfHasResult,
+    unsigned * pResultLocal)
+{
+    PCCOR_SIGNATURE pSig;
+    ULONG cbSig;
+    IfFailRet(pMetadata->GetMethodSignature(methodDef, &pSig, &cbSig));
+
+    // Skip to the return type, leaving out its custom modifiers.
+    PCCOR_SIGNATURE pEnd = pSig + cbSig;
+    BYTE callConv = *pSig++;
+    if (callConv & IMAGE_CEE_CS_CALLCONV_GENERIC)
+        CorSigUncompressData(pSig);
+    CorSigUncompressData(pSig);
+    while (pSig < pEnd && (*pSig == ELEMENT_TYPE_CMOD_REQD || *pSig == ELEMENT_TYPE_CMOD_OPT))
+    {
+        pSig++;
+        CorSigUncompressData(pSig);
+    }
+
+    PCCOR_SIGNATURE pReturnType = pSig;
+    IfFailRet(SkipType(pSig, pEnd));
+
+    *pfHasResult = *pReturnType != ELEMENT_TYPE_VOID;
+    *pResultLocal = 0;
+    if (*pfHasResult)
+        IfFailRet(pilr->AddLocal(pReturnType, (ULONG)(pSig - pReturnType), pResultLocal));
+
+    return S_OK;
+}
+
+// Turns a RET into a store of the return value, or a NOP for void methods.
+// Branches to the RET then go to the store.
+void SpillResult(ILInstr * pRet, BOOL fHasResult, unsigned resultLocal)
+{
+    if (fHasResult)
+    {
+        pRet->m_opcode = CEE_STLOC;
+        pRet->m_Arg16 = (INT16)resultLocal;
+    }
+    else
+    {
+        pRet->m_opcode = CEE_NOP;
+    }
+}
+
+unsigned CountReturns(ILRewriter * pilr)
+{
+    unsigned nReturns = 0;
+
+    for (ILInstr * pInstr = pilr->GetILList()->m_pNext; pInstr != pilr->GetILList(); pInstr = pInstr->m_pNext)
+    {
+        if (pInstr->m_opcode == CEE_RET)
+            nReturns++;
+    }
+
+    return nReturns;
+}
+
+// Sends every RET to one epilog at the end of the method, so the exit probe
+// is emitted once instead of once per return:
+//
+//      <body, each "ret" replaced by "stloc result; br epilog">
+//  epilog:
+//      <exit probe>; ldloc result; ret
+//
+// A RET that ends the body falls through to the epilog.
+HRESULT AddSharedExitProbe(
+    ILRewriter * pilr,
+    ILMetadata * pMetadata,
+    mdMethodDef methodDef,
+    UINT32 functionIndex,
+    UINT_PTR methodAddress,
+    ULONG32 methodSignature)
+{
+    BOOL fHasResult;
+    unsigned resultLocal;
+    IfFailRet(AddResultLocal(pilr, pMetadata, methodDef, &fHasResult, &resultLocal));
+
+    ILInstr * pList = pilr->GetILList();
+    ILInstr * pLastOriginalInstr = pList->m_pPrev;
+
+    ILInstr * pRet = pilr->NewILInstr();
+    pRet->m_opcode = CEE_RET;
+    pilr->InsertBefore(pList, pRet);
+
+    if (fHasResult)
+    {
+        ILInstr * pLoadResult = pilr->NewILInstr();
+        pLoadResult->m_opcode = CEE_LDLOC;
+        pLoadResult->m_Arg16 = (INT16)resultLocal;
+        pilr->InsertBefore(pRet, pLoadResult);
+        pRet = pLoadResult;
+    }
+
+    IfFailRet(AddProbe(pilr, functionIndex, methodAddress, ILFixup_ExitAddress, methodSignature, pRet));
+    ILInstr * pEpilog = pLastOriginalInstr->m_pNext;
+    pilr->EndEHClausesBefore(pEpilog);
+
+    for (ILInstr * pInstr = pList->m_pNext; pInstr != pEpilog; pInstr = pInstr->m_pNext)
+    {
+        switch (pInstr->m_opcode)
+        {
+        case CEE_RET:
+        {
+            SpillResult(pInstr, fHasResult, resultLocal);
+
+            if (pInstr != pLastOriginalInstr)
+            {
+                // Export widens the branch if the epilog is too far away.
+                ILInstr * pBranch = pilr->NewILInstr();
+                pBranch->m_opcode = CEE_BR_S;
+                pBranch->m_pTarget = pEpilog;
+                pilr->InsertAfter(pInstr, pBranch);
+
+                pInstr = pBranch;
+            }
+            break;
+        }
+
+        // "tail. call" must be followed by a RET, which is now a store.
+        case CEE_TAILCALL:
+            pInstr->m_opcode = CEE_NOP;
+            break;
+
+        case CEE_JMP:
+            return E_FAIL;
+
+        default:
+            break;
+        }
+    }
+
+    return S_OK;
+}
+
+// Wraps the original body, starting at pTryBegin, in a try/finally with the
+// exit probe in the handler, so it also runs when the method throws:
+//
+//      try { <body, each "ret" replaced by "stloc result; leave exit"> }
+//      finally { <exit probe>; endfinally }
+//  exit:
+//      ldloc result; ret
+HRESULT AddExitProbeInFinally(
+    ILRewriter * pilr,
+    ILMetadata * pMetadata,
+    mdMethodDef methodDef,
+    UINT32 functionIndex,
+    UINT_PTR methodAddress,
+    ULONG32 methodSignature,
+    ILInstr * pTryBegin)
+{
+    BOOL fHasResult;
+    unsigned resultLocal;
+    IfFailRet(AddResultLocal(pilr, pMetadata, methodDef, &fHasResult, &resultLocal));
+
+    ILInstr * pList = pilr->GetILList();
+    ILInstr * pLastOriginalInstr = pList->m_pPrev;
+
+    // The finally handler
+    ILInstr * pEndFinally = pilr->NewILInstr();
+    pEndFinally->m_opcode = CEE_ENDFINALLY;
+    pilr->InsertBefore(pList, pEndFinally);
+
+    IfFailRet(AddProbe(pilr, functionIndex, methodAddress, ILFixup_ExitAddress, methodSignature, pEndFinally));
+    ILInstr * pHandlerBegin = pLastOriginalInstr->m_pNext;
+    pilr->EndEHClausesBefore(pHandlerBegin);
+
+    // The exit block
+    ILInstr * pExit = pilr->NewILInstr();
+    pExit->m_opcode = CEE_RET;
+    pilr->InsertBefore(pList, pExit);
+
+    if (fHasResult)
+    {
+        ILInstr * pLoadResult = pilr->NewILInstr();
+        pLoadResult->m_opcode = CEE_LDLOC;
+        pLoadResult->m_Arg16 = (INT16)resultLocal;
+        pilr->InsertBefore(pExit, pLoadResult);
+        pExit = pLoadResult;
+    }
+
+    // Control can't leave a protected region with ret, jmp or a tail call.
+    for (ILInstr * pInstr = pTryBegin; pInstr != pHandlerBegin; pInstr = pInstr->m_pNext)
+    {
+        switch (pInstr->m_opcode)
+        {
+        case CEE_RET:
+        {
+            SpillResult(pInstr, fHasResult, resultLocal);
+
+            ILInstr * pLeave = pilr->NewILInstr();
+            pLeave->m_opcode = CEE_LEAVE;
+            pLeave->m_pTarget = pExit;
+            pilr->InsertAfter(pInstr, pLeave);
+
+            pInstr = pLeave;
+            break;
+        }
+
+        case CEE_TAILCALL:
+            pInstr->m_opcode = CEE_NOP;
+            break;
+
+        case CEE_JMP:
+            return E_FAIL;
+
+        default:
+            break;
+        }
+    }
+
+    EHClause clause = {};
+    clause.m_Flags = COR_ILEXCEPTION_CLAUSE_FINALLY;
+    clause.m_pTryBegin = pTryBegin;
+    clause.m_pTryEnd = pHandlerBegin;
+    clause.m_pHandlerBegin = pHandlerBegin;
+    clause.m_pHandlerEnd = pEndFinally;
+
+    return pilr->AddEHClause(clause);
+}
+
+HRESULT AddCounterProbe(
+    ILRewriter * pilr,
+    UINT_PTR counterAddress)
+{
+    ILInstr * pFirstOriginalInstr = pilr->GetILList()->m_pNext;
+    ILInstr * pNewInstr = nullptr;
+
+    constexpr auto CEE_LDC_I = sizeof(size_t) == 8 ? CEE_LDC_I8 : sizeof(size_t) == 4 ? CEE_LDC_I4 : throw std::logic_error("size_t must be defined as 8 or 4");
+
+    // (*counterAddress)++, without leaving managed code
+    const struct { unsigned opcode; INT64 arg; ILFixupKind fixup; } instrs[] =
+    {
+        { CEE_LDC_I, (INT64)counterAddress, ILFixup_Counter },
+        { CEE_CONV_U, 0, ILFixup_None },
+        { CEE_DUP, 0, ILFixup_None },
+        { CEE_LDIND_I8, 0, ILFixup_None },
+        { CEE_LDC_I8, 1, ILFixup_None },
+        { CEE_ADD, 0, ILFixup_None },
+        { CEE_STIND_I8, 0, ILFixup_None },
+    };
+
+    for (const auto& instr : instrs)
+    {
+        pNewInstr = pilr->NewILInstr();
+        pNewInstr->m_opcode = instr.opcode;
+        pNewInstr->m_Arg64 = instr.arg;
+        pNewInstr->m_fixup = instr.fixup;
+        pilr->InsertBefore(pFirstOriginalInstr, pNewInstr);
+    }
+
+    return S_OK;
+}
 
 // Uses the general-purpose ILRewriter class to import original
 // IL, rewrite it, and send the result to the CLR
+HRESULT ProbePass::Run(ILRewriter * pilr, const ILMethod & method)
+{
+    ILInstr * pFirstOriginalInstr = pilr->GetILList()->m_pNext;
+
+    IfFailRet(AddEnterProbe(pilr, method.functionIndex, this->enterMethodAddress, method.probeSignature));
+
+    if (this->fExitProbeInFinally)
+        IfFailRet(AddExitProbeInFinally(pilr, method.pMetadata, method.methodDef, method.functionIndex, this->exitMethodAddress, method.probeSignature, pFirstOriginalInstr));
+    else if (CountReturns(pilr) > 1)
+        IfFailRet(AddSharedExitProbe(pilr, method.pMetadata, method.methodDef, method.functionIndex, this->exitMethodAddress, method.probeSignature));
+    else
+        IfFailRet(AddExitProbe(pilr, method.functionIndex, this->exitMethodAddress, method.probeSignature));
+
+    return S_OK;
+}
+
+const char * ProbePass::GetConfig() const
+{
+    return this->fExitProbeInFinally ? "probes,finally" : "probes";
+}
+
+bool ProbePass::ResolveFixup(ILFixupKind kind, const ILMethod & method, UINT64 * pValue)
+{
+    if (kind == ILFixup_EnterAddress)
+        *pValue = this->enterMethodAddress;
+    else if (kind == ILFixup_ExitAddress)
+        *pValue = this->exitMethodAddress;
+    else
+        return false;
+
+    return true;
+}
+
+HRESULT CounterPass::Run(ILRewriter * pilr, const ILMethod & method)
+{
+    UINT64 * pCounter = this->getCounter(method.functionIndex);
+    IfNullRet(pCounter);
+
+    return AddCounterProbe(pilr, reinterpret_cast<UINT_PTR>(pCounter));
+}
+
+const char * CounterPass::GetConfig() const
+{
+    return "counters";
+}
+
+bool CounterPass::ResolveFixup(ILFixupKind kind, const ILMethod & method, UINT64 * pValue)
+{
+    if (kind != ILFixup_Counter)
+        return false;
+
+    UINT64 * pCounter = this->getCounter(method.functionIndex);
+    if (pCounter == NULL)
+        return false;
+
+    *pValue = reinterpret_cast<UINT_PTR>(pCounter);
+    return true;
+}
+
+// Identifies the IL the rewriter and its passes emit. Bump it with any change
+// to that IL, so bodies cached by an older profiler aren't used; a rebuild
+// that leaves the IL alone keeps them.
+#define ILREWRITER_FORMAT_VERSION   1
+
+// Covers what a rewritten body depends on besides its fixups: the original
+// body, the passes that apply, and the format of the IL the rewriter emits.
+static HRESULT HashMethod(
+    ICorProfilerInfo * pICorProfilerInfo,
+    const ILMethod & method,
+    ILPass ** ppPasses,
+    unsigned nPasses,
+    UINT64 * pHash)
+{
+    LPCBYTE pMethodBytes;
+    ULONG cbMethodSize;
+    IfFailRet(pICorProfilerInfo->GetILFunctionBody(method.moduleId, method.methodDef, &pMethodBytes, &cbMethodSize));
+
+    const UINT32 formatVersion = ILREWRITER_FORMAT_VERSION;
+    UINT64 hash = ILCacheHash(ILCACHE_HASH_SEED, &formatVersion, sizeof(formatVersion));
+    hash = ILCacheHash(hash, pMethodBytes, cbMethodSize);
+
+    for (unsigned iPass = 0; iPass < nPasses; iPass++)
+    {
+        const char * szConfig = ppPasses[iPass]->GetConfig();
+        hash = ILCacheHash(hash, szConfig, strlen(szConfig) + 1);
+    }
+
+    *pHash = hash;
+    return S_OK;
+}
+
+// Patches a body saved by an earlier run with this run's values and sends it
+// instead of a rewrite. Fails, without touching the method, if a fixup can't
+// be resolved.
+static HRESULT ExportCached(
+    ILRewriter * pilr,
+    const ILMethod & method,
+    ILPass ** ppPasses,
+    unsigned nPasses,
+    const ILCacheEntry & entry)
+{
+    BYTE * pPatched = ILArena::ForCurrentThread().AllocArray<BYTE>(entry.bodySize);
+    IfNullRet(pPatched);
+    CopyMemory(pPatched, entry.body, entry.bodySize);
+
+    for (unsigned iFixup = 0; iFixup < entry.fixupCount; iFixup++)
+    {
+        ILFixupKind kind = (ILFixupKind)entry.fixups[iFixup].kind;
+        unsigned offset = entry.fixups[iFixup].offset;
+
+        BOOL fNativeInt = (kind == ILFixup_EnterAddress || kind == ILFixup_ExitAddress || kind == ILFixup_Counter);
+        unsigned size = fNativeInt ? sizeof(UINT_PTR) : sizeof(INT32);
+        if (offset > entry.bodySize || entry.bodySize - offset < size)
+            return COR_E_BADIMAGEFORMAT;
+
+        UINT64 value = 0;
+        switch (kind)
+        {
+        case ILFixup_FunctionIndex:
+            value = method.functionIndex;
+            break;
+
+        case ILFixup_ProbeSignature:
+            value = method.probeSignature;
+            break;
+
+        case ILFixup_LocalVarSig:
+        {
+            mdSignature tkLocalVarSig;
+            IfFailRet(method.pMetadata->GetTokenFromSignature(entry.localVarSig, entry.localVarSigSize, &tkLocalVarSig));
+            value = tkLocalVarSig;
+            break;
+        }
+
+        default:
+        {
+            unsigned iPass = 0;
+            while (iPass < nPasses && !ppPasses[iPass]->ResolveFixup(kind, method, &value))
+                iPass++;
+
+            if (iPass == nPasses)
+                return E_FAIL;
+            break;
+        }
+        }
+
+        if (fNativeInt)
+            *(UNALIGNED UINT_PTR *)&(pPatched[offset]) = (UINT_PTR)value;
+        else
+            *(UNALIGNED INT32 *)&(pPatched[offset]) = (INT32)value;
+    }
+
+    LPBYTE pBody = pilr->AllocateILMemory(entry.bodySize);
+    IfNullRet(pBody);
+    CopyMemory(pBody, pPatched, entry.bodySize);
+
+    return pilr->SetILFunctionBody(entry.bodySize, pBody);
+}
+
+// Saves what the rewriter just exported, along with the signature of the
+// locals it extended, which only gets a token in the next run.
+static void SaveToCache(
+    ILRewriter * pilr,
+    const ILMethod & method,
+    UINT64 hash,
+    ILCache * pCache)
+{
+    ILCacheEntry entry;
+    pilr->GetExport(&entry);
+
+    for (unsigned iFixup = 0; iFixup < entry.fixupCount; iFixup++)
+    {
+        if (entry.fixups[iFixup].kind != ILFixup_LocalVarSig)
+            continue;
+
+        mdSignature tkLocalVarSig = *(UNALIGNED mdSignature *)&(entry.body[entry.fixups[iFixup].offset]);
+
+        ULONG cbLocalVarSig;
+        if (FAILED(method.pMetadata->GetStandAloneSignature(tkLocalVarSig, &entry.localVarSig, &cbLocalVarSig)))
+            return;
+        entry.localVarSigSize = cbLocalVarSig;
+    }
+
+    pCache->Add(method.moduleVersionId, method.methodDef, hash, entry);
+}
+
 HRESULT RewriteIL(
     ICorProfilerInfo * pICorProfilerInfo,
     ICorProfilerFunctionControl * pICorProfilerFunctionControl,
-    ModuleID moduleID,
-    mdMethodDef methodDef,
-    FunctionID functionId,
-    UINT_PTR enterMethodAddress,
-    UINT_PTR exitMethodAddress,
+    const ILMethod & method,
+    const std::vector<std::unique_ptr<ILPass>> & passes,
+    ILCache * pCache,
+    LPCBYTE pMethodBytes)
+{
+    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, method.pMetadata, method.moduleId, method.methodDef);
 
-    ULONG32 methodSignature)
+    if (passes.empty())
+        return S_FALSE;
+
+    // Lives in the rewriter's arena
+    ILPass ** ppPasses = ILArena::ForCurrentThread().AllocArray<ILPass *>(passes.size());
+    IfNullRet(ppPasses);
+
+    unsigned nPasses = 0;
+    for (const std::unique_ptr<ILPass> & pass : passes)
+    {
+        if (pass->AppliesTo(method))
+            ppPasses[nPasses++] = pass.get();
+    }
+
+    if (nPasses == 0)
+        return S_FALSE;
+
+    UINT64 hash = 0;
+    if (pMethodBytes != NULL)
+    {
+        pCache = nullptr;
+    }
+    else if (pCache != nullptr)
+    {
+        IfFailRet(HashMethod(pICorProfilerInfo, method, ppPasses, nPasses, &hash));
+
+        ILCacheEntry entry;
+        if (pCache->Find(method.moduleVersionId, method.methodDef, hash, &entry) &&
+            SUCCEEDED(ExportCached(&rewriter, method, ppPasses, nPasses, entry)))
+            return S_OK;
+
+        rewriter.RecordExport();
+    }
+
+    IfFailRet(pMethodBytes != NULL ? rewriter.Import(pMethodBytes) : rewriter.Import());
+
+    for (unsigned iPass = 0; iPass < nPasses; iPass++)
+        IfFailRet(ppPasses[iPass]->Run(&rewriter, method));
+
+    IfFailRet(rewriter.Export());
+
+    if (pCache != nullptr)
+        SaveToCache(&rewriter, method, hash, pCache);
+
+    return S_OK;
+}
+
+HRESULT RewriteILBody(
+    LPCBYTE pMethodBytes,
+    IMethodMalloc * pIMethodMalloc,
+    const ILMethod & method,
+    const std::vector<std::unique_ptr<ILPass>> & passes,
+    LPCBYTE * ppNewBody,
+    ULONG * pcbNewBody)
 {
-    ILRewriter rewriter(pICorProfilerInfo, pICorProfilerFunctionControl, moduleID, methodDef);
+    ILRewriter rewriter(NULL, NULL, method.pMetadata, method.moduleId, method.methodDef);
+    rewriter.SetILFunctionBodyAllocator(pIMethodMalloc);
 
-    IfFailRet(rewriter.Import());
+    bool fImported = false;
+    for (const std::unique_ptr<ILPass> & pass : passes)
     {
-        // Adds enter/exit probes
-        IfFailRet(AddEnterProbe(&rewriter, functionId, enterMethodAddress, methodSignature));
-        IfFailRet(AddExitProbe(&rewriter, functionId, exitMethodAddress, methodSignature));
+        if (!pass->AppliesTo(method))
+            continue;
+
+        if (!fImported)
+        {
+            IfFailRet(rewriter.Import(pMethodBytes));
+            fImported = true;
+        }
+
+        IfFailRet(pass->Run(&rewriter, method));
     }
+
+    if (!fImported)
+        return S_FALSE;
+
     IfFailRet(rewriter.Export());
 
+    ILCacheEntry entry;
+    rewriter.GetExport(&entry);
+    *ppNewBody = entry.body;
+    *pcbNewBody = entry.bodySize;
+
     return S_OK;
-}
\ No newline at end of file
+}
+
+bool HasBackwardBranch(LPCBYTE pMethodBytes)
+{
+    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
+
+    LPCBYTE pIL = decoder.Code;
+    unsigned codeSize = decoder.GetCodeSize();
+
+    unsigned offset = 0;
+    while (offset < codeSize)
+    {
+        unsigned startOffset = offset;
+        unsigned opcode = pIL[offset++];
+
+        if (opcode == CEE_PREFIX1)
+        {
+            if (offset >= codeSize)
+            {
+                return false;
+            }
+            opcode = 0x100 + pIL[offset++];
+        }
+
+        if (opcode >= CEE_COUNT || ((CEE_PREFIX7 <= opcode) && (opcode <= CEE_PREFIX2)))
+        {
+            return false;
+        }
+
+        BYTE flags = s_OpCodeFlags[opcode];
+
+        unsigned size = (flags & OPCODEFLAGS_SizeMask);
+        if (offset + size > codeSize)
+        {
+            return false;
+        }
+
+        switch (flags)
+        {
+        case 1 | OPCODEFLAGS_BranchTarget:
+            if ((INT64)offset + 1 + *(UNALIGNED INT8 *)&(pIL[offset]) <= (INT64)startOffset)
+            {
+                return true;
+            }
+            break;
+        case 4 | OPCODEFLAGS_BranchTarget:
+            if ((INT64)offset + 4 + *(UNALIGNED INT32 *)&(pIL[offset]) <= (INT64)startOffset)
+            {
+                return true;
+            }
+            break;
+        case 0 | OPCODEFLAGS_Switch:
+        {
+            if (offset + sizeof(INT32) > codeSize)
+            {
+                return false;
+            }
+
+            unsigned nTargets = *(UNALIGNED INT32 *)&(pIL[offset]);
+            offset += sizeof(INT32);
+
+            if (nTargets > (codeSize - offset) / sizeof(INT32))
+            {
+                return false;
+            }
+
+            unsigned base = offset + nTargets * sizeof(INT32);
+            for (unsigned iTarget = 0; iTarget < nTargets; iTarget++)
+            {
+                if ((INT64)base + *(UNALIGNED INT32 *)&(pIL[offset]) <= (INT64)startOffset)
+                {
+                    return true;
+                }
+                offset += sizeof(INT32);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        offset += size;
+    }
+
+    return false;
+}
+
+void GetILArenaStats(UINT64 * pcbAllocated, UINT64 * pcbReserved)
+{
+    ILArena::ForCurrentThread().GetStats(pcbAllocated, pcbReserved);
+}
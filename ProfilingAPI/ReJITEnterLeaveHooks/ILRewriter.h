@@ -3,12 +3,155 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+class ILCache;
+class ILRewriter;
+
+// The metadata the rewriter and the passes read from the method's module, and
+// the signatures they add to it. The profiler serves it from the module's
+// IMetaDataImport/IMetaDataEmit; the rewriter benchmark from its corpus.
+class ILMetadata
+{
+public:
+    virtual ~ILMetadata() {}
+
+    // For a MethodDef or a MemberRef, or the generic method a MethodSpec
+    // instantiates.
+    virtual HRESULT GetMethodSignature(mdToken token, PCCOR_SIGNATURE * ppSig, ULONG * pcbSig) = 0;
+
+    // For a StandAloneSig, like the locals or the target of a calli.
+    virtual HRESULT GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE * ppSig, ULONG * pcbSig) = 0;
+
+    virtual HRESULT GetTokenFromSignature(PCCOR_SIGNATURE pSig, ULONG cbSig, mdSignature * pToken) = 0;
+};
+
+// The method the passes are about to rewrite.
+struct ILMethod
+{
+    ModuleID moduleId;
+    mdMethodDef methodDef;
+    UINT32 functionIndex;           // from the FunctionRegistry
+    ILMetadata * pMetadata;
+    mdSignature probeSignature;     // void (UINT32), in the method's module
+    GUID moduleVersionId;           // keys the method in the IL cache
+};
+
+// Operands whose value is only good in the current process. The passes tag
+// the instructions they emit with one, so a body saved by an earlier run can
+// be patched instead of rewritten.
+enum ILFixupKind
+{
+    ILFixup_None,
+    ILFixup_FunctionIndex,          // INT32, ILMethod::functionIndex
+    ILFixup_ProbeSignature,         // token, ILMethod::probeSignature
+    ILFixup_LocalVarSig,            // token, in the header, of the locals a pass extended
+    ILFixup_EnterAddress,           // native int, from the pass
+    ILFixup_ExitAddress,            // native int, from the pass
+    ILFixup_Counter,                // native int, from the pass
+};
+
+struct ILFixup
+{
+    UINT32 offset;                  // of the operand, from the start of the body
+    UINT32 kind;                    // ILFixupKind
+};
+
+// One instrumentation applied to a method's IL. All the passes that apply to
+// a method run, in order, between a single Import and Export, and each one
+// sees the IL as the previous ones left it.
+class ILPass
+{
+public:
+    virtual ~ILPass() {}
+
+    virtual bool AppliesTo(const ILMethod & method)
+    {
+        return true;
+    }
+
+    virtual HRESULT Run(ILRewriter * pilr, const ILMethod & method) = 0;
+
+    // Names the pass and every setting that changes the IL it emits; the IL
+    // cache doesn't reuse a body saved under a different one.
+    virtual const char * GetConfig() const = 0;
+
+    // Gives this process' value for a native int the pass tagged.
+    virtual bool ResolveFixup(ILFixupKind kind, const ILMethod & method, UINT64 * pValue)
+    {
+        return false;
+    }
+};
+
+// Calls the Enter probe on entry and the Leave probe on every exit.
+class ProbePass : public ILPass
+{
+private:
+    UINT_PTR enterMethodAddress;
+    UINT_PTR exitMethodAddress;
+    BOOL fExitProbeInFinally;       // otherwise before each ret, which misses exits by exception
+public:
+    ProbePass(UINT_PTR enterMethodAddress, UINT_PTR exitMethodAddress, BOOL fExitProbeInFinally)
+        : enterMethodAddress(enterMethodAddress), exitMethodAddress(exitMethodAddress), fExitProbeInFinally(fExitProbeInFinally)
+    {
+    }
+
+    HRESULT Run(ILRewriter * pilr, const ILMethod & method) override;
+    const char * GetConfig() const override;
+    bool ResolveFixup(ILFixupKind kind, const ILMethod & method, UINT64 * pValue) override;
+};
+
+// Counts calls by incrementing a UINT64 from the method's own IL, instead of
+// calling Enter/Leave.
+class CounterPass : public ILPass
+{
+public:
+    typedef std::function<UINT64*(UINT32 functionIndex)> CounterCallback;
+
+private:
+    CounterCallback getCounter;
+public:
+    CounterPass(CounterCallback getCounter) : getCounter(getCounter)
+    {
+    }
+
+    HRESULT Run(ILRewriter * pilr, const ILMethod & method) override;
+    const char * GetConfig() const override;
+    bool ResolveFixup(ILFixupKind kind, const ILMethod & method, UINT64 * pValue) override;
+};
+
+// Returns S_FALSE, without touching the method, if none of the passes apply.
+// With a cache, a body saved by an earlier run from the same IL and passes is
+// patched and used as is, and a body rewritten here is saved for the next run.
+// pMethodBytes, if not NULL, is rewritten instead of the body the runtime has
+// now, which a rejit needs once that body was replaced; the cache isn't used.
 HRESULT RewriteIL(
     ICorProfilerInfo * pICorProfilerInfo,
     ICorProfilerFunctionControl * pICorProfilerFunctionControl,
-    ModuleID moduleID,
-    mdMethodDef methodDef,
-    FunctionID functionId,
-    UINT_PTR enterMethodAddress,
-    UINT_PTR exitMethodAddress,
-    ULONG32 methodSignature);
\ No newline at end of file
+    const ILMethod & method,
+    const std::vector<std::unique_ptr<ILPass>> & passes,
+    ILCache * pCache,
+    LPCBYTE pMethodBytes);
+
+// Rewrites a method body that doesn't come from the runtime, like one from a
+// corpus. The new body is allocated from pIMethodMalloc and returned instead
+// of being set, and method.moduleId is only passed on to the passes.
+HRESULT RewriteILBody(
+    LPCBYTE pMethodBytes,
+    IMethodMalloc * pIMethodMalloc,
+    const ILMethod & method,
+    const std::vector<std::unique_ptr<ILPass>> & passes,
+    LPCBYTE * ppNewBody,
+    ULONG * pcbNewBody);
+
+// Whether the method's IL branches back to an earlier instruction, which is
+// how the JIT tells that it has a loop. False for IL it can't decode.
+bool HasBackwardBranch(LPCBYTE pMethodBytes);
+
+// What the calling thread's rewrites have taken from its arena since the
+// thread started, and the heap memory that backs the arena now.
+void GetILArenaStats(UINT64 * pcbAllocated, UINT64 * pcbReserved);
@@ -0,0 +1,119 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "MethodFilter.h"
+#include "corhlpr.h"
+#include "profiler_pal.h"
+
+// ldarg.0; ldfld | ldsfld | ldarg.0; ldarg.1; stfld | ldarg.0; stsfld, followed by ret.
+static bool IsFieldAccessor(const BYTE* code, unsigned size)
+{
+    const BYTE* end = code + size;
+
+    if (code < end && *code == 0x02) // ldarg.0
+    {
+        code++;
+    }
+
+    if (code < end && *code == 0x03) // ldarg.1
+    {
+        code++;
+    }
+
+    if (end - code != 6 || code[5] != 0x2A) // field token, ret
+    {
+        return false;
+    }
+
+    return code[0] == 0x7B || code[0] == 0x7E || code[0] == 0x7D || code[0] == 0x80; // ldfld, ldsfld, stfld, stsfld
+}
+
+static bool IsAccessorName(const WCHAR* name)
+{
+    return (name[0] == 'g' || name[0] == 's') && name[1] == 'e' && name[2] == 't' && name[3] == '_';
+}
+
+MethodFilter::MethodFilter() : corProfilerInfo(nullptr), moduleMetadata(nullptr), minimumILSize(0)
+{
+}
+
+void MethodFilter::Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata, ULONG minimumILSize)
+{
+    this->corProfilerInfo = corProfilerInfo;
+    this->moduleMetadata = moduleMetadata;
+    this->minimumILSize = minimumILSize;
+}
+
+bool MethodFilter::Classify(ModuleID moduleId, mdMethodDef methodDef)
+{
+    LPCBYTE methodBytes;
+    if (FAILED(this->corProfilerInfo->GetILFunctionBody(moduleId, methodDef, &methodBytes, nullptr)))
+    {
+        return false;
+    }
+
+    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)methodBytes);
+    if (decoder.GetCodeSize() < this->minimumILSize)
+    {
+        return true;
+    }
+
+    if (!IsFieldAccessor(decoder.Code, decoder.GetCodeSize()))
+    {
+        return false;
+    }
+
+    ModuleMetadata metadata;
+    if (FAILED(this->moduleMetadata->Get(moduleId, &metadata)))
+    {
+        return false;
+    }
+
+    // Only the "get_"/"set_" prefix is needed; a truncated name still succeeds.
+    WCHAR name[8];
+    ULONG nameLength;
+    DWORD attributes;
+    mdTypeDef typeDef;
+    if (FAILED(metadata.metadataImport->GetMethodProps(methodDef, &typeDef, name, 8, &nameLength, &attributes, nullptr, nullptr, nullptr, nullptr)))
+    {
+        return false;
+    }
+
+    return (attributes & mdSpecialName) != 0 && nameLength > 4 && IsAccessorName(name);
+}
+
+bool MethodFilter::IsTrivial(ModuleID moduleId, mdMethodDef methodDef)
+{
+    if (this->minimumILSize == 0)
+    {
+        return false;
+    }
+
+    MethodKey key = { moduleId, methodDef };
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        auto found = this->trivialMethods.find(key);
+        if (found != this->trivialMethods.end())
+        {
+            return found->second;
+        }
+    }
+
+    bool trivial = this->Classify(moduleId, methodDef);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->trivialMethods[key] = trivial;
+    return trivial;
+}
+
+void MethodFilter::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    for (auto entry = this->trivialMethods.begin(); entry != this->trivialMethods.end();)
+    {
+        entry = entry->first.moduleId == moduleId ? this->trivialMethods.erase(entry) : std::next(entry);
+    }
+}
@@ -0,0 +1,35 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include "cor.h"
+#include "corprof.h"
+#include "ModuleMetadataCache.h"
+#include "ReJITManager.h"
+
+// Picks out the methods too small to be worth the probes: bodies under a
+// minimum IL size, and property accessors that only load or store a field.
+// They are left uninstrumented so the JIT can keep inlining them, the way it
+// would without a profiler; timing them would mostly measure the probes.
+class MethodFilter
+{
+private:
+    ICorProfilerInfo8* corProfilerInfo;
+    ModuleMetadataCache* moduleMetadata;
+    ULONG minimumILSize;
+    std::mutex lock;
+    std::unordered_map<MethodKey, bool, MethodKeyHash> trivialMethods;
+
+    bool Classify(ModuleID moduleId, mdMethodDef methodDef);
+public:
+    MethodFilter();
+
+    // A minimumILSize of 0 instruments every method.
+    void Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata, ULONG minimumILSize);
+
+    bool IsTrivial(ModuleID moduleId, mdMethodDef methodDef);
+    void ModuleUnloaded(ModuleID moduleId);
+};
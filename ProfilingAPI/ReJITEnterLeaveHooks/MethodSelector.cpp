@@ -0,0 +1,575 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "MethodSelector.h"
+#include "NameResolver.h"
+#include "ReJITManager.h"
+#include "corhlpr.h"
+#include "profiler_pal.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#define NAME_BUFFER_SIZE 1024
+#define MAX_USED_SLOTS (MODULE_SLOT_COUNT / 4 * 3) // so a lookup always ends at a free slot; more modules are looked up under the lock
+#define MAX_RULES (sizeof(UINT64) * 8)
+#define ANY_IL_SIZE ((ULONG)-1)
+
+static std::string Trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+    {
+        return std::string();
+    }
+
+    return text.substr(begin, text.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// "Namespace.Type", with nested types spelled Outer+Inner like NameResolver
+// does. The namespace is the outermost type's.
+static bool GetTypeName(IMetaDataImport* metadataImport, mdTypeDef typeDef, std::string* typeName, std::string* namespaceName)
+{
+    typeName->clear();
+
+    while (true)
+    {
+        WCHAR name[NAME_BUFFER_SIZE];
+        if (FAILED(metadataImport->GetTypeDefProps(typeDef, name, NAME_BUFFER_SIZE, nullptr, nullptr, nullptr)))
+        {
+            return false;
+        }
+
+        std::string part = ToUtf8(name);
+        *typeName = typeName->empty() ? part : part + "+" + *typeName;
+
+        mdTypeDef enclosingTypeDef;
+        if (FAILED(metadataImport->GetNestedClassProps(typeDef, &enclosingTypeDef)) || IsNilToken(enclosingTypeDef))
+        {
+            size_t dot = part.rfind('.');
+            *namespaceName = dot != std::string::npos ? part.substr(0, dot) : std::string();
+            return true;
+        }
+
+        typeDef = enclosingTypeDef;
+    }
+}
+
+MethodSelector::MethodSelector() : corProfilerInfo(nullptr), moduleMetadata(nullptr), anyNamespaceRules(0), attributeRules(0), ilSizeRules(0), selectedByDefault(true), usedSlots(0)
+{
+    this->namespaces.push_back({ {}, 0 });
+
+    for (ModuleSlot& slot : this->moduleSlots)
+    {
+        slot.moduleId.store(0, std::memory_order_relaxed);
+        slot.selection.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+void MethodSelector::Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata, const std::string& ruleList)
+{
+    this->corProfilerInfo = corProfilerInfo;
+    this->moduleMetadata = moduleMetadata;
+
+    std::string text = ruleList;
+    char separator = ';';
+
+    if (!ruleList.empty() && ruleList[0] == '@')
+    {
+        FILE* file = fopen(ruleList.c_str() + 1, "r");
+        if (file == nullptr)
+        {
+            printf("ERROR: Could not read the method selection rules from %s\n", ruleList.c_str() + 1);
+            return;
+        }
+
+        text.clear();
+        char buffer[NAME_BUFFER_SIZE];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+        {
+            text.append(buffer, read);
+        }
+
+        fclose(file);
+        separator = '\n';
+    }
+
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = text.find(separator, begin);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+
+        std::string rule = text.substr(begin, end - begin);
+        rule = Trim(rule.substr(0, rule.find('#')));
+
+        if (!rule.empty())
+        {
+            this->AddRule(rule);
+        }
+
+        begin = end + 1;
+    }
+}
+
+// [+|-]key=value[,key=value...], where the conditions all have to hold.
+bool MethodSelector::AddRule(const std::string& text)
+{
+    Rule rule = { true, std::string(), std::string(), std::string(), {}, 0, ANY_IL_SIZE };
+    std::string namespacePrefix;
+
+    size_t begin = 0;
+    if (text[0] == '+' || text[0] == '-')
+    {
+        rule.include = text[0] == '+';
+        begin = 1;
+    }
+
+    while (begin < text.size())
+    {
+        size_t end = text.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+
+        std::string condition = text.substr(begin, end - begin);
+        size_t equals = condition.find('=');
+        std::string key = Trim(condition.substr(0, equals));
+        std::string value = equals != std::string::npos ? Trim(condition.substr(equals + 1)) : std::string();
+
+        if (value.empty())
+        {
+            printf("ERROR: Method selection rule '%s' has no value for '%s'\n", text.c_str(), key.c_str());
+            return false;
+        }
+
+        if (key == "assembly")
+        {
+            rule.assembly = value;
+        }
+        else if (key == "namespace")
+        {
+            namespacePrefix = value;
+        }
+        else if (key == "type")
+        {
+            rule.type = value;
+        }
+        else if (key == "method")
+        {
+            rule.method = value;
+        }
+        else if (key == "attribute")
+        {
+            rule.attribute.assign(value.begin(), value.end());
+            rule.attribute.push_back(0);
+        }
+        else if (key == "minil")
+        {
+            rule.minimumILSize = (ULONG)strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (key == "maxil")
+        {
+            rule.maximumILSize = (ULONG)strtoul(value.c_str(), nullptr, 10);
+        }
+        else
+        {
+            printf("ERROR: Method selection rule '%s' has an unknown condition '%s'\n", text.c_str(), key.c_str());
+            return false;
+        }
+
+        begin = end + 1;
+    }
+
+    if (this->rules.size() == MAX_RULES)
+    {
+        printf("ERROR: Only the first %d method selection rules are used, '%s' is ignored\n", (int)MAX_RULES, text.c_str());
+        return false;
+    }
+
+    RuleMask bit = (RuleMask)1 << this->rules.size();
+
+    if (namespacePrefix.empty())
+    {
+        this->anyNamespaceRules |= bit;
+    }
+    else
+    {
+        size_t node = 0;
+        for (char c : namespacePrefix)
+        {
+            auto child = this->namespaces[node].children.find(c);
+            if (child != this->namespaces[node].children.end())
+            {
+                node = child->second;
+                continue;
+            }
+
+            this->namespaces.push_back({ {}, 0 });
+            this->namespaces[node].children[c] = this->namespaces.size() - 1;
+            node = this->namespaces.size() - 1;
+        }
+
+        this->namespaces[node].rules |= bit;
+    }
+
+    if (!rule.attribute.empty())
+    {
+        this->attributeRules |= bit;
+    }
+
+    if (rule.minimumILSize != 0 || rule.maximumILSize != ANY_IL_SIZE)
+    {
+        this->ilSizeRules |= bit;
+    }
+
+    if (rule.include)
+    {
+        this->selectedByDefault = false;
+    }
+
+    this->rules.push_back(rule);
+    return true;
+}
+
+// The rules whose namespace prefix is the whole name or ends at one of its dots.
+MethodSelector::RuleMask MethodSelector::MatchNamespace(const std::string& name)
+{
+    RuleMask matches = this->anyNamespaceRules;
+    size_t node = 0;
+
+    for (size_t i = 0; ; i++)
+    {
+        if (i == name.size() || name[i] == '.')
+        {
+            matches |= this->namespaces[node].rules;
+        }
+
+        if (i == name.size())
+        {
+            break;
+        }
+
+        auto child = this->namespaces[node].children.find(name[i]);
+        if (child == this->namespaces[node].children.end())
+        {
+            break;
+        }
+
+        node = child->second;
+    }
+
+    return matches;
+}
+
+bool MethodSelector::Decide(RuleMask matches)
+{
+    for (size_t i = this->rules.size(); i-- > 0;)
+    {
+        if (matches & ((RuleMask)1 << i))
+        {
+            return this->rules[i].include;
+        }
+    }
+
+    return this->selectedByDefault;
+}
+
+HRESULT MethodSelector::Evaluate(ModuleID moduleId, ModuleSelection* selection)
+{
+    HRESULT hr;
+
+    selection->methods.clear();
+    selection->rowCount = 0;
+    selection->selectedByDefault = this->selectedByDefault;
+
+    LPCBYTE baseLoadAddress;
+    WCHAR name[NAME_BUFFER_SIZE];
+    ULONG nameLength;
+    AssemblyID assemblyId;
+    AppDomainID appDomainId;
+    ModuleID manifestModuleId;
+    IfFailRet(this->corProfilerInfo->GetModuleInfo(moduleId, &baseLoadAddress, NAME_BUFFER_SIZE, &nameLength, name, &assemblyId));
+    IfFailRet(this->corProfilerInfo->GetAssemblyInfo(assemblyId, NAME_BUFFER_SIZE, &nameLength, name, &appDomainId, &manifestModuleId));
+
+    std::string assemblyName = ToUtf8(name);
+    RuleMask moduleRules = 0;
+    for (size_t i = 0; i < this->rules.size(); i++)
+    {
+        if (this->rules[i].assembly.empty() || MatchPattern(this->rules[i].assembly.c_str(), assemblyName.c_str()))
+        {
+            moduleRules |= (RuleMask)1 << i;
+        }
+    }
+
+    // No rule tells this module's methods apart.
+    if (moduleRules == 0)
+    {
+        return S_OK;
+    }
+
+    ModuleMetadata metadata;
+    IfFailRet(this->moduleMetadata->Get(moduleId, &metadata));
+    IMetaDataImport* metadataImport = metadata.metadataImport;
+
+    auto evaluateType = [&](mdTypeDef typeDef) {
+        std::string typeName;
+        std::string namespaceName;
+        if (!IsNilToken(typeDef) && !GetTypeName(metadataImport, typeDef, &typeName, &namespaceName))
+        {
+            typeName.clear();
+            namespaceName.clear();
+        }
+
+        RuleMask typeRules = moduleRules & this->MatchNamespace(namespaceName);
+        for (size_t i = 0; i < this->rules.size(); i++)
+        {
+            if ((typeRules & ((RuleMask)1 << i)) && !this->rules[i].type.empty() && !MatchPattern(this->rules[i].type.c_str(), typeName.c_str()))
+            {
+                typeRules &= ~((RuleMask)1 << i);
+            }
+        }
+
+        HCORENUM methodEnum = nullptr;
+        mdMethodDef methodDefs[64];
+        ULONG count;
+        while (SUCCEEDED(metadataImport->EnumMethods(&methodEnum, typeDef, methodDefs, 64, &count)) && count > 0)
+        {
+            for (ULONG i = 0; i < count; i++)
+            {
+                mdMethodDef methodDef = methodDefs[i];
+                RuleMask methodRules = typeRules;
+
+                WCHAR methodName[NAME_BUFFER_SIZE];
+                std::string methodNameUtf8;
+                if (methodRules != 0 && SUCCEEDED(metadataImport->GetMethodProps(methodDef, nullptr, methodName, NAME_BUFFER_SIZE, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr)))
+                {
+                    methodNameUtf8 = ToUtf8(methodName);
+                }
+
+                for (size_t r = 0; r < this->rules.size(); r++)
+                {
+                    if ((methodRules & ((RuleMask)1 << r)) && !this->rules[r].method.empty() && !MatchPattern(this->rules[r].method.c_str(), methodNameUtf8.c_str()))
+                    {
+                        methodRules &= ~((RuleMask)1 << r);
+                    }
+                }
+
+                for (size_t r = 0; r < this->rules.size(); r++)
+                {
+                    if ((methodRules & this->attributeRules & ((RuleMask)1 << r)) &&
+                        metadataImport->GetCustomAttributeByName(methodDef, this->rules[r].attribute.data(), nullptr, nullptr) != S_OK &&
+                        (IsNilToken(typeDef) || metadataImport->GetCustomAttributeByName(typeDef, this->rules[r].attribute.data(), nullptr, nullptr) != S_OK))
+                    {
+                        methodRules &= ~((RuleMask)1 << r);
+                    }
+                }
+
+                // Only read the body if a rule still depends on it
+                if (methodRules & this->ilSizeRules)
+                {
+                    LPCBYTE methodBytes;
+                    ULONG codeSize = 0;
+                    bool hasBody = SUCCEEDED(this->corProfilerInfo->GetILFunctionBody(moduleId, methodDef, &methodBytes, nullptr));
+                    if (hasBody)
+                    {
+                        COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)methodBytes);
+                        codeSize = decoder.GetCodeSize();
+                    }
+
+                    for (size_t r = 0; r < this->rules.size(); r++)
+                    {
+                        if ((methodRules & this->ilSizeRules & ((RuleMask)1 << r)) &&
+                            (!hasBody || codeSize < this->rules[r].minimumILSize || codeSize > this->rules[r].maximumILSize))
+                        {
+                            methodRules &= ~((RuleMask)1 << r);
+                        }
+                    }
+                }
+
+                ULONG row = RidFromToken(methodDef);
+                if (row / 64 >= selection->methods.size())
+                {
+                    selection->methods.resize(row / 64 + 1, 0);
+                }
+
+                if (this->Decide(methodRules))
+                {
+                    selection->methods[row / 64] |= (UINT64)1 << (row % 64);
+                }
+
+                selection->rowCount = std::max(selection->rowCount, row + 1);
+            }
+        }
+
+        metadataImport->CloseEnum(methodEnum);
+    };
+
+    // Global functions, then the methods of every type.
+    evaluateType(mdTypeDefNil);
+
+    HCORENUM typeEnum = nullptr;
+    mdTypeDef typeDefs[64];
+    ULONG count;
+    while (SUCCEEDED(metadataImport->EnumTypeDefs(&typeEnum, typeDefs, 64, &count)) && count > 0)
+    {
+        for (ULONG i = 0; i < count; i++)
+        {
+            evaluateType(typeDefs[i]);
+        }
+    }
+
+    metadataImport->CloseEnum(typeEnum);
+    return S_OK;
+}
+
+// A module that can't be evaluated, like a resource-only one, gets the
+// default for all its methods.
+std::unique_ptr<MethodSelector::ModuleSelection> MethodSelector::EvaluateOrDefault(ModuleID moduleId)
+{
+    std::unique_ptr<ModuleSelection> selection(new ModuleSelection());
+    if (FAILED(this->Evaluate(moduleId, selection.get())))
+    {
+        selection->methods.clear();
+        selection->rowCount = 0;
+        selection->selectedByDefault = this->selectedByDefault;
+    }
+
+    return selection;
+}
+
+static size_t GetFirstSlot(ModuleID moduleId)
+{
+    return (size_t)(((UINT64)moduleId * 0x9E3779B97F4A7C15ULL) >> (64 - MODULE_SLOT_BITS));
+}
+
+const MethodSelector::ModuleSelection* MethodSelector::FindPublished(ModuleID moduleId)
+{
+    for (size_t slot = GetFirstSlot(moduleId);; slot = (slot + 1) & (MODULE_SLOT_COUNT - 1))
+    {
+        ModuleID slotModuleId = this->moduleSlots[slot].moduleId.load(std::memory_order_acquire);
+        if (slotModuleId == moduleId)
+        {
+            return this->moduleSlots[slot].selection.load(std::memory_order_acquire);
+        }
+
+        if (slotModuleId == 0)
+        {
+            return nullptr;
+        }
+    }
+}
+
+// Must be called with the lock held.
+void MethodSelector::Publish(ModuleID moduleId, const ModuleSelection* selection)
+{
+    for (size_t slot = GetFirstSlot(moduleId);; slot = (slot + 1) & (MODULE_SLOT_COUNT - 1))
+    {
+        ModuleID slotModuleId = this->moduleSlots[slot].moduleId.load(std::memory_order_relaxed);
+        if (slotModuleId == moduleId)
+        {
+            this->moduleSlots[slot].selection.store(selection, std::memory_order_release);
+            return;
+        }
+
+        if (slotModuleId == 0)
+        {
+            if (selection != nullptr && this->usedSlots < MAX_USED_SLOTS)
+            {
+                // The selection goes first, so a reader that sees the
+                // ModuleID sees it too.
+                this->moduleSlots[slot].selection.store(selection, std::memory_order_relaxed);
+                this->moduleSlots[slot].moduleId.store(moduleId, std::memory_order_release);
+                this->usedSlots++;
+            }
+
+            return;
+        }
+    }
+}
+
+void MethodSelector::ModuleLoaded(ModuleID moduleId)
+{
+    if (this->rules.empty())
+    {
+        return;
+    }
+
+    std::unique_ptr<ModuleSelection> selection = this->EvaluateOrDefault(moduleId);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    std::unique_ptr<ModuleSelection>& entry = this->modules[moduleId];
+    if (entry != nullptr)
+    {
+        this->retired.push_back(std::move(entry));
+    }
+
+    entry = std::move(selection);
+    this->Publish(moduleId, entry.get());
+}
+
+void MethodSelector::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->modules.find(moduleId);
+    if (found == this->modules.end())
+    {
+        return;
+    }
+
+    this->Publish(moduleId, nullptr);
+    this->retired.push_back(std::move(found->second));
+    this->modules.erase(found);
+}
+
+static bool IsRowSelected(const std::vector<UINT64>& methods, ULONG rowCount, bool selectedByDefault, ULONG row)
+{
+    return row < rowCount ? ((methods[row / 64] >> (row % 64)) & 1) != 0 : selectedByDefault;
+}
+
+bool MethodSelector::IsSelected(ModuleID moduleId, mdMethodDef methodDef)
+{
+    if (this->rules.empty())
+    {
+        return true;
+    }
+
+    ULONG row = RidFromToken(methodDef);
+
+    const ModuleSelection* selection = this->FindPublished(moduleId);
+    if (selection != nullptr)
+    {
+        return IsRowSelected(selection->methods, selection->rowCount, selection->selectedByDefault, row);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        auto found = this->modules.find(moduleId);
+        if (found != this->modules.end())
+        {
+            return IsRowSelected(found->second->methods, found->second->rowCount, found->second->selectedByDefault, row);
+        }
+    }
+
+    std::unique_ptr<ModuleSelection> evaluated = this->EvaluateOrDefault(moduleId);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    // Another thread may have evaluated the module in the meantime.
+    auto inserted = this->modules.emplace(moduleId, std::move(evaluated));
+    if (inserted.second)
+    {
+        this->Publish(moduleId, inserted.first->second.get());
+    }
+
+    selection = inserted.first->second.get();
+    return IsRowSelected(selection->methods, selection->rowCount, selection->selectedByDefault, row);
+}
@@ -0,0 +1,104 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "ModuleMetadataCache.h"
+
+#define MODULE_SLOT_BITS 12
+#define MODULE_SLOT_COUNT (1 << MODULE_SLOT_BITS)
+
+// Chooses the methods that get the probes from a list of include and exclude
+// rules, by assembly, namespace, type, method name, custom attribute and IL
+// size. The rules are compiled once, and each module's methods are run through
+// them when the module loads, into a bitmap indexed by MethodDef row; deciding
+// about a method on the JIT path is then a bit test. The bitmaps are published
+// in a table that is read without locking.
+//
+// The last rule that matches a method decides. A method that no rule matches
+// is instrumented unless there are include rules.
+class MethodSelector
+{
+private:
+    typedef UINT64 RuleMask;    // bit i is rules[i]
+
+    struct Rule
+    {
+        bool include;
+        std::string assembly;           // patterns, empty for any
+        std::string type;
+        std::string method;
+        std::vector<WCHAR> attribute;   // custom attribute type name, empty for any
+        ULONG minimumILSize;
+        ULONG maximumILSize;
+    };
+
+    // Namespace prefixes, one character per edge. A rule is recorded on the
+    // node where its prefix ends.
+    struct NamespaceNode
+    {
+        std::map<char, size_t> children;
+        RuleMask rules;
+    };
+
+    struct ModuleSelection
+    {
+        std::vector<UINT64> methods;    // bit per MethodDef row
+        ULONG rowCount;
+        bool selectedByDefault;         // for rows added after the module was evaluated
+    };
+
+    // Open addressing over the ModuleID. Slots are only written under the
+    // lock and never freed; an unloaded module keeps its slot with a null
+    // selection.
+    struct ModuleSlot
+    {
+        std::atomic<ModuleID> moduleId;
+        std::atomic<const ModuleSelection*> selection;
+    };
+
+    ICorProfilerInfo8* corProfilerInfo;
+    ModuleMetadataCache* moduleMetadata;
+    std::vector<Rule> rules;
+    std::vector<NamespaceNode> namespaces;
+    RuleMask anyNamespaceRules;
+    RuleMask attributeRules;
+    RuleMask ilSizeRules;
+    bool selectedByDefault;
+
+    ModuleSlot moduleSlots[MODULE_SLOT_COUNT];
+
+    std::mutex lock;
+    std::unordered_map<ModuleID, std::unique_ptr<ModuleSelection>> modules;
+    std::vector<std::unique_ptr<ModuleSelection>> retired;  // of unloaded modules, a reader may still hold them
+    ULONG usedSlots;
+
+    bool AddRule(const std::string& text);
+    RuleMask MatchNamespace(const std::string& name);
+    bool Decide(RuleMask matches);
+    HRESULT Evaluate(ModuleID moduleId, ModuleSelection* selection);
+    std::unique_ptr<ModuleSelection> EvaluateOrDefault(ModuleID moduleId);
+    const ModuleSelection* FindPublished(ModuleID moduleId);
+    void Publish(ModuleID moduleId, const ModuleSelection* selection);
+public:
+    MethodSelector();
+
+    // ';' separated rules, or "@<file>" for a file with one rule per line.
+    void Initialize(ICorProfilerInfo8* corProfilerInfo, ModuleMetadataCache* moduleMetadata, const std::string& ruleList);
+
+    void ModuleLoaded(ModuleID moduleId);
+    void ModuleUnloaded(ModuleID moduleId);
+
+    // Lock-free, except for modules loaded before the profiler saw them,
+    // which are evaluated on first use.
+    bool IsSelected(ModuleID moduleId, mdMethodDef methodDef);
+};
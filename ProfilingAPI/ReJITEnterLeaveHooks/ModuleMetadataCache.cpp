@@ -0,0 +1,144 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "ModuleMetadataCache.h"
+#include "CComPtr.h"
+#include "corhlpr.h"
+#include "profiler_pal.h"
+
+ModuleMetadataCache::ModuleMetadataCache() : corProfilerInfo(nullptr), enterLeaveSignature(nullptr), enterLeaveSignatureSize(0)
+{
+}
+
+ModuleMetadataCache::~ModuleMetadataCache()
+{
+    this->Clear();
+}
+
+void ModuleMetadataCache::Initialize(ICorProfilerInfo8* corProfilerInfo, PCCOR_SIGNATURE enterLeaveSignature, ULONG enterLeaveSignatureSize)
+{
+    this->corProfilerInfo = corProfilerInfo;
+    this->enterLeaveSignature = enterLeaveSignature;
+    this->enterLeaveSignatureSize = enterLeaveSignatureSize;
+}
+
+void ModuleMetadataCache::Release(ModuleMetadata& metadata)
+{
+    metadata.metadataEmit->Release();
+    metadata.metadataImport->Release();
+}
+
+// Called without the lock; the metadata calls can take a while and may be
+// made for the same module on two threads, in which case one result is kept.
+HRESULT ModuleMetadataCache::Load(ModuleID moduleId, ModuleMetadata* metadata)
+{
+    HRESULT hr;
+
+    CComPtr<IMetaDataImport> metadataImport;
+    IfFailRet(this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+
+    CComPtr<IMetaDataEmit> metadataEmit;
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
+
+    mdSignature enterLeaveSignatureToken;
+    IfFailRet(metadataEmit->GetTokenFromSig(this->enterLeaveSignature, this->enterLeaveSignatureSize, &enterLeaveSignatureToken));
+
+    GUID moduleVersionId;
+    IfFailRet(metadataImport->GetScopeProps(nullptr, 0, nullptr, &moduleVersionId));
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto inserted = this->modules.insert({ moduleId, { metadataImport, metadataEmit, enterLeaveSignatureToken, moduleVersionId } });
+    if (inserted.second)
+    {
+        metadataImport->AddRef();
+        metadataEmit->AddRef();
+    }
+
+    *metadata = inserted.first->second;
+    return S_OK;
+}
+
+HRESULT ModuleMetadataCache::ModuleLoaded(ModuleID moduleId)
+{
+    ModuleMetadata metadata;
+    return this->Load(moduleId, &metadata);
+}
+
+void ModuleMetadataCache::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->modules.find(moduleId);
+    if (found != this->modules.end())
+    {
+        Release(found->second);
+        this->modules.erase(found);
+    }
+}
+
+void ModuleMetadataCache::Clear()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    for (auto& module : this->modules)
+    {
+        Release(module.second);
+    }
+
+    this->modules.clear();
+}
+
+HRESULT ModuleMetadataCache::Get(ModuleID moduleId, ModuleMetadata* metadata)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        auto found = this->modules.find(moduleId);
+        if (found != this->modules.end())
+        {
+            *metadata = found->second;
+            return S_OK;
+        }
+    }
+
+    return this->Load(moduleId, metadata);
+}
+
+ModuleILMetadata::ModuleILMetadata(IMetaDataImport* metadataImport, IMetaDataEmit* metadataEmit) : metadataImport(metadataImport), metadataEmit(metadataEmit)
+{
+}
+
+HRESULT ModuleILMetadata::GetMethodSignature(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize)
+{
+    HRESULT hr;
+
+    if (TypeFromToken(token) == mdtMethodSpec)
+    {
+        CComPtr<IMetaDataImport2> metadataImport2;
+        IfFailRet(this->metadataImport->QueryInterface(IID_IMetaDataImport2, reinterpret_cast<void **>(&metadataImport2)));
+        IfFailRet(metadataImport2->GetMethodSpecProps(token, &token, nullptr, nullptr));
+    }
+
+    if (TypeFromToken(token) == mdtMethodDef)
+    {
+        return this->metadataImport->GetMethodProps(token, nullptr, nullptr, 0, nullptr, nullptr, signature, signatureSize, nullptr, nullptr);
+    }
+
+    if (TypeFromToken(token) == mdtMemberRef)
+    {
+        return this->metadataImport->GetMemberRefProps(token, nullptr, nullptr, 0, nullptr, signature, signatureSize);
+    }
+
+    return E_FAIL;
+}
+
+HRESULT ModuleILMetadata::GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE* signature, ULONG* signatureSize)
+{
+    return this->metadataImport->GetSigFromToken(token, signature, signatureSize);
+}
+
+HRESULT ModuleILMetadata::GetTokenFromSignature(PCCOR_SIGNATURE signature, ULONG signatureSize, mdSignature* token)
+{
+    return this->metadataEmit->GetTokenFromSig(signature, signatureSize, token);
+}
@@ -0,0 +1,62 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include "cor.h"
+#include "corprof.h"
+#include "ILRewriter.h"
+
+struct ModuleMetadata
+{
+    IMetaDataImport* metadataImport;
+    IMetaDataEmit* metadataEmit;
+    mdSignature enterLeaveSignatureToken;   // StandAloneSig for the calli to the probes
+    GUID moduleVersionId;
+};
+
+// Keeps what rewriting a method needs from its module's metadata, so a JIT
+// event only pays for the IL rewrite. Modules are added when they finish
+// loading and dropped when they start unloading; the interfaces stay valid in
+// between, since no method of a module is jitted once it unloads.
+class ModuleMetadataCache
+{
+private:
+    ICorProfilerInfo8* corProfilerInfo;
+    PCCOR_SIGNATURE enterLeaveSignature;
+    ULONG enterLeaveSignatureSize;
+    std::mutex lock;
+    std::unordered_map<ModuleID, ModuleMetadata> modules;
+
+    HRESULT Load(ModuleID moduleId, ModuleMetadata* metadata);
+    static void Release(ModuleMetadata& metadata);
+public:
+    ModuleMetadataCache();
+    ~ModuleMetadataCache();
+    void Initialize(ICorProfilerInfo8* corProfilerInfo, PCCOR_SIGNATURE enterLeaveSignature, ULONG enterLeaveSignatureSize);
+
+    HRESULT ModuleLoaded(ModuleID moduleId);
+    void ModuleUnloaded(ModuleID moduleId);
+    void Clear();
+
+    // Modules loaded before the profiler saw them are added on first use.
+    // The returned interfaces are not AddRef'd.
+    HRESULT Get(ModuleID moduleId, ModuleMetadata* metadata);
+};
+
+// Serves the IL rewriter from a module's metadata interfaces, which it
+// doesn't AddRef.
+class ModuleILMetadata : public ILMetadata
+{
+private:
+    IMetaDataImport* metadataImport;
+    IMetaDataEmit* metadataEmit;
+public:
+    ModuleILMetadata(IMetaDataImport* metadataImport, IMetaDataEmit* metadataEmit);
+
+    HRESULT GetMethodSignature(mdToken token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override;
+    HRESULT GetStandAloneSignature(mdSignature token, PCCOR_SIGNATURE* signature, ULONG* signatureSize) override;
+    HRESULT GetTokenFromSignature(PCCOR_SIGNATURE signature, ULONG signatureSize, mdSignature* token) override;
+};
@@ -0,0 +1,128 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "NameResolver.h"
+#include "CComPtr.h"
+#include "profiler_pal.h"
+
+#define NAME_BUFFER_SIZE 1024
+
+std::string ToUtf8(const WCHAR* value)
+{
+    std::string result;
+
+    for (; *value != 0; value++)
+    {
+        UINT32 c = *value;
+
+        if (c >= 0xD800 && c <= 0xDBFF && value[1] >= 0xDC00 && value[1] <= 0xDFFF)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + (value[1] - 0xDC00);
+            value++;
+        }
+
+        if (c < 0x80)
+        {
+            result += (char)c;
+        }
+        else if (c < 0x800)
+        {
+            result += (char)(0xC0 | (c >> 6));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            result += (char)(0xE0 | (c >> 12));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            result += (char)(0xF0 | (c >> 18));
+            result += (char)(0x80 | ((c >> 12) & 0x3F));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+    }
+
+    return result;
+}
+
+NameResolver::NameResolver() : corProfilerInfo(nullptr)
+{
+}
+
+void NameResolver::Initialize(ICorProfilerInfo8* corProfilerInfo)
+{
+    this->corProfilerInfo = corProfilerInfo;
+}
+
+std::string NameResolver::GetFunctionName(FunctionID functionId)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto found = this->names.find(functionId);
+        if (found != this->names.end())
+        {
+            return found->second;
+        }
+    }
+
+    std::string name = this->LookupFunctionName(functionId);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->names[functionId] = name;
+    return name;
+}
+
+std::string NameResolver::LookupFunctionName(FunctionID functionId)
+{
+    char unknown[64];
+    sprintf(unknown, "<unknown 0x%" UINT_PTR_FORMAT ">", (UINT64)functionId);
+
+    mdToken token;
+    ClassID classId;
+    ModuleID moduleId;
+
+    if (this->corProfilerInfo == nullptr ||
+        FAILED(this->corProfilerInfo->GetFunctionInfo(functionId, &classId, &moduleId, &token)))
+    {
+        return unknown;
+    }
+
+    CComPtr<IMetaDataImport> metadataImport;
+    if (FAILED(this->corProfilerInfo->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport))))
+    {
+        return unknown;
+    }
+
+    WCHAR methodName[NAME_BUFFER_SIZE];
+    mdTypeDef typeDef;
+    if (FAILED(metadataImport->GetMethodProps(token, &typeDef, methodName, NAME_BUFFER_SIZE, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr)))
+    {
+        return unknown;
+    }
+
+    // Nested types are spelled Outer+Inner, like reflection does.
+    std::string typeName;
+    while (!IsNilToken(typeDef))
+    {
+        WCHAR name[NAME_BUFFER_SIZE];
+        if (FAILED(metadataImport->GetTypeDefProps(typeDef, name, NAME_BUFFER_SIZE, nullptr, nullptr, nullptr)))
+        {
+            break;
+        }
+
+        typeName = typeName.empty() ? ToUtf8(name) : ToUtf8(name) + "+" + typeName;
+
+        mdTypeDef enclosingTypeDef;
+        if (FAILED(metadataImport->GetNestedClassProps(typeDef, &enclosingTypeDef)))
+        {
+            break;
+        }
+
+        typeDef = enclosingTypeDef;
+    }
+
+    return typeName + "::" + ToUtf8(methodName);
+}
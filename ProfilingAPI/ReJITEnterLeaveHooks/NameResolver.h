@@ -0,0 +1,28 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "cor.h"
+#include "corprof.h"
+
+// Turns FunctionIDs into "Namespace.Type::Method" strings. Names are looked up
+// lazily, off the probe path, and cached for the lifetime of the profiler.
+class NameResolver
+{
+private:
+    ICorProfilerInfo8* corProfilerInfo;
+    std::mutex lock;
+    std::unordered_map<FunctionID, std::string> names;
+
+    std::string LookupFunctionName(FunctionID functionId);
+public:
+    NameResolver();
+    void Initialize(ICorProfilerInfo8* corProfilerInfo);
+    std::string GetFunctionName(FunctionID functionId);
+};
+
+std::string ToUtf8(const WCHAR* value);
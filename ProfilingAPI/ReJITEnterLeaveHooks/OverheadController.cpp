@@ -0,0 +1,148 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "OverheadController.h"
+#include "Timestamp.h"
+#include <algorithm>
+
+std::atomic<bool> OverheadController::sampling(false);
+
+static std::atomic<UINT64> sampledTime(0);
+static std::atomic<UINT64> sampledProbes(0);
+
+struct RevertCandidate
+{
+    FunctionID functionId;
+    double overhead;    // nanoseconds spent in the probes during the interval
+    double share;       // of the time the method ran, probes included
+};
+
+OverheadController::OverheadController() : budgetPercent(0), intervalMilliseconds(1000), revertedMethods(0), stopRequested(false)
+{
+}
+
+void OverheadController::Start(double budgetPercent, UINT32 intervalMilliseconds, SnapshotCallback snapshot, RevertCallback revert)
+{
+    this->budgetPercent = budgetPercent;
+    this->intervalMilliseconds = intervalMilliseconds;
+    this->snapshot = snapshot;
+    this->revert = revert;
+    this->stopRequested = false;
+
+    sampling = true;
+    this->worker = std::thread(&OverheadController::Run, this);
+}
+
+void OverheadController::Stop()
+{
+    if (!this->worker.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopRequested = true;
+        this->stopChanged.notify_all();
+    }
+
+    this->worker.join();
+    sampling = false;
+}
+
+bool OverheadController::IsRunning()
+{
+    return this->worker.joinable();
+}
+
+void OverheadController::SetBudget(double budgetPercent)
+{
+    this->budgetPercent = budgetPercent;
+}
+
+double OverheadController::GetBudget()
+{
+    return this->budgetPercent;
+}
+
+UINT64 OverheadController::GetRevertedMethods()
+{
+    return this->revertedMethods;
+}
+
+void OverheadController::AddProbeSample(UINT64 duration)
+{
+    sampledTime.fetch_add(duration, std::memory_order_relaxed);
+    sampledProbes.fetch_add(1, std::memory_order_relaxed);
+}
+
+UINT64 OverheadController::GetProbeCost()
+{
+    UINT64 probes = sampledProbes.load(std::memory_order_relaxed);
+    return probes != 0 ? sampledTime.load(std::memory_order_relaxed) / probes : 0;
+}
+
+void OverheadController::Run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+    UINT64 lastCheck = GetTimestamp();
+
+    while (!this->stopChanged.wait_for(guard, std::chrono::milliseconds(this->intervalMilliseconds), [this] { return this->stopRequested; }))
+    {
+        guard.unlock();
+
+        UINT64 now = GetTimestamp();
+        this->CheckBudget(now - lastCheck);
+        lastCheck = now;
+
+        guard.lock();
+    }
+}
+
+void OverheadController::CheckBudget(UINT64 elapsed)
+{
+    std::vector<FunctionStatistics> statistics = this->snapshot();
+
+    // Each call runs one Enter and one Leave probe.
+    double callCost = 2.0 * GetProbeCost();
+    double totalOverhead = 0;
+    std::vector<RevertCandidate> candidates;
+
+    for (const FunctionStatistics& function : statistics)
+    {
+        std::pair<UINT64, UINT64>& last = this->lastTotals[function.functionId];
+
+        // The counters go backwards when they are reset.
+        UINT64 calls = function.callCount >= last.first ? function.callCount - last.first : function.callCount;
+        UINT64 inclusiveTime = function.inclusiveTime >= last.second ? function.inclusiveTime - last.second : function.inclusiveTime;
+        last = std::make_pair(function.callCount, function.inclusiveTime);
+
+        if (calls == 0)
+        {
+            continue;
+        }
+
+        double overhead = calls * callCost;
+        totalOverhead += overhead;
+        candidates.push_back({ function.functionId, overhead, overhead / (overhead + inclusiveTime) });
+    }
+
+    double budget = elapsed * (double)std::max(1u, std::thread::hardware_concurrency()) * this->budgetPercent / 100.0;
+    if (budget <= 0 || callCost == 0 || totalOverhead <= budget)
+    {
+        return;
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const RevertCandidate& left, const RevertCandidate& right) {
+        return left.share > right.share;
+    });
+
+    std::vector<FunctionID> functionIds;
+    for (size_t i = 0; i < candidates.size() && totalOverhead > budget; i++)
+    {
+        functionIds.push_back(candidates[i].functionId);
+        totalOverhead -= candidates[i].overhead;
+    }
+
+    this->revertedMethods += this->revert(functionIds);
+}
@@ -0,0 +1,70 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "Statistics.h"
+
+// Keeps the cost of the Enter/Leave probes under a budget, given as a
+// percentage of the machine's CPU time. Every interval it estimates each
+// method's probe overhead as its probe hits times the measured cost of one
+// probe, and while the total is over budget it removes the probes from the
+// methods that spend the largest share of their own time in them, which
+// typically are tiny hot getters.
+//
+// Hit counts come from the per-function statistics, so only the aggregate
+// and trace modes are controlled.
+class OverheadController
+{
+public:
+    typedef std::function<std::vector<FunctionStatistics>()> SnapshotCallback;
+    typedef std::function<size_t(const std::vector<FunctionID>& functionIds)> RevertCallback; // returns the number of methods reverted
+
+private:
+    static std::atomic<bool> sampling;
+
+    SnapshotCallback snapshot;
+    RevertCallback revert;
+    std::atomic<double> budgetPercent;
+    UINT32 intervalMilliseconds;
+    std::unordered_map<FunctionID, std::pair<UINT64, UINT64>> lastTotals; // call count and inclusive time at the previous interval
+    std::atomic<UINT64> revertedMethods;
+    std::mutex lock;
+    std::condition_variable stopChanged;
+    std::thread worker;
+    bool stopRequested;
+
+    void Run();
+    void CheckBudget(UINT64 elapsed);
+public:
+    OverheadController();
+
+    void Start(double budgetPercent, UINT32 intervalMilliseconds, SnapshotCallback snapshot, RevertCallback revert);
+    void Stop();
+    bool IsRunning();
+
+    void SetBudget(double budgetPercent);
+    double GetBudget();
+    UINT64 GetRevertedMethods();
+
+    // The probes time one call in every few hundred to measure their own cost.
+    static bool ShouldSample()
+    {
+        static thread_local UINT32 counter = 0;
+        return sampling.load(std::memory_order_relaxed) && (++counter & 0xFF) == 0;
+    }
+
+    static void AddProbeSample(UINT64 duration);
+
+    // Average duration of one probe call in nanoseconds, 0 until measured.
+    static UINT64 GetProbeCost();
+};
@@ -0,0 +1,191 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "PreInstrumenter.h"
+#include <algorithm>
+
+static void AddMethods(IMetaDataImport* metadataImport, mdTypeDef typeDef, std::vector<mdMethodDef>& methodDefs)
+{
+    HCORENUM methodEnum = nullptr;
+    mdMethodDef methods[64];
+    ULONG count;
+
+    while (SUCCEEDED(metadataImport->EnumMethods(&methodEnum, typeDef, methods, 64, &count)) && count > 0)
+    {
+        for (ULONG i = 0; i < count; i++)
+        {
+            DWORD attributes;
+            ULONG codeRVA;
+            DWORD implFlags;
+            if (SUCCEEDED(metadataImport->GetMethodProps(methods[i], nullptr, nullptr, 0, nullptr, &attributes, nullptr, nullptr, &codeRVA, &implFlags)) &&
+                codeRVA != 0 && IsMiIL(implFlags) && !IsMdPinvokeImpl(attributes))
+            {
+                methodDefs.push_back(methods[i]);
+            }
+        }
+    }
+
+    metadataImport->CloseEnum(methodEnum);
+}
+
+PreInstrumenter::PreInstrumenter() : stopRequested(false)
+{
+}
+
+void PreInstrumenter::Start(unsigned threadCount, InstrumentCallback instrument)
+{
+    this->instrument = instrument;
+    this->stopRequested = false;
+
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        this->workers.emplace_back(&PreInstrumenter::Run, this);
+    }
+}
+
+void PreInstrumenter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopRequested = true;
+        this->workAvailable.notify_all();
+    }
+
+    for (std::thread& worker : this->workers)
+    {
+        worker.join();
+    }
+
+    this->workers.clear();
+}
+
+bool PreInstrumenter::IsStarted()
+{
+    return !this->workers.empty();
+}
+
+void PreInstrumenter::Run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (true)
+    {
+        this->workAvailable.wait(guard, [this] { return this->stopRequested || !this->queue.empty(); });
+
+        if (this->stopRequested)
+        {
+            break;
+        }
+
+        MethodKey key = this->queue.front();
+        this->queue.pop_front();
+
+        auto found = this->methods.find(key);
+        if (found == this->methods.end() || found->second.state != MethodState::Queued)
+        {
+            continue;
+        }
+
+        found->second.state = MethodState::Running;
+        guard.unlock();
+
+        UINT32 functionIndex = 0;
+        HRESULT hr = this->instrument(key.moduleId, key.methodDef, &functionIndex);
+
+        guard.lock();
+
+        // ModuleUnloaded waits for running methods, so the entry is still there.
+        found = this->methods.find(key);
+        found->second = { hr == S_OK ? MethodState::Instrumented : MethodState::Skipped, functionIndex };
+        this->methodFinished.notify_all();
+    }
+}
+
+void PreInstrumenter::ModuleLoaded(ModuleID moduleId, IMetaDataImport* metadataImport)
+{
+    std::vector<mdMethodDef> methodDefs;
+
+    // Global functions, then the methods of every type.
+    AddMethods(metadataImport, mdTypeDefNil, methodDefs);
+
+    HCORENUM typeEnum = nullptr;
+    mdTypeDef typeDefs[64];
+    ULONG count;
+    while (SUCCEEDED(metadataImport->EnumTypeDefs(&typeEnum, typeDefs, 64, &count)) && count > 0)
+    {
+        for (ULONG i = 0; i < count; i++)
+        {
+            AddMethods(metadataImport, typeDefs[i], methodDefs);
+        }
+    }
+    metadataImport->CloseEnum(typeEnum);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    for (mdMethodDef methodDef : methodDefs)
+    {
+        MethodKey key = { moduleId, methodDef };
+        if (this->methods.insert({ key, { MethodState::Queued, 0 } }).second)
+        {
+            this->queue.push_back(key);
+        }
+    }
+
+    this->workAvailable.notify_all();
+}
+
+// Must be called with the lock held.
+bool PreInstrumenter::IsRunning(ModuleID moduleId)
+{
+    for (auto& entry : this->methods)
+    {
+        if (entry.first.moduleId == moduleId && entry.second.state == MethodState::Running)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void PreInstrumenter::ModuleUnloaded(ModuleID moduleId)
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    // The workers use the module's metadata while they rewrite its methods.
+    this->methodFinished.wait(guard, [this, moduleId] { return !this->IsRunning(moduleId); });
+
+    for (auto entry = this->methods.begin(); entry != this->methods.end();)
+    {
+        entry = entry->first.moduleId == moduleId ? this->methods.erase(entry) : std::next(entry);
+    }
+
+    this->queue.erase(std::remove_if(this->queue.begin(), this->queue.end(), [moduleId](const MethodKey& key) { return key.moduleId == moduleId; }), this->queue.end());
+}
+
+bool PreInstrumenter::TakeInstrumented(ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex)
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    // Methods the workers haven't seen are marked so they never pick them up.
+    auto inserted = this->methods.insert({ { moduleId, methodDef }, { MethodState::Skipped, 0 } });
+    if (inserted.second)
+    {
+        return false;
+    }
+
+    MethodEntry& entry = inserted.first->second;
+    this->methodFinished.wait(guard, [&entry] { return entry.state != MethodState::Running; });
+
+    switch (entry.state)
+    {
+    case MethodState::Queued:
+        entry.state = MethodState::Skipped;
+        return false;
+    case MethodState::Instrumented:
+        *functionIndex = entry.functionIndex;
+        return true;
+    default:
+        return false;
+    }
+}
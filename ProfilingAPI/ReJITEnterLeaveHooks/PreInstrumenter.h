@@ -0,0 +1,71 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "ReJITManager.h"
+
+// Rewrites the IL of a module's methods on worker threads as soon as the
+// module is loaded, so the probes are usually in place before a method is
+// first jitted and JITCompilationStarted only has to look the method up. A
+// method the JIT reaches before the workers do is instrumented on the JIT
+// thread, as it is without pre-instrumentation.
+class PreInstrumenter
+{
+public:
+    // Rewrites the method's IL. Returns S_OK with the function index the
+    // probes use, or S_FALSE if the method isn't instrumented.
+    typedef std::function<HRESULT(ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex)> InstrumentCallback;
+
+private:
+    enum class MethodState
+    {
+        Queued,
+        Running,
+        Instrumented,
+        Skipped,        // not instrumented, or left to the JIT thread
+    };
+
+    struct MethodEntry
+    {
+        MethodState state;
+        UINT32 functionIndex;
+    };
+
+    InstrumentCallback instrument;
+    std::mutex lock;
+    std::condition_variable workAvailable;
+    std::condition_variable methodFinished;
+    std::deque<MethodKey> queue;
+    std::unordered_map<MethodKey, MethodEntry, MethodKeyHash> methods;
+    std::vector<std::thread> workers;
+    bool stopRequested;
+
+    bool IsRunning(ModuleID moduleId);
+    void Run();
+public:
+    PreInstrumenter();
+
+    void Start(unsigned threadCount, InstrumentCallback instrument);
+    void Stop();
+    bool IsStarted();
+
+    // Queues every method of the module that has an IL body.
+    void ModuleLoaded(ModuleID moduleId, IMetaDataImport* metadataImport);
+    void ModuleUnloaded(ModuleID moduleId);
+
+    // Called when a method is about to be jitted. Returns true, with the
+    // index its probes use, once a worker has rewritten it, waiting if a
+    // worker is on it right now. Otherwise the caller instruments the method
+    // itself and the workers leave it alone.
+    bool TakeInstrumented(ModuleID moduleId, mdMethodDef methodDef, UINT32* functionIndex);
+};
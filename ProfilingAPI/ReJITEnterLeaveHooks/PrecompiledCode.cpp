@@ -0,0 +1,81 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "PrecompiledCode.h"
+#include "Timestamp.h"
+
+PrecompiledCode::PrecompiledCode() : rejecting(false), statistics()
+{
+}
+
+void PrecompiledCode::Initialize(bool rejecting)
+{
+    this->rejecting = rejecting;
+}
+
+bool PrecompiledCode::Found(FunctionID functionId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (!this->rejecting)
+    {
+        this->statistics.kept++;
+        return false;
+    }
+
+    this->statistics.rejected++;
+    this->pending[functionId] = 0;
+    return true;
+}
+
+// Only the first compilation after a rejection is its cost; with tiered
+// compilation the later ones would have happened for the precompiled code too.
+void PrecompiledCode::CompilationStarted(FunctionID functionId)
+{
+    if (!this->rejecting)
+    {
+        return;
+    }
+
+    UINT64 now = GetTimestamp();
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->pending.find(functionId);
+    if (found != this->pending.end() && found->second == 0)
+    {
+        found->second = now;
+    }
+}
+
+void PrecompiledCode::CompilationFinished(FunctionID functionId, HRESULT hrStatus)
+{
+    if (!this->rejecting)
+    {
+        return;
+    }
+
+    UINT64 now = GetTimestamp();
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->pending.find(functionId);
+    if (found == this->pending.end() || found->second == 0)
+    {
+        return;
+    }
+
+    if (SUCCEEDED(hrStatus))
+    {
+        this->statistics.jitted++;
+        this->statistics.jitTime += now - found->second;
+    }
+
+    this->pending.erase(found);
+}
+
+PrecompiledCodeStatistics PrecompiledCode::GetStatistics()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->statistics;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include "cor.h"
+#include "corprof.h"
+
+struct PrecompiledCodeStatistics
+{
+    UINT64 kept;        // selected methods that ran their precompiled code, without probes
+    UINT64 rejected;    // selected methods whose precompiled code was turned down
+    UINT64 jitted;      // rejected methods the JIT compiled instead
+    UINT64 jitTime;     // nanoseconds spent compiling them, rewriting included
+};
+
+// Keeps track of the selected methods that have code in a ReadyToRun image.
+// That code is used without a JITCompilationStarted, so the methods would
+// run without probes; turning it down for these methods only has the JIT
+// compile them from their rewritten IL, and leaves the rest of the image,
+// and the startup time it saves, alone.
+class PrecompiledCode
+{
+private:
+    bool rejecting;
+    std::mutex lock;
+    std::unordered_map<FunctionID, UINT64> pending;    // rejected methods not compiled yet, and the start time of their compilation
+    PrecompiledCodeStatistics statistics;
+public:
+    PrecompiledCode();
+    void Initialize(bool rejecting);
+
+    // Called when a selected method is found in a ReadyToRun image. Returns
+    // true if its precompiled code is to be turned down.
+    bool Found(FunctionID functionId);
+
+    void CompilationStarted(FunctionID functionId);
+    void CompilationFinished(FunctionID functionId, HRESULT hrStatus);
+
+    PrecompiledCodeStatistics GetStatistics();
+};
@@ -0,0 +1,358 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "ReJITManager.h"
+#include "profiler_pal.h"
+#include <algorithm>
+#include <unordered_set>
+
+bool MatchPattern(const char* pattern, const char* text)
+{
+    // Iterative wildcard match; backtracks to the last * on a mismatch.
+    const char* star = nullptr;
+    const char* resume = nullptr;
+
+    while (*text != 0)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = text;
+        }
+        else if (*pattern == '?' || *pattern == *text)
+        {
+            pattern++;
+            text++;
+        }
+        else if (star != nullptr)
+        {
+            pattern = star + 1;
+            text = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*pattern == '*')
+    {
+        pattern++;
+    }
+
+    return *pattern == 0;
+}
+
+static void RemoveModule(std::vector<MethodKey>& keys, ModuleID moduleId)
+{
+    keys.erase(std::remove_if(keys.begin(), keys.end(), [moduleId](const MethodKey& key) { return key.moduleId == moduleId; }), keys.end());
+}
+
+ReJITManager::ReJITManager() : corProfilerInfo(nullptr), originalCodeInstrumented(false), stopRequested(false)
+{
+}
+
+void ReJITManager::Initialize(ICorProfilerInfo8* corProfilerInfo, bool originalCodeInstrumented)
+{
+    this->corProfilerInfo = corProfilerInfo;
+    this->originalCodeInstrumented = originalCodeInstrumented;
+    this->worker = std::thread(&ReJITManager::Run, this);
+}
+
+void ReJITManager::Stop()
+{
+    if (!this->worker.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopRequested = true;
+        this->requestsChanged.notify_all();
+    }
+
+    this->worker.join();
+}
+
+// RequestReJIT and RequestRevert suspend the runtime, so they are issued from
+// this thread rather than from inside the JIT callbacks that found the methods.
+// A method may be instrumented and uninstrumented again before the thread gets
+// to it, so each one is only requested for the state it is in now.
+void ReJITManager::Run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (true)
+    {
+        this->requestsChanged.wait(guard, [this] { return this->stopRequested || !this->pendingChanges.empty(); });
+
+        if (this->stopRequested)
+        {
+            break;
+        }
+
+        std::vector<MethodKey> changes;
+        changes.swap(this->pendingChanges);
+
+        std::unordered_set<MethodKey, MethodKeyHash> requested;
+        std::vector<MethodKey> reJITs;
+        std::vector<MethodKey> reverts;
+        for (const MethodKey& key : changes)
+        {
+            auto found = this->methods.find(key);
+            if (found == this->methods.end() || !requested.insert(key).second)
+            {
+                continue;
+            }
+
+            // With the probes in the original code, they are removed by
+            // rejitting the method with a copy of its original IL.
+            (found->second.instrumented || this->originalCodeInstrumented ? reJITs : reverts).push_back(key);
+        }
+
+        guard.unlock();
+
+        for (int pass = 0; pass < 2; pass++)
+        {
+            std::vector<MethodKey>& keys = pass == 0 ? reJITs : reverts;
+            if (keys.empty())
+            {
+                continue;
+            }
+
+            std::vector<ModuleID> moduleIds;
+            std::vector<mdMethodDef> methodDefs;
+            for (const MethodKey& key : keys)
+            {
+                moduleIds.push_back(key.moduleId);
+                methodDefs.push_back(key.methodDef);
+            }
+
+            HRESULT hr;
+            if (pass == 0)
+            {
+                hr = this->corProfilerInfo->RequestReJIT((ULONG)keys.size(), moduleIds.data(), methodDefs.data());
+            }
+            else
+            {
+                std::vector<HRESULT> statuses(keys.size());
+                hr = this->corProfilerInfo->RequestRevert((ULONG)keys.size(), moduleIds.data(), methodDefs.data(), statuses.data());
+            }
+
+            if (FAILED(hr))
+            {
+                printf("ERROR: %s failed for %u methods (HRESULT: 0x%08x)\r\n", pass == 0 ? "RequestReJIT" : "RequestRevert", (unsigned)keys.size(), (unsigned)hr);
+            }
+        }
+
+        guard.lock();
+    }
+}
+
+bool ReJITManager::MatchesAnyPattern(const std::string& name)
+{
+    for (const std::string& pattern : this->patterns)
+    {
+        if (MatchPattern(pattern.c_str(), name.c_str()))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Must be called with the lock held.
+void ReJITManager::RemoveProbes(const MethodKey& key, MethodEntry& entry)
+{
+    entry.instrumented = false;
+    this->pendingChanges.push_back(key);
+}
+
+void ReJITManager::AddPatterns(const std::string& patternList)
+{
+    size_t begin = 0;
+    while (begin <= patternList.size())
+    {
+        size_t end = patternList.find(';', begin);
+        if (end == std::string::npos)
+        {
+            end = patternList.size();
+        }
+
+        if (end > begin)
+        {
+            this->Instrument(patternList.substr(begin, end - begin));
+        }
+
+        begin = end + 1;
+    }
+}
+
+void ReJITManager::MethodLoaded(FunctionID functionId, ModuleID moduleId, mdMethodDef methodDef, const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    MethodKey key = { moduleId, methodDef };
+    auto inserted = this->methods.insert({ key, { functionId, name, this->originalCodeInstrumented, false } });
+    if (!inserted.second || this->originalCodeInstrumented || !this->MatchesAnyPattern(name))
+    {
+        return;
+    }
+
+    inserted.first->second.instrumented = true;
+    this->pendingChanges.push_back(key);
+    this->requestsChanged.notify_all();
+}
+
+void ReJITManager::ModuleUnloaded(ModuleID moduleId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    for (auto entry = this->methods.begin(); entry != this->methods.end();)
+    {
+        entry = entry->first.moduleId == moduleId ? this->methods.erase(entry) : std::next(entry);
+    }
+
+    for (auto entry = this->originalBodies.begin(); entry != this->originalBodies.end();)
+    {
+        entry = entry->first.moduleId == moduleId ? this->originalBodies.erase(entry) : std::next(entry);
+    }
+
+    RemoveModule(this->pendingChanges, moduleId);
+}
+
+void ReJITManager::SaveOriginalIL(ModuleID moduleId, mdMethodDef methodDef, LPCBYTE body, ULONG bodySize)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->originalBodies.insert({ { moduleId, methodDef }, std::vector<BYTE>(body, body + bodySize) });
+}
+
+bool ReJITManager::GetOriginalIL(ModuleID moduleId, mdMethodDef methodDef, std::vector<BYTE>* body)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->originalBodies.find({ moduleId, methodDef });
+    if (found == this->originalBodies.end())
+    {
+        return false;
+    }
+
+    *body = found->second;
+    return true;
+}
+
+size_t ReJITManager::Instrument(const std::string& pattern)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (std::find(this->patterns.begin(), this->patterns.end(), pattern) == this->patterns.end())
+    {
+        this->patterns.push_back(pattern);
+    }
+
+    size_t count = 0;
+    for (auto& entry : this->methods)
+    {
+        if (!entry.second.instrumented && !entry.second.overBudget && MatchPattern(pattern.c_str(), entry.second.name.c_str()))
+        {
+            entry.second.instrumented = true;
+            this->pendingChanges.push_back(entry.first);
+            count++;
+        }
+    }
+
+    this->requestsChanged.notify_all();
+    return count;
+}
+
+size_t ReJITManager::Uninstrument(const std::string& pattern)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    this->patterns.erase(std::remove(this->patterns.begin(), this->patterns.end(), pattern), this->patterns.end());
+
+    size_t count = 0;
+    for (auto& entry : this->methods)
+    {
+        if (entry.second.instrumented && MatchPattern(pattern.c_str(), entry.second.name.c_str()))
+        {
+            this->RemoveProbes(entry.first, entry.second);
+            count++;
+        }
+    }
+
+    this->requestsChanged.notify_all();
+    return count;
+}
+
+size_t ReJITManager::Revert(const std::vector<FunctionID>& functionIds)
+{
+    std::unordered_set<FunctionID> selected(functionIds.begin(), functionIds.end());
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    size_t count = 0;
+    for (auto& entry : this->methods)
+    {
+        if (entry.second.instrumented && selected.count(entry.second.functionId) != 0)
+        {
+            entry.second.overBudget = true;
+            this->RemoveProbes(entry.first, entry.second);
+            count++;
+        }
+    }
+
+    this->requestsChanged.notify_all();
+    return count;
+}
+
+bool ReJITManager::GetInstrumentedFunction(ModuleID moduleId, mdMethodDef methodDef, FunctionID* functionId)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->methods.find({ moduleId, methodDef });
+    if (found == this->methods.end() || !found->second.instrumented)
+    {
+        return false;
+    }
+
+    *functionId = found->second.functionId;
+    return true;
+}
+
+bool ReJITManager::IsSelected(ModuleID moduleId, mdMethodDef methodDef, const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto found = this->methods.find({ moduleId, methodDef });
+    if (found != this->methods.end())
+    {
+        return found->second.instrumented;
+    }
+
+    return this->MatchesAnyPattern(name);
+}
+
+std::vector<std::string> ReJITManager::GetPatterns()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->patterns;
+}
+
+std::vector<std::string> ReJITManager::GetInstrumentedNames()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    std::vector<std::string> names;
+    for (auto& entry : this->methods)
+    {
+        if (entry.second.instrumented)
+        {
+            names.push_back(entry.second.name);
+        }
+    }
+
+    std::sort(names.begin(), names.end());
+    return names;
+}
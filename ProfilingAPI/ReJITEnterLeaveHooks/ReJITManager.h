@@ -0,0 +1,108 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+struct MethodKey
+{
+    ModuleID moduleId;
+    mdMethodDef methodDef;
+
+    bool operator==(const MethodKey& other) const
+    {
+        return this->moduleId == other.moduleId && this->methodDef == other.methodDef;
+    }
+};
+
+struct MethodKeyHash
+{
+    size_t operator()(const MethodKey& key) const
+    {
+        return std::hash<UINT64>()((UINT64)key.moduleId ^ ((UINT64)key.methodDef << 32));
+    }
+};
+
+// Chooses which methods get the Enter/Leave probes when the profiler runs in
+// "rejit" mode. Methods are compiled without probes; the ones whose name
+// matches a pattern are instrumented afterwards with RequestReJIT, and can be
+// reverted to their original code with RequestRevert.
+//
+// When every method is instrumented at its first JIT instead, the original
+// code already has the probes. SetILFunctionBody replaces the IL for good, and
+// RequestRevert would only go back to that instrumented IL, so a copy of the
+// original IL is kept before the rewrite; the probes are removed by rejitting
+// the method with the copy, and added back by rewriting the copy again.
+//
+// Patterns are matched against "Namespace.Type::Method" names, with * and ?
+// as wildcards. Patterns given up front also apply to methods compiled later.
+class ReJITManager
+{
+private:
+    struct MethodEntry
+    {
+        FunctionID functionId;  // first instantiation seen; all of them share the rewritten IL
+        std::string name;
+        bool instrumented;
+        bool overBudget;        // reverted by the overhead controller, patterns no longer apply
+    };
+
+    ICorProfilerInfo8* corProfilerInfo;
+    bool originalCodeInstrumented;
+    std::mutex lock;
+    std::condition_variable requestsChanged;
+    std::vector<std::string> patterns;
+    std::unordered_map<MethodKey, MethodEntry, MethodKeyHash> methods;
+    std::unordered_map<MethodKey, std::vector<BYTE>, MethodKeyHash> originalBodies;
+    std::vector<MethodKey> pendingChanges;  // methods whose probes are to be added or removed
+    std::thread worker;
+    bool stopRequested;
+
+    bool MatchesAnyPattern(const std::string& name);
+    void RemoveProbes(const MethodKey& key, MethodEntry& entry);
+    void Run();
+public:
+    ReJITManager();
+    void Initialize(ICorProfilerInfo8* corProfilerInfo, bool originalCodeInstrumented);
+    void Stop();
+
+    // Adds a ';' separated list of patterns.
+    void AddPatterns(const std::string& patternList);
+
+    // Called the first time a method's code is needed, whether it is jitted
+    // or loaded from a ReadyToRun image.
+    void MethodLoaded(FunctionID functionId, ModuleID moduleId, mdMethodDef methodDef, const std::string& name);
+    void ModuleUnloaded(ModuleID moduleId);
+
+    // Called before a method is instrumented at its first JIT.
+    void SaveOriginalIL(ModuleID moduleId, mdMethodDef methodDef, LPCBYTE body, ULONG bodySize);
+
+    // Returns false if the method's IL was never replaced.
+    bool GetOriginalIL(ModuleID moduleId, mdMethodDef methodDef, std::vector<BYTE>* body);
+
+    // Both return the number of methods that were requested.
+    size_t Instrument(const std::string& pattern);
+    size_t Uninstrument(const std::string& pattern);
+    size_t Revert(const std::vector<FunctionID>& functionIds);
+
+    // Looks up the method GetReJITParameters was called for. Returns false if
+    // the method shouldn't be instrumented (anymore).
+    bool GetInstrumentedFunction(ModuleID moduleId, mdMethodDef methodDef, FunctionID* functionId);
+
+    // Whether the method is instrumented or would be once it is loaded.
+    bool IsSelected(ModuleID moduleId, mdMethodDef methodDef, const std::string& name);
+
+    std::vector<std::string> GetPatterns();
+    std::vector<std::string> GetInstrumentedNames();
+};
+
+// Matches the whole text, with * and ? as wildcards.
+bool MatchPattern(const char* pattern, const char* text);
@@ -0,0 +1,167 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "Statistics.h"
+#include "FunctionRegistry.h"
+#include "Timestamp.h"
+#include <algorithm>
+#include <mutex>
+
+struct Counters
+{
+    UINT64 callCount;
+    UINT64 inclusiveTime;
+    UINT64 exclusiveTime;
+};
+
+struct Frame
+{
+    UINT32 functionIndex;
+    UINT64 startTime;
+    UINT64 childTime;
+};
+
+typedef std::vector<Counters> CounterTable; // by function index
+
+struct ThreadStatistics
+{
+    std::mutex lock;        // only contended while the control thread takes a snapshot
+    CounterTable counters;
+    std::vector<Frame> stack;
+};
+
+static std::mutex threadsLock;
+static std::vector<ThreadStatistics*> threads;
+static CounterTable retiredCounters; // totals of threads that have exited
+
+static Counters& GetCounters(CounterTable& table, UINT32 functionIndex)
+{
+    if (table.size() <= functionIndex)
+    {
+        table.resize(functionIndex + 1);
+    }
+
+    return table[functionIndex];
+}
+
+static void Accumulate(CounterTable& table, UINT32 functionIndex, const Counters& counters)
+{
+    Counters& total = GetCounters(table, functionIndex);
+    total.callCount += counters.callCount;
+    total.inclusiveTime += counters.inclusiveTime;
+    total.exclusiveTime += counters.exclusiveTime;
+}
+
+class ThreadStatisticsHolder
+{
+public:
+    ThreadStatistics* statistics;
+
+    ThreadStatisticsHolder() : statistics(new ThreadStatistics())
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        threads.push_back(this->statistics);
+    }
+
+    ~ThreadStatisticsHolder()
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        threads.erase(std::remove(threads.begin(), threads.end(), this->statistics), threads.end());
+
+        for (size_t i = 0; i < this->statistics->counters.size(); i++)
+        {
+            Accumulate(retiredCounters, (UINT32)i, this->statistics->counters[i]);
+        }
+
+        delete this->statistics;
+    }
+};
+
+static ThreadStatistics* GetThreadStatistics()
+{
+    static thread_local ThreadStatisticsHolder holder;
+    return holder.statistics;
+}
+
+void Statistics::Enter(UINT32 functionIndex)
+{
+    ThreadStatistics* thread = GetThreadStatistics();
+    thread->stack.push_back({ functionIndex, GetTimestamp(), 0 });
+}
+
+void Statistics::Leave(UINT32 functionIndex)
+{
+    UINT64 now = GetTimestamp();
+    ThreadStatistics* thread = GetThreadStatistics();
+
+    // Frames above the matching one belong to methods that were unwound by an
+    // exception and never ran their Leave probe. A Leave without any matching
+    // frame was entered before tracing started, and is ignored.
+    size_t depth = thread->stack.size();
+    while (depth > 0 && thread->stack[depth - 1].functionIndex != functionIndex)
+    {
+        depth--;
+    }
+
+    if (depth == 0)
+    {
+        return;
+    }
+
+    Frame frame = thread->stack[depth - 1];
+    thread->stack.resize(depth - 1);
+
+    UINT64 elapsed = now - frame.startTime;
+    if (!thread->stack.empty())
+    {
+        thread->stack.back().childTime += elapsed;
+    }
+
+    std::lock_guard<std::mutex> guard(thread->lock);
+    Counters& counters = GetCounters(thread->counters, functionIndex);
+    counters.callCount++;
+    counters.inclusiveTime += elapsed;
+    counters.exclusiveTime += elapsed - std::min(elapsed, frame.childTime);
+}
+
+std::vector<FunctionStatistics> Statistics::Snapshot()
+{
+    CounterTable merged;
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        merged = retiredCounters;
+
+        for (ThreadStatistics* thread : threads)
+        {
+            std::lock_guard<std::mutex> threadGuard(thread->lock);
+            for (size_t i = 0; i < thread->counters.size(); i++)
+            {
+                Accumulate(merged, (UINT32)i, thread->counters[i]);
+            }
+        }
+    }
+
+    std::vector<FunctionStatistics> result;
+    for (size_t i = 0; i < merged.size(); i++)
+    {
+        const Counters& counters = merged[i];
+        if (counters.callCount != 0)
+        {
+            result.push_back({ FunctionRegistry::GetFunctionId((UINT32)i), counters.callCount, counters.inclusiveTime, counters.exclusiveTime });
+        }
+    }
+
+    return result;
+}
+
+void Statistics::Reset()
+{
+    std::lock_guard<std::mutex> guard(threadsLock);
+    retiredCounters.clear();
+
+    for (ThreadStatistics* thread : threads)
+    {
+        std::lock_guard<std::mutex> threadGuard(thread->lock);
+        thread->counters.clear();
+    }
+}
@@ -0,0 +1,30 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+
+struct FunctionStatistics
+{
+    FunctionID functionId;
+    UINT64 callCount;
+    UINT64 inclusiveTime;   // nanoseconds
+    UINT64 exclusiveTime;   // nanoseconds, time spent in callees subtracted
+};
+
+// Per-function call counts and timings gathered from the Enter/Leave probes.
+// Every thread aggregates into its own table, indexed by the function's
+// FunctionRegistry index, so the probes never contend with each other;
+// Snapshot and Reset walk all the tables from the control thread.
+class Statistics
+{
+public:
+    static void Enter(UINT32 functionIndex);
+    static void Leave(UINT32 functionIndex);
+
+    static std::vector<FunctionStatistics> Snapshot();
+    static void Reset();
+};
@@ -0,0 +1,115 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+// On-disk layout of the binary trace written in "trace" mode. Shared with the
+// TraceAnalyzer tool, so this header must not depend on the CoreCLR headers.
+//
+//   TraceFileHeader
+//   TraceBlockHeader, payload[storedSize]
+//   TraceBlockHeader, payload[storedSize]
+//   ...
+//
+// Every block holds consecutive events of a single thread; blocks of
+// different threads are interleaved in the order they were flushed. Blocks
+// don't refer to each other, so they can be decoded in any order. The
+// (decompressed) payload is:
+//
+//   dictionary:  dictionarySize x varint(zigzag(functionId - previous entry))
+//   records:     recordCount x { varint(dictionary index << 1 | TRACE_EVENT_*),
+//                                varint(zigzag(timestamp - previous timestamp)) }
+//
+// where the first entry is relative to 0 and the first timestamp is relative
+// to the block's baseTimestamp. With TRACE_BLOCK_LZ4 set the payload is
+// compressed as a single LZ4 block.
+//
+// The symbol table is a separate text file with one "0x<functionId>\t<name>"
+// line per function that appears in the trace.
+
+#include <cstddef>
+#include <cstdint>
+
+#define TRACE_FILE_MAGIC    0x31454341525452ULL  // "RTRACE1"
+#define TRACE_FILE_VERSION  2
+
+#define TRACE_EVENT_ENTER   0
+#define TRACE_EVENT_LEAVE   1
+
+#define TRACE_BLOCK_LZ4     0x1
+
+#define TRACE_MAX_VARINT_SIZE   10
+
+struct TraceFileHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t startTimestamp;    // nanoseconds, same clock as the records
+    uint64_t reserved;
+};
+
+struct TraceBlockHeader
+{
+    uint32_t threadIndex;       // small sequential id assigned per traced thread
+    uint32_t recordCount;
+    uint32_t dictionarySize;
+    uint32_t flags;             // TRACE_BLOCK_*
+    uint32_t storedSize;        // payload bytes following this header
+    uint32_t encodedSize;       // payload bytes after decompression
+    uint64_t baseTimestamp;
+};
+
+// A decoded event.
+struct TraceRecord
+{
+    uint64_t functionId;
+    uint64_t timestampAndKind;  // timestamp in nanoseconds << 1 | TRACE_EVENT_*
+
+    uint64_t Timestamp() const { return this->timestampAndKind >> 1; }
+    unsigned Kind() const { return (unsigned)(this->timestampAndKind & 1); }
+};
+
+static_assert(sizeof(TraceFileHeader) == 32, "TraceFileHeader layout");
+static_assert(sizeof(TraceBlockHeader) == 32, "TraceBlockHeader layout");
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord layout");
+
+inline uint64_t TraceZigZag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t TraceUnZigZag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Writes at most TRACE_MAX_VARINT_SIZE bytes and returns the end of the value.
+inline uint8_t* TraceWriteVarint(uint8_t* out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Returns nullptr if the value runs past end.
+inline const uint8_t* TraceReadVarint(const uint8_t* in, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for (unsigned shift = 0; in < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *in++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (byte < 0x80)
+        {
+            return in;
+        }
+    }
+
+    return nullptr;
+}
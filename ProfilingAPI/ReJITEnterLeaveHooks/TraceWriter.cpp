@@ -0,0 +1,473 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "TraceWriter.h"
+#include "BatchAggregator.h"
+#include "FunctionRegistry.h"
+#include "TraceFormat.h"
+#include "Timestamp.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef TRACE_LZ4
+#include <lz4.h>
+#endif
+
+#define RECORDS_PER_BUFFER  65536   // 1 MB per buffer
+#define MAX_BUFFERS         64
+#define FILE_BUFFER_SIZE    (1 << 20)
+#define DROP_RETRY_INTERVAL 4096    // events a thread drops before it looks for a free buffer again
+
+struct TraceBuffer
+{
+    std::atomic<UINT32> count;
+    TraceEvent records[RECORDS_PER_BUFFER];
+};
+
+struct ThreadTrace
+{
+    UINT32 threadIndex;
+    std::mutex lock;        // taken by the owning thread only when it swaps buffers
+    TraceBuffer* buffer;
+    UINT32 flushed;         // records of the current buffer already handed to the flusher
+    UINT32 dropsBeforeRetry; // owning thread only: events left to drop without taking any lock
+};
+
+// A range of records for the flusher to write. Flush hands out ranges of
+// buffers that are still being filled; the owning thread queues the buffer one
+// last time with releaseBuffer set once it is full, and since the queue is
+// FIFO the buffer is only recycled after all of its ranges are written.
+struct QueuedChunk
+{
+    UINT32 threadIndex;
+    TraceBuffer* buffer;
+    UINT32 begin;
+    UINT32 end;
+    bool releaseBuffer;
+};
+
+static std::atomic<bool> isOpen(false);
+static std::atomic<UINT64> writtenEvents(0);
+static std::atomic<UINT64> droppedEvents(0);
+static std::atomic<UINT64> writtenBytes(0);
+
+static std::mutex threadsLock;
+static std::vector<ThreadTrace*> threads;
+static UINT32 nextThreadIndex = 0;
+
+static std::mutex queueLock;
+static std::condition_variable queueChanged;
+static std::deque<QueuedChunk> queue;
+static std::vector<TraceBuffer*> freeBuffers;
+static UINT32 allocatedBuffers = 0;
+static bool flusherBusy = false;
+static bool stopRequested = false;
+
+static std::thread flusherThread;
+static FILE* traceFile = nullptr;
+static FILE* symbolsFile = nullptr;
+static TraceWriter::NameCallback resolveName;
+static std::vector<bool> knownFunctions;        // by function index, already in the symbol table
+static BatchAggregator aggregator;
+
+// Scratch space of the flusher thread.
+static std::vector<UINT32> blockIndices;        // by function index, dictionary index + 1, or 0 if not in the block
+static std::vector<UINT32> blockDictionary;     // function indexes
+static std::vector<uint8_t> recordBytes;
+static std::vector<uint8_t> encodedBytes;
+#ifdef TRACE_LZ4
+static std::vector<uint8_t> compressedBytes;
+#endif
+
+static TraceBuffer* AcquireBuffer()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+
+    if (!freeBuffers.empty())
+    {
+        TraceBuffer* buffer = freeBuffers.back();
+        freeBuffers.pop_back();
+        buffer->count.store(0, std::memory_order_relaxed);
+        return buffer;
+    }
+
+    if (allocatedBuffers == MAX_BUFFERS)
+    {
+        return nullptr;
+    }
+
+    allocatedBuffers++;
+    TraceBuffer* buffer = new TraceBuffer();
+    buffer->count.store(0, std::memory_order_relaxed);
+    return buffer;
+}
+
+static void QueueChunk(const QueuedChunk& chunk)
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    queue.push_back(chunk);
+    queueChanged.notify_all();
+}
+
+// Must be called with thread->lock held.
+static void RetireBuffer(ThreadTrace* thread)
+{
+    if (thread->buffer == nullptr)
+    {
+        return;
+    }
+
+    UINT32 count = thread->buffer->count.load(std::memory_order_acquire);
+    QueueChunk({ thread->threadIndex, thread->buffer, thread->flushed, count, true });
+
+    thread->buffer = nullptr;
+    thread->flushed = 0;
+}
+
+class ThreadTraceHolder
+{
+public:
+    ThreadTrace* trace;
+
+    ThreadTraceHolder() : trace(new ThreadTrace())
+    {
+        this->trace->buffer = nullptr;
+        this->trace->flushed = 0;
+        this->trace->dropsBeforeRetry = 0;
+
+        std::lock_guard<std::mutex> guard(threadsLock);
+        this->trace->threadIndex = nextThreadIndex++;
+        threads.push_back(this->trace);
+    }
+
+    ~ThreadTraceHolder()
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        threads.erase(std::remove(threads.begin(), threads.end(), this->trace), threads.end());
+
+        {
+            std::lock_guard<std::mutex> threadGuard(this->trace->lock);
+            RetireBuffer(this->trace);
+        }
+
+        delete this->trace;
+    }
+};
+
+static ThreadTrace* GetThreadTrace()
+{
+    static thread_local ThreadTraceHolder holder;
+    return holder.trace;
+}
+
+static void Append(UINT32 functionIndex, unsigned kind)
+{
+    ThreadTrace* thread = GetThreadTrace();
+    TraceBuffer* buffer = thread->buffer;
+
+    // While the flusher is behind, a thread that found no free buffer drops
+    // its next events without locking, and only looks again now and then.
+    if (buffer == nullptr && thread->dropsBeforeRetry > 0)
+    {
+        thread->dropsBeforeRetry--;
+        droppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    UINT32 count = buffer != nullptr ? buffer->count.load(std::memory_order_relaxed) : RECORDS_PER_BUFFER;
+
+    if (count == RECORDS_PER_BUFFER)
+    {
+        std::lock_guard<std::mutex> guard(thread->lock);
+        RetireBuffer(thread);
+        buffer = thread->buffer = AcquireBuffer();
+
+        if (buffer == nullptr)
+        {
+            thread->dropsBeforeRetry = DROP_RETRY_INTERVAL;
+            droppedEvents.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        count = 0;
+    }
+
+    buffer->records[count].functionIndex = functionIndex;
+    buffer->records[count].timestampAndKind = (GetTimestamp() << 1) | kind;
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+// Encodes a range of records as one self-contained block (see TraceFormat.h).
+static void WriteChunk(const QueuedChunk& chunk)
+{
+    UINT32 recordCount = chunk.end - chunk.begin;
+    if (recordCount == 0)
+    {
+        return;
+    }
+
+    const TraceEvent* records = &chunk.buffer->records[chunk.begin];
+
+    blockDictionary.clear();
+    recordBytes.resize((size_t)recordCount * 2 * TRACE_MAX_VARINT_SIZE);
+
+    UINT32 functionCount = FunctionRegistry::GetCount();
+    if (blockIndices.size() < functionCount)
+    {
+        blockIndices.resize(functionCount, 0);
+        knownFunctions.resize(functionCount, false);
+    }
+
+    uint8_t* out = recordBytes.data();
+    UINT64 baseTimestamp = records[0].Timestamp();
+    UINT64 previousTimestamp = baseTimestamp;
+
+    for (UINT32 i = 0; i < recordCount; i++)
+    {
+        UINT32 functionIndex = records[i].functionIndex;
+
+        UINT32& entry = blockIndices[functionIndex];
+        if (entry == 0)
+        {
+            blockDictionary.push_back(functionIndex);
+            entry = (UINT32)blockDictionary.size();
+        }
+
+        UINT64 timestamp = records[i].Timestamp();
+        out = TraceWriteVarint(out, ((UINT64)(entry - 1) << 1) | records[i].Kind());
+        out = TraceWriteVarint(out, TraceZigZag((INT64)(timestamp - previousTimestamp)));
+        previousTimestamp = timestamp;
+    }
+
+    size_t recordSize = out - recordBytes.data();
+
+    encodedBytes.resize(blockDictionary.size() * TRACE_MAX_VARINT_SIZE + recordSize);
+    out = encodedBytes.data();
+
+    FunctionID previousEntry = 0;
+    for (UINT32 functionIndex : blockDictionary)
+    {
+        FunctionID functionId = FunctionRegistry::GetFunctionId(functionIndex);
+        out = TraceWriteVarint(out, TraceZigZag((INT64)(functionId - previousEntry)));
+        previousEntry = functionId;
+        blockIndices[functionIndex] = 0;
+    }
+
+    memcpy(out, recordBytes.data(), recordSize);
+    out += recordSize;
+
+    TraceBlockHeader header = { chunk.threadIndex, recordCount, (UINT32)blockDictionary.size(), 0, 0, (UINT32)(out - encodedBytes.data()), baseTimestamp };
+    const uint8_t* payload = encodedBytes.data();
+    header.storedSize = header.encodedSize;
+
+#ifdef TRACE_LZ4
+    compressedBytes.resize(LZ4_compressBound(header.encodedSize));
+    int compressedSize = LZ4_compress_default((const char*)encodedBytes.data(), (char*)compressedBytes.data(), header.encodedSize, (int)compressedBytes.size());
+
+    if (compressedSize > 0 && (UINT32)compressedSize < header.encodedSize)
+    {
+        header.flags |= TRACE_BLOCK_LZ4;
+        header.storedSize = compressedSize;
+        payload = compressedBytes.data();
+    }
+#endif
+
+    fwrite(&header, sizeof(header), 1, traceFile);
+    fwrite(payload, 1, header.storedSize, traceFile);
+
+    for (UINT32 functionIndex : blockDictionary)
+    {
+        if (!knownFunctions[functionIndex])
+        {
+            knownFunctions[functionIndex] = true;
+
+            FunctionID functionId = FunctionRegistry::GetFunctionId(functionIndex);
+            fprintf(symbolsFile, "0x%llx\t%s\n", (unsigned long long)functionId, resolveName(functionId).c_str());
+        }
+    }
+
+    writtenEvents.fetch_add(recordCount, std::memory_order_relaxed);
+    writtenBytes.fetch_add(sizeof(header) + header.storedSize, std::memory_order_relaxed);
+}
+
+static void RunFlusher()
+{
+    std::unique_lock<std::mutex> guard(queueLock);
+
+    while (true)
+    {
+        queueChanged.wait(guard, [] { return !queue.empty() || stopRequested; });
+
+        if (queue.empty())
+        {
+            break;
+        }
+
+        QueuedChunk chunk = queue.front();
+        queue.pop_front();
+        flusherBusy = true;
+        guard.unlock();
+
+        WriteChunk(chunk);
+        aggregator.Add(chunk.threadIndex, &chunk.buffer->records[chunk.begin], chunk.end - chunk.begin);
+
+        guard.lock();
+        flusherBusy = false;
+
+        if (chunk.releaseBuffer)
+        {
+            freeBuffers.push_back(chunk.buffer);
+        }
+
+        queueChanged.notify_all();
+    }
+}
+
+bool TraceWriter::Open(const std::string& tracePath, NameCallback nameCallback)
+{
+    if (isOpen)
+    {
+        return true;
+    }
+
+    std::string symbolsPath = tracePath + ".symbols";
+
+    traceFile = fopen(tracePath.c_str(), "wb");
+    symbolsFile = fopen(symbolsPath.c_str(), "w");
+
+    if (traceFile == nullptr || symbolsFile == nullptr)
+    {
+        printf("ERROR: Could not create trace files %s, %s\n", tracePath.c_str(), symbolsPath.c_str());
+
+        if (traceFile != nullptr)
+        {
+            fclose(traceFile);
+            traceFile = nullptr;
+        }
+
+        if (symbolsFile != nullptr)
+        {
+            fclose(symbolsFile);
+            symbolsFile = nullptr;
+        }
+
+        return false;
+    }
+
+    setvbuf(traceFile, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+
+    TraceFileHeader header = { TRACE_FILE_MAGIC, TRACE_FILE_VERSION, sizeof(TraceFileHeader), GetTimestamp(), 0 };
+    fwrite(&header, sizeof(header), 1, traceFile);
+
+    resolveName = nameCallback;
+    stopRequested = false;
+    flusherThread = std::thread(RunFlusher);
+    isOpen = true;
+
+    return true;
+}
+
+bool TraceWriter::IsOpen()
+{
+    return isOpen;
+}
+
+void TraceWriter::Close()
+{
+    if (!isOpen)
+    {
+        return;
+    }
+
+    Flush();
+
+    {
+        std::lock_guard<std::mutex> guard(queueLock);
+        stopRequested = true;
+        queueChanged.notify_all();
+    }
+
+    flusherThread.join();
+    isOpen = false;
+
+    fclose(traceFile);
+    fclose(symbolsFile);
+    traceFile = nullptr;
+    symbolsFile = nullptr;
+}
+
+void TraceWriter::Enter(UINT32 functionIndex)
+{
+    Append(functionIndex, TRACE_EVENT_ENTER);
+}
+
+void TraceWriter::Leave(UINT32 functionIndex)
+{
+    Append(functionIndex, TRACE_EVENT_LEAVE);
+}
+
+void TraceWriter::Flush()
+{
+    if (!isOpen)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+
+        for (ThreadTrace* thread : threads)
+        {
+            std::lock_guard<std::mutex> threadGuard(thread->lock);
+            if (thread->buffer == nullptr)
+            {
+                continue;
+            }
+
+            UINT32 count = thread->buffer->count.load(std::memory_order_acquire);
+            if (count > thread->flushed)
+            {
+                QueueChunk({ thread->threadIndex, thread->buffer, thread->flushed, count, false });
+                thread->flushed = count;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(queueLock);
+    queueChanged.wait(guard, [] { return queue.empty() && !flusherBusy; });
+
+    fflush(traceFile);
+    fflush(symbolsFile);
+}
+
+UINT64 TraceWriter::GetWrittenEvents()
+{
+    return writtenEvents;
+}
+
+UINT64 TraceWriter::GetDroppedEvents()
+{
+    return droppedEvents;
+}
+
+std::vector<FunctionTotals> TraceWriter::GetStatistics()
+{
+    return aggregator.Snapshot();
+}
+
+void TraceWriter::ResetStatistics()
+{
+    aggregator.Reset();
+}
+
+UINT64 TraceWriter::GetWrittenBytes()
+{
+    return writtenBytes;
+}
@@ -0,0 +1,44 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "cor.h"
+#include "corprof.h"
+#include "BatchAggregator.h"
+
+// Writes every Enter/Leave to a binary trace file (see TraceFormat.h) for
+// offline analysis. The probes append their function index to per-thread
+// buffers; full buffers are encoded into compact blocks by a flusher thread,
+// which turns the indexes into FunctionIDs for the blocks and also writes the
+// symbol table for every function that shows up in the trace and aggregates
+// the records into per-function statistics on the way. When the flusher falls
+// behind and all buffers are in use, events are dropped and counted rather
+// than blocking the application.
+class TraceWriter
+{
+public:
+    typedef std::function<std::string(FunctionID functionId)> NameCallback;
+
+    static bool Open(const std::string& tracePath, NameCallback resolveName);
+    static bool IsOpen();
+    static void Close();
+
+    static void Enter(UINT32 functionIndex);
+    static void Leave(UINT32 functionIndex);
+
+    // Hands the partially filled buffers of all threads to the flusher and
+    // waits until everything recorded so far is on disk.
+    static void Flush();
+
+    // Statistics of the events written so far, by function index.
+    static std::vector<FunctionTotals> GetStatistics();
+    static void ResetStatistics();
+
+    static UINT64 GetWrittenEvents();
+    static UINT64 GetDroppedEvents();
+    static UINT64 GetWrittenBytes();
+};
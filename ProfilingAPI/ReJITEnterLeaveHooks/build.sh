@@ -5,17 +5,26 @@
 [ -z "${BuildArch:-}"    ] && BuildArch=x64
 [ -z "${BuildType:-}"    ] && BuildType=Debug
 [ -z "${Output:-}"       ] && Output=CorProfiler.so
+[ -z "${UseLZ4:-}"       ] && UseLZ4=0
 
 printf '  CORECLR_PATH : %s\n' "$CORECLR_PATH"
 printf '  BuildOS      : %s\n' "$BuildOS"
 printf '  BuildArch    : %s\n' "$BuildArch"
 printf '  BuildType    : %s\n' "$BuildType"
+printf '  UseLZ4       : %s\n' "$UseLZ4"
 
 printf '  Building %s ... ' "$Output"
 
-CXX_FLAGS="$CXX_FLAGS --no-undefined -Wno-invalid-noreturn -fPIC -fms-extensions -DBIT64 -DPAL_STDCPP_COMPAT -DPLATFORM_UNIX -std=c++11"
+CXX_FLAGS="$CXX_FLAGS --no-undefined -Wno-invalid-noreturn -fPIC -fms-extensions -DBIT64 -DPAL_STDCPP_COMPAT -DPLATFORM_UNIX -std=c++11 -pthread"
+[ "$UseLZ4" = "1" ] && CXX_FLAGS="$CXX_FLAGS -DTRACE_LZ4" && LIBS="$LIBS -llz4"
 INCLUDES="-I $CORECLR_PATH/src/pal/inc/rt -I $CORECLR_PATH/src/pal/prebuilt/inc -I $CORECLR_PATH/src/pal/inc -I $CORECLR_PATH/src/inc -I $CORECLR_PATH/bin/Product/$BuildOS.$BuildArch.$BuildType/inc"
 
-clang++ -shared -o $Output $CXX_FLAGS $INCLUDES ClassFactory.cpp CorProfiler.cpp dllmain.cpp ILRewriter.cpp
+clang++ -shared -o $Output $CXX_FLAGS $INCLUDES BatchAggregator.cpp CallCounters.cpp ClassFactory.cpp CodeVersions.cpp ControlServer.cpp CorProfiler.cpp dllmain.cpp DynamicMethods.cpp FunctionRegistry.cpp ILCache.cpp ILCorpus.cpp ILRewriter.cpp MethodFilter.cpp MethodSelector.cpp ModuleMetadataCache.cpp NameResolver.cpp OverheadController.cpp PrecompiledCode.cpp PreInstrumenter.cpp ReJITManager.cpp Statistics.cpp TraceWriter.cpp $LIBS
+
+printf 'Done.\n'
+
+printf '  Building profctl ... '
+
+clang++ -o profctl -std=c++11 ControlClient.cpp
 
 printf 'Done.\n'
\ No newline at end of file
@@ -0,0 +1,647 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+// Offline analyzer for the binary traces written by the ReJITEnterLeaveHooks
+// profiler in "trace" mode. The trace is memory mapped and its blocks are
+// decoded in parallel into per-thread event arrays. Every thread's events are
+// then replayed on a pool of worker threads to rebuild its call tree and
+// per-function statistics, and the per-thread results are merged at the end.
+
+#include "../ReJITEnterLeaveHooks/TraceFormat.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#ifdef TRACE_LZ4
+#include <lz4.h>
+#endif
+
+#define HISTOGRAM_BUCKETS 64
+
+struct MappedFile
+{
+    const uint8_t* data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0)
+    {
+    }
+
+    ~MappedFile()
+    {
+        if (this->data != nullptr)
+        {
+            munmap(const_cast<uint8_t*>(this->data), this->size);
+        }
+    }
+
+    bool Open(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+
+        madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+
+        this->data = static_cast<const uint8_t*>(mapping);
+        this->size = info.st_size;
+        return true;
+    }
+};
+
+struct FunctionStatistics
+{
+    uint64_t callCount;
+    uint64_t inclusiveTime;
+    uint64_t exclusiveTime;
+    uint64_t histogram[HISTOGRAM_BUCKETS]; // calls by log2 of their inclusive time in nanoseconds
+
+    void Add(const FunctionStatistics& other)
+    {
+        this->callCount += other.callCount;
+        this->inclusiveTime += other.inclusiveTime;
+        this->exclusiveTime += other.exclusiveTime;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            this->histogram[i] += other.histogram[i];
+        }
+    }
+};
+
+typedef std::unordered_map<uint64_t, FunctionStatistics> FunctionTable;
+
+struct CallTreeNode
+{
+    uint64_t functionId;
+    uint32_t parent;
+    uint64_t callCount;
+    uint64_t inclusiveTime;
+    uint64_t exclusiveTime;
+};
+
+struct ChildKey
+{
+    uint32_t parent;
+    uint64_t functionId;
+
+    bool operator==(const ChildKey& other) const
+    {
+        return this->parent == other.parent && this->functionId == other.functionId;
+    }
+};
+
+struct ChildKeyHash
+{
+    size_t operator()(const ChildKey& key) const
+    {
+        return std::hash<uint64_t>()(key.functionId * 0x9E3779B97F4A7C15ULL ^ key.parent);
+    }
+};
+
+// Node 0 is the root. Parents are always created before their children, so
+// walking the nodes in index order visits every path top-down.
+class CallTree
+{
+private:
+    std::unordered_map<ChildKey, uint32_t, ChildKeyHash> children;
+public:
+    std::vector<CallTreeNode> nodes;
+
+    CallTree()
+    {
+        this->nodes.push_back({ 0, 0, 0, 0, 0 });
+    }
+
+    uint32_t GetChild(uint32_t parent, uint64_t functionId)
+    {
+        auto inserted = this->children.insert({ { parent, functionId }, (uint32_t)this->nodes.size() });
+        if (inserted.second)
+        {
+            this->nodes.push_back({ functionId, parent, 0, 0, 0 });
+        }
+
+        return inserted.first->second;
+    }
+
+    void Merge(const CallTree& other)
+    {
+        std::vector<uint32_t> mapping(other.nodes.size(), 0);
+
+        for (size_t i = 1; i < other.nodes.size(); i++)
+        {
+            const CallTreeNode& source = other.nodes[i];
+            uint32_t target = this->GetChild(mapping[source.parent], source.functionId);
+            mapping[i] = target;
+
+            this->nodes[target].callCount += source.callCount;
+            this->nodes[target].inclusiveTime += source.inclusiveTime;
+            this->nodes[target].exclusiveTime += source.exclusiveTime;
+        }
+    }
+};
+
+struct ThreadPartition
+{
+    std::vector<TraceRecord> records;
+    uint64_t recordCount;
+};
+
+struct TraceBlock
+{
+    const TraceBlockHeader* header;
+    ThreadPartition* partition;
+    uint64_t firstRecord;       // where the block's events go in partition->records
+};
+
+struct ThreadResult
+{
+    FunctionTable functions;
+    CallTree callTree;
+    uint64_t unmatchedLeaves;
+};
+
+struct Frame
+{
+    uint64_t functionId;
+    uint32_t node;
+    uint64_t startTime;
+    uint64_t childTime;
+};
+
+static int Log2Bucket(uint64_t value)
+{
+    int bucket = 0;
+    while (value > 1 && bucket < HISTOGRAM_BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+// Runs work(i) for every i in [0, count) on up to workerCount threads.
+template <typename Work>
+static void RunParallel(size_t count, unsigned workerCount, Work work)
+{
+    std::atomic<size_t> nextItem(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned i = 0; i < std::min<size_t>(workerCount, count); i++)
+    {
+        workers.emplace_back([&]() {
+            size_t item;
+            while ((item = nextItem.fetch_add(1)) < count)
+            {
+                work(item);
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+static bool DecodeBlock(const TraceBlock& block, std::vector<uint8_t>& scratch)
+{
+    const TraceBlockHeader* header = block.header;
+    const uint8_t* current = reinterpret_cast<const uint8_t*>(header + 1);
+    const uint8_t* end = current + header->storedSize;
+
+    if (header->flags & TRACE_BLOCK_LZ4)
+    {
+#ifdef TRACE_LZ4
+        scratch.resize(header->encodedSize);
+        int decodedSize = LZ4_decompress_safe(reinterpret_cast<const char*>(current), reinterpret_cast<char*>(scratch.data()), header->storedSize, header->encodedSize);
+        if (decodedSize != (int)header->encodedSize)
+        {
+            return false;
+        }
+
+        current = scratch.data();
+        end = current + header->encodedSize;
+#else
+        (void)scratch;
+        return false;
+#endif
+    }
+
+    std::vector<uint64_t> dictionary(header->dictionarySize);
+    uint64_t previousEntry = 0;
+    uint64_t value;
+
+    for (uint32_t i = 0; i < header->dictionarySize; i++)
+    {
+        if ((current = TraceReadVarint(current, end, value)) == nullptr)
+        {
+            return false;
+        }
+
+        previousEntry += TraceUnZigZag(value);
+        dictionary[i] = previousEntry;
+    }
+
+    TraceRecord* records = &block.partition->records[block.firstRecord];
+    uint64_t timestamp = header->baseTimestamp;
+
+    for (uint32_t i = 0; i < header->recordCount; i++)
+    {
+        if ((current = TraceReadVarint(current, end, value)) == nullptr || (value >> 1) >= dictionary.size())
+        {
+            return false;
+        }
+
+        records[i].functionId = dictionary[value >> 1];
+        unsigned kind = (unsigned)(value & 1);
+
+        if ((current = TraceReadVarint(current, end, value)) == nullptr)
+        {
+            return false;
+        }
+
+        timestamp += TraceUnZigZag(value);
+        records[i].timestampAndKind = (timestamp << 1) | kind;
+    }
+
+    return true;
+}
+
+static void AnalyzeThread(const ThreadPartition& partition, ThreadResult& result)
+{
+    std::vector<Frame> stack;
+    result.unmatchedLeaves = 0;
+
+    for (const TraceRecord& record : partition.records)
+    {
+        uint64_t timestamp = record.Timestamp();
+
+        if (record.Kind() == TRACE_EVENT_ENTER)
+        {
+            uint32_t parent = stack.empty() ? 0 : stack.back().node;
+            stack.push_back({ record.functionId, result.callTree.GetChild(parent, record.functionId), timestamp, 0 });
+            continue;
+        }
+
+        // Same matching rules as the live statistics: frames above the
+        // matching one were unwound by an exception.
+        size_t depth = stack.size();
+        while (depth > 0 && stack[depth - 1].functionId != record.functionId)
+        {
+            depth--;
+        }
+
+        if (depth == 0)
+        {
+            result.unmatchedLeaves++;
+            continue;
+        }
+
+        Frame frame = stack[depth - 1];
+        stack.resize(depth - 1);
+
+        uint64_t elapsed = timestamp - frame.startTime;
+        uint64_t exclusive = elapsed - std::min(elapsed, frame.childTime);
+        if (!stack.empty())
+        {
+            stack.back().childTime += elapsed;
+        }
+
+        FunctionStatistics& function = result.functions[record.functionId];
+        function.callCount++;
+        function.inclusiveTime += elapsed;
+        function.exclusiveTime += exclusive;
+        function.histogram[Log2Bucket(elapsed)]++;
+
+        CallTreeNode& node = result.callTree.nodes[frame.node];
+        node.callCount++;
+        node.inclusiveTime += elapsed;
+        node.exclusiveTime += exclusive;
+    }
+}
+
+static std::unordered_map<uint64_t, std::string> LoadSymbols(const std::string& path)
+{
+    std::unordered_map<uint64_t, std::string> symbols;
+
+    MappedFile file;
+    if (!file.Open(path.c_str()))
+    {
+        fprintf(stderr, "warning: could not read symbols from %s\n", path.c_str());
+        return symbols;
+    }
+
+    const char* current = reinterpret_cast<const char*>(file.data);
+    const char* end = current + file.size;
+
+    while (current < end)
+    {
+        const char* lineEnd = static_cast<const char*>(memchr(current, '\n', end - current));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+
+        const char* tab = static_cast<const char*>(memchr(current, '\t', lineEnd - current));
+        if (tab != nullptr)
+        {
+            uint64_t functionId = strtoull(current, nullptr, 16);
+            symbols[functionId] = std::string(tab + 1, lineEnd);
+        }
+
+        current = lineEnd + 1;
+    }
+
+    return symbols;
+}
+
+static std::string GetName(const std::unordered_map<uint64_t, std::string>& symbols, uint64_t functionId)
+{
+    auto found = symbols.find(functionId);
+    if (found != symbols.end())
+    {
+        return found->second;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "0x%llx", (unsigned long long)functionId);
+    return name;
+}
+
+static void PrintUsage(const char* program)
+{
+    fprintf(stderr,
+        "usage: %s <trace file> [options]\n"
+        "  --symbols <file>     symbol table (default: <trace file>.symbols)\n"
+        "  --top <count>        functions to list, by exclusive time (default: 20)\n"
+        "  --histograms <count> print duration histograms of the top functions (default: 0)\n"
+        "  --folded <file>      write folded stacks, weighted by exclusive nanoseconds\n"
+        "  --threads <count>    worker threads (default: all cores)\n",
+        program);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        PrintUsage(argv[0]);
+        return 2;
+    }
+
+    std::string tracePath = argv[1];
+    std::string symbolsPath = tracePath + ".symbols";
+    std::string foldedPath;
+    size_t topCount = 20;
+    size_t histogramCount = 0;
+    unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string option = argv[i];
+        if (i + 1 >= argc)
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+
+        const char* value = argv[++i];
+        if (option == "--symbols")
+        {
+            symbolsPath = value;
+        }
+        else if (option == "--top")
+        {
+            topCount = strtoul(value, nullptr, 10);
+        }
+        else if (option == "--histograms")
+        {
+            histogramCount = strtoul(value, nullptr, 10);
+        }
+        else if (option == "--folded")
+        {
+            foldedPath = value;
+        }
+        else if (option == "--threads")
+        {
+            workerCount = std::max(1ul, strtoul(value, nullptr, 10));
+        }
+        else
+        {
+            PrintUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Symbols are only needed for the output, so parse them in the background.
+    std::future<std::unordered_map<uint64_t, std::string>> symbolsLoaded = std::async(std::launch::async, LoadSymbols, symbolsPath);
+
+    MappedFile trace;
+    if (!trace.Open(tracePath.c_str()))
+    {
+        fprintf(stderr, "error: could not map %s\n", tracePath.c_str());
+        return 1;
+    }
+
+    const TraceFileHeader* header = reinterpret_cast<const TraceFileHeader*>(trace.data);
+    if (trace.size < sizeof(TraceFileHeader) || header->magic != TRACE_FILE_MAGIC || header->version != TRACE_FILE_VERSION)
+    {
+        fprintf(stderr, "error: %s is not a version %d trace\n", tracePath.c_str(), TRACE_FILE_VERSION);
+        return 1;
+    }
+
+    // Partition the blocks by thread. Only the block headers are touched here.
+    std::vector<ThreadPartition> partitions;
+    std::vector<TraceBlock> blocks;
+    uint64_t totalRecords = 0;
+    size_t offset = header->headerSize;
+
+    while (offset + sizeof(TraceBlockHeader) <= trace.size)
+    {
+        const TraceBlockHeader* block = reinterpret_cast<const TraceBlockHeader*>(trace.data + offset);
+        size_t blockSize = sizeof(TraceBlockHeader) + block->storedSize;
+
+        if (offset + blockSize > trace.size)
+        {
+            fprintf(stderr, "warning: trace is truncated at offset %zu\n", offset);
+            break;
+        }
+
+#ifndef TRACE_LZ4
+        if (block->flags & TRACE_BLOCK_LZ4)
+        {
+            fprintf(stderr, "error: %s is LZ4 compressed; rebuild with UseLZ4=1\n", tracePath.c_str());
+            return 1;
+        }
+#endif
+
+        if (block->threadIndex >= partitions.size())
+        {
+            partitions.resize(block->threadIndex + 1);
+        }
+
+        blocks.push_back({ block, nullptr, partitions[block->threadIndex].recordCount });
+        partitions[block->threadIndex].recordCount += block->recordCount;
+        totalRecords += block->recordCount;
+
+        offset += blockSize;
+    }
+
+    for (TraceBlock& block : blocks)
+    {
+        block.partition = &partitions[block.header->threadIndex];
+    }
+
+    for (ThreadPartition& partition : partitions)
+    {
+        partition.records.resize(partition.recordCount);
+    }
+
+    // Blocks are self-contained, so they are decoded in parallel regardless of
+    // which thread they belong to.
+    std::atomic<bool> decodeFailed(false);
+    RunParallel(blocks.size(), workerCount, [&](size_t index) {
+        static thread_local std::vector<uint8_t> scratch;
+        if (!DecodeBlock(blocks[index], scratch))
+        {
+            decodeFailed = true;
+        }
+    });
+
+    if (decodeFailed)
+    {
+        fprintf(stderr, "error: %s contains corrupt blocks\n", tracePath.c_str());
+        return 1;
+    }
+
+    // Hand out the largest threads first so one big thread doesn't end up last.
+    std::vector<size_t> order(partitions.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](size_t left, size_t right) {
+        return partitions[left].recordCount > partitions[right].recordCount;
+    });
+
+    std::vector<ThreadResult> results(partitions.size());
+    RunParallel(order.size(), workerCount, [&](size_t index) {
+        AnalyzeThread(partitions[order[index]], results[order[index]]);
+    });
+
+    FunctionTable functions;
+    CallTree callTree;
+    uint64_t unmatchedLeaves = 0;
+
+    for (ThreadResult& result : results)
+    {
+        for (auto& entry : result.functions)
+        {
+            functions[entry.first].Add(entry.second);
+        }
+
+        callTree.Merge(result.callTree);
+        unmatchedLeaves += result.unmatchedLeaves;
+    }
+
+    std::unordered_map<uint64_t, std::string> symbols = symbolsLoaded.get();
+
+    printf("%llu events from %zu threads, %zu functions, %llu unmatched leaves\n\n",
+        (unsigned long long)totalRecords, partitions.size(), functions.size(), (unsigned long long)unmatchedLeaves);
+
+    std::vector<std::pair<uint64_t, const FunctionStatistics*>> sorted;
+    for (auto& entry : functions)
+    {
+        sorted.push_back({ entry.first, &entry.second });
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, const FunctionStatistics*>& left, const std::pair<uint64_t, const FunctionStatistics*>& right) {
+        return left.second->exclusiveTime > right.second->exclusiveTime;
+    });
+
+    printf("%14s %14s %14s %12s  %s\n", "calls", "exclusive ms", "inclusive ms", "avg incl us", "function");
+    for (size_t i = 0; i < sorted.size() && i < topCount; i++)
+    {
+        const FunctionStatistics& function = *sorted[i].second;
+        printf("%14llu %14.3f %14.3f %12.3f  %s\n", (unsigned long long)function.callCount,
+            function.exclusiveTime / 1e6, function.inclusiveTime / 1e6,
+            function.callCount != 0 ? function.inclusiveTime / 1e3 / function.callCount : 0.0,
+            GetName(symbols, sorted[i].first).c_str());
+    }
+
+    for (size_t i = 0; i < sorted.size() && i < histogramCount; i++)
+    {
+        const FunctionStatistics& function = *sorted[i].second;
+        uint64_t largest = *std::max_element(function.histogram, function.histogram + HISTOGRAM_BUCKETS);
+
+        printf("\n%s\n", GetName(symbols, sorted[i].first).c_str());
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        {
+            if (function.histogram[bucket] == 0)
+            {
+                continue;
+            }
+
+            int width = largest != 0 ? (int)(function.histogram[bucket] * 50 / largest) : 0;
+            printf("  >= %12llu ns %12llu %s\n", 1ULL << bucket, (unsigned long long)function.histogram[bucket], std::string(width, '#').c_str());
+        }
+    }
+
+    if (!foldedPath.empty())
+    {
+        FILE* folded = fopen(foldedPath.c_str(), "w");
+        if (folded == nullptr)
+        {
+            fprintf(stderr, "error: could not create %s\n", foldedPath.c_str());
+            return 1;
+        }
+
+        std::vector<std::string> paths(callTree.nodes.size());
+        for (size_t i = 1; i < callTree.nodes.size(); i++)
+        {
+            const CallTreeNode& node = callTree.nodes[i];
+            std::string name = GetName(symbols, node.functionId);
+            std::replace(name.begin(), name.end(), ';', ':');
+
+            paths[i] = node.parent == 0 ? name : paths[node.parent] + ";" + name;
+
+            if (node.exclusiveTime != 0)
+            {
+                fprintf(folded, "%s %llu\n", paths[i].c_str(), (unsigned long long)node.exclusiveTime);
+            }
+        }
+
+        fclose(folded);
+    }
+
+    return 0;
+}
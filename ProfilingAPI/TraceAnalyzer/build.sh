@@ -0,0 +1,12 @@
+#!/bin/sh
+
+[ -z "${Output:-}"  ] && Output=TraceAnalyzer
+[ -z "${UseLZ4:-}"  ] && UseLZ4=0
+
+[ "$UseLZ4" = "1" ] && LZ4_FLAGS="-DTRACE_LZ4 -llz4"
+
+printf '  Building %s ... ' "$Output"
+
+clang++ -o $Output -O2 -std=c++11 -pthread TraceAnalyzer.cpp $LZ4_FLAGS
+
+printf 'Done.\n'